@@ -0,0 +1,302 @@
+#include "BuddyPool.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <assert.h>
+
+BuddyPool::BuddyPool( uint64_t size )
+    : _poolSize( size ),
+      _treeSize( nextPowerOfTwo( std::max( size, MIN_BLOCK_SIZE ) ) ),
+      _freeLevels( 0 ),
+      _freeSpace( 0 ),
+      _freeBlockCount( 0 ),
+      _usedBlockCount( 0 )
+{
+   const uint64_t minBlockSize = std::max( MIN_BLOCK_SIZE, _treeSize >> ( MAX_LEVEL_COUNT - 1 ) );
+   _levelCount = mostSignificantBit( _treeSize ) - mostSignificantBit( minBlockSize ) + 1;
+
+   const uint32_t nodeCount = ( 1u << _levelCount ) - 1;
+   _freeLists.resize( _levelCount, NULL_NODE );
+   _nextFree.resize( nodeCount, NULL_NODE );
+   _prevFree.resize( nodeCount, NULL_NODE );
+   _freeBits.resize( ( nodeCount + 63 ) / 64, 0 );
+   _splitBits.resize( ( nodeCount + 63 ) / 64, 0 );
+
+   // Free every block fully inside the pool, starting from the root.
+   initNode( 0, size );
+}
+
+uint32_t BuddyPool::nodeLevel( uint32_t node )
+{
+   return mostSignificantBit( node + 1 );
+}
+
+bool BuddyPool::testBit( const std::vector<uint64_t>& bitmap, uint32_t node ) const
+{
+   return ( bitmap[ node / 64 ] >> ( node % 64 ) ) & 1;
+}
+
+void BuddyPool::setBit( std::vector<uint64_t>& bitmap, uint32_t node, bool value )
+{
+   if ( value )
+      bitmap[ node / 64 ] |= 1ull << ( node % 64 );
+   else
+      bitmap[ node / 64 ] &= ~( 1ull << ( node % 64 ) );
+}
+
+void BuddyPool::initNode( uint32_t node, uint64_t poolSize )
+{
+   const uint32_t level = nodeLevel( node );
+   const uint64_t nodeOffset = offset( node );
+
+   // Past the end of the pool. Stays used forever.
+   if ( nodeOffset >= poolSize )
+      return;
+
+   if ( nodeOffset + blockSize( level ) <= poolSize )
+   {
+      pushFree( node, level );
+      _freeSpace += blockSize( level );
+      return;
+   }
+
+   // Partially outside of the pool and cannot be split further. Also stays used.
+   if ( level + 1 == _levelCount )
+      return;
+
+   setBit( _splitBits, node, true );
+   initNode( 2 * node + 1, poolSize );
+   initNode( 2 * node + 2, poolSize );
+}
+
+void BuddyPool::pushFree( uint32_t node, uint32_t level )
+{
+   const uint32_t head = _freeLists[ level ];
+   _prevFree[ node ] = NULL_NODE;
+   _nextFree[ node ] = head;
+   if ( head != NULL_NODE )
+   {
+      _prevFree[ head ] = node;
+   }
+   _freeLists[ level ] = node;
+   _freeLevels |= 1ull << level;
+   setBit( _freeBits, node, true );
+   ++_freeBlockCount;
+}
+
+void BuddyPool::removeFree( uint32_t node, uint32_t level )
+{
+   assert( testBit( _freeBits, node ) );
+   if ( _prevFree[ node ] != NULL_NODE )
+   {
+      _nextFree[ _prevFree[ node ] ] = _nextFree[ node ];
+   }
+   else
+   {
+      _freeLists[ level ] = _nextFree[ node ];
+      if ( _freeLists[ level ] == NULL_NODE )
+      {
+         _freeLevels &= ~( 1ull << level );
+      }
+   }
+   if ( _nextFree[ node ] != NULL_NODE )
+   {
+      _prevFree[ _nextFree[ node ] ] = _prevFree[ node ];
+   }
+   setBit( _freeBits, node, false );
+   --_freeBlockCount;
+}
+
+BuddyPool::Handle BuddyPool::alloc( uint64_t size, uint64_t alignment )
+{
+   assert( size > 0 );
+
+   // Blocks are aligned on their size, so the alignment only needs the block to be big enough.
+   const uint64_t minBlockSize = blockSize( _levelCount - 1 );
+   const uint64_t requestedSize = nextPowerOfTwo( std::max( size, alignment ) );
+   if ( requestedSize > _treeSize )
+   {
+      return INVALID_HANDLE;
+   }
+
+   const uint32_t targetLevel =
+      mostSignificantBit( _treeSize ) -
+      mostSignificantBit( std::max( requestedSize, minBlockSize ) );
+
+   // Take the smallest free block that is big enough, which is the one on the deepest level.
+   const uint64_t candidateLevels = _freeLevels & ( ( 2ull << targetLevel ) - 1 );
+   if ( !candidateLevels )
+   {
+      // Out of space, cannot allocate.
+      return INVALID_HANDLE;
+   }
+
+   uint32_t level = mostSignificantBit( candidateLevels );
+   uint32_t node = _freeLists[ level ];
+   removeFree( node, level );
+
+   // Split it until we get to the requested size. The right buddies become free.
+   for ( ; level < targetLevel; ++level )
+   {
+      setBit( _splitBits, node, true );
+      pushFree( 2 * node + 2, level + 1 );
+      node = 2 * node + 1;
+   }
+
+   _freeSpace -= blockSize( targetLevel );
+   ++_usedBlockCount;
+
+   return node;
+}
+
+void BuddyPool::free( Handle handle )
+{
+   uint32_t node = handle;
+   uint32_t level = nodeLevel( node );
+
+   // Already freed block or not an allocation
+   assert( !testBit( _freeBits, node ) && !testBit( _splitBits, node ) );
+
+   _freeSpace += blockSize( level );
+   --_usedBlockCount;
+
+   // Merge with the buddy for as long as it is free
+   for ( ; level > 0; --level )
+   {
+      const uint32_t buddy = ( node & 1 ) ? node + 1 : node - 1;
+      if ( !testBit( _freeBits, buddy ) )
+         break;
+
+      removeFree( buddy, level );
+      node = ( node - 1 ) / 2;
+      setBit( _splitBits, node, false );
+   }
+
+   pushFree( node, level );
+}
+
+bool BuddyPool::tryGrow( Handle& handle, uint64_t newSize )
+{
+   assert( !testBit( _freeBits, handle ) && !testBit( _splitBits, handle ) );
+   const uint64_t requestedSize = nextPowerOfTwo( newSize );
+   if ( requestedSize > _treeSize )
+   {
+      return false;
+   }
+
+   // Check first that every buddy we need is free. A block can only grow in place if it
+   // is the left buddy, the parent block starting at the same offset.
+   uint32_t node = handle;
+   uint32_t level = nodeLevel( node );
+   for ( ; blockSize( level ) < requestedSize; --level )
+   {
+      if ( !( node & 1 ) || !testBit( _freeBits, node + 1 ) )
+      {
+         return false;
+      }
+      node = ( node - 1 ) / 2;
+   }
+
+   node = handle;
+   level = nodeLevel( node );
+   for ( ; blockSize( level ) < requestedSize; --level )
+   {
+      removeFree( node + 1, level );
+      _freeSpace -= blockSize( level );
+      node = ( node - 1 ) / 2;
+      setBit( _splitBits, node, false );
+   }
+
+   handle = node;
+   return true;
+}
+
+void BuddyPool::shrink( Handle& handle, uint64_t newSize )
+{
+   assert( !testBit( _freeBits, handle ) && !testBit( _splitBits, handle ) );
+   assert( newSize > 0 && newSize <= size( handle ) );
+
+   // Split in two while the left half is big enough. The right buddies become free.
+   const uint64_t requestedSize = nextPowerOfTwo( newSize );
+   uint32_t node = handle;
+   for ( uint32_t level = nodeLevel( node );
+         level + 1 < _levelCount && blockSize( level + 1 ) >= requestedSize; ++level )
+   {
+      setBit( _splitBits, node, true );
+      pushFree( 2 * node + 2, level + 1 );
+      _freeSpace += blockSize( level + 1 );
+      node = 2 * node + 1;
+   }
+
+   handle = node;
+}
+
+uint64_t BuddyPool::offset( Handle handle ) const
+{
+   const uint32_t level = nodeLevel( handle );
+   return ( handle + 1 - ( 1ull << level ) ) * blockSize( level );
+}
+
+uint64_t BuddyPool::largestFreeBlock() const
+{
+   // Free blocks are always fully inside the pool, the lowest free level has the biggest ones.
+   return _freeLevels ? blockSize( countTrailingZeros( _freeLevels ) ) : 0;
+}
+
+bool BuddyPool::_debugIsConform() const
+{
+   bool isConform = true;
+
+   // Every node of a free list must be flagged free and be on the right level.
+   // Two free buddies should have been merged.
+   size_t listedNodes = 0;
+   for ( uint32_t level = 0; level < _levelCount; ++level )
+   {
+      isConform &= ( _freeLists[ level ] == NULL_NODE ) == !( _freeLevels & ( 1ull << level ) );
+      for ( uint32_t node = _freeLists[ level ]; node != NULL_NODE; node = _nextFree[ node ] )
+      {
+         isConform &= testBit( _freeBits, node ) && !testBit( _splitBits, node );
+         isConform &= nodeLevel( node ) == level;
+         if ( level > 0 )
+         {
+            const uint32_t buddy = ( node & 1 ) ? node + 1 : node - 1;
+            isConform &= !testBit( _freeBits, buddy );
+         }
+         ++listedNodes;
+      }
+      assert( isConform );
+   }
+
+   size_t freeNodes = 0;
+   for ( uint64_t bits : _freeBits )
+   {
+      for ( ; bits; bits &= bits - 1 )
+         ++freeNodes;
+   }
+   isConform &= freeNodes == listedNodes && freeNodes == _freeBlockCount;
+   assert( isConform );
+
+   return isConform;
+}
+
+void BuddyPool::debugChunks( uint32_t node, std::vector<Chunk>& chunks ) const
+{
+   if ( testBit( _splitBits, node ) )
+   {
+      debugChunks( 2 * node + 1, chunks );
+      debugChunks( 2 * node + 2, chunks );
+      return;
+   }
+
+   // Only report the part of the block inside the pool
+   const uint64_t nodeOffset = offset( node );
+   if ( nodeOffset < _poolSize )
+   {
+      const uint64_t size = std::min( blockSize( nodeLevel( node ) ), _poolSize - nodeOffset );
+      chunks.push_back( Chunk{nodeOffset, size, testBit( _freeBits, node )} );
+   }
+}
+
+void BuddyPool::_debugChunks( std::vector<Chunk>& chunks ) const
+{
+   debugChunks( 0, chunks );
+}
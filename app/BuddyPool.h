@@ -0,0 +1,71 @@
+#ifndef BUDDY_POOL_H_
+#define BUDDY_POOL_H_
+
+#include "MemoryPoolBackend.h"
+#include <vector>
+#include <inttypes.h>
+#include <limits>
+
+// Binary buddy allocator. The pool is seen as a complete binary tree of power
+// of two blocks, a block being naturally aligned on its size. Blocks are split
+// in two buddies until they fit a request and merged back with their buddy
+// when both are free. Alloc and free are O(log n).
+//
+// Node state is tracked in two bitmaps: whether a node is split, and whether
+// it is free (and thus in the free list of its level). If the pool size is
+// not a power of two, the blocks past the end of the pool are never freed.
+class BuddyPool : public MemoryPoolBackend
+{
+  public:
+   // Smallest block handed out. Requests are rounded to a power of two of at least this size.
+   static constexpr uint64_t MIN_BLOCK_SIZE = 256;
+
+   BuddyPool( uint64_t size );
+   Handle alloc( uint64_t size, uint64_t alignment ) override;
+   void free( Handle handle ) override;
+   uint64_t offset( Handle handle ) const override;
+   uint64_t size( Handle handle ) const override { return blockSize( nodeLevel( handle ) ); }
+   // Merges the block with its right buddies, or splits it keeping the left half. The
+   // handle changes but the offset stays the same.
+   bool tryGrow( Handle& handle, uint64_t newSize ) override;
+   void shrink( Handle& handle, uint64_t newSize ) override;
+   uint64_t spaceLeft() const override { return _freeSpace; }
+   uint64_t largestFreeBlock() const override;
+   uint32_t chunkCount() const override { return _freeBlockCount + _usedBlockCount; }
+   uint32_t freeChunkCount() const override { return _freeBlockCount; }
+
+   bool _debugIsConform() const override;
+   void _debugChunks( std::vector<Chunk>& chunks ) const override;
+
+  private:
+   // Limits the size of the tree. The smallest block size grows with the pool instead.
+   static constexpr uint32_t MAX_LEVEL_COUNT = 17;
+   static constexpr uint32_t NULL_NODE = std::numeric_limits<uint32_t>::max();
+
+   static uint32_t nodeLevel( uint32_t node );
+   uint64_t blockSize( uint32_t level ) const { return _treeSize >> level; }
+   bool testBit( const std::vector<uint64_t>& bitmap, uint32_t node ) const;
+   void setBit( std::vector<uint64_t>& bitmap, uint32_t node, bool value );
+
+   void initNode( uint32_t node, uint64_t poolSize );
+   void pushFree( uint32_t node, uint32_t level );
+   void removeFree( uint32_t node, uint32_t level );
+   void debugChunks( uint32_t node, std::vector<Chunk>& chunks ) const;
+
+   const uint64_t _poolSize;
+   uint64_t _treeSize;
+   uint32_t _levelCount;
+   // Bit N set if level N free list is not empty
+   uint64_t _freeLevels;
+   std::vector<uint32_t> _freeLists;
+   std::vector<uint32_t> _nextFree;
+   std::vector<uint32_t> _prevFree;
+   std::vector<uint64_t> _freeBits;
+   std::vector<uint64_t> _splitBits;
+   uint64_t _freeSpace;
+   uint32_t _freeBlockCount;
+   // Allocated blocks. The blocks past the end of the pool are not counted.
+   uint32_t _usedBlockCount;
+};
+
+#endif  // BUDDY_POOL_H_
@@ -0,0 +1,89 @@
+#include "ChunkList.h"
+
+ChunkList::ChunkList( uint64_t poolSize, uint64_t reservedChunks )
+    : _firstUnused( NULL_CHUNK ), _chunkCount( 0 )
+{
+   do
+   {
+      addPage();
+   } while ( _pages.size() * PAGE_SIZE < reservedChunks );
+
+   _first = createChunk();
+   ( *this )[ _first ] = Chunk{0, poolSize, NULL_CHUNK, NULL_CHUNK, NULL_CHUNK, NULL_CHUNK, true};
+}
+
+ChunkList::Handle ChunkList::split( Handle handle, uint64_t size )
+{
+   assert( size < ( *this )[ handle ].size );
+
+   const Handle newHandle = createChunk();
+   Chunk& chunk = ( *this )[ handle ];
+   Chunk& newChunk = ( *this )[ newHandle ];
+
+   chunk.size -= size;
+   newChunk.offset = chunk.offset + chunk.size;
+   newChunk.size = size;
+   newChunk.prev = handle;
+   newChunk.next = chunk.next;
+   newChunk.prevFree = NULL_CHUNK;
+   newChunk.nextFree = NULL_CHUNK;
+   newChunk.isFree = chunk.isFree;
+   if ( chunk.next != NULL_CHUNK )
+   {
+      ( *this )[ chunk.next ].prev = newHandle;
+   }
+   chunk.next = newHandle;
+
+   return newHandle;
+}
+
+void ChunkList::mergeNext( Handle handle )
+{
+   Chunk& chunk = ( *this )[ handle ];
+   const Handle nextHandle = chunk.next;
+   assert( nextHandle != NULL_CHUNK );
+
+   const Chunk& next = ( *this )[ nextHandle ];
+   chunk.size += next.size;
+   chunk.next = next.next;
+   if ( next.next != NULL_CHUNK )
+   {
+      ( *this )[ next.next ].prev = handle;
+   }
+
+   destroyChunk( nextHandle );
+}
+
+ChunkList::Handle ChunkList::createChunk()
+{
+   if ( _firstUnused == NULL_CHUNK )
+   {
+      addPage();
+   }
+
+   const Handle handle = _firstUnused;
+   _firstUnused = ( *this )[ handle ].nextFree;
+   ++_chunkCount;
+   return handle;
+}
+
+void ChunkList::destroyChunk( Handle handle )
+{
+   ( *this )[ handle ].nextFree = _firstUnused;
+   _firstUnused = handle;
+   --_chunkCount;
+}
+
+void ChunkList::addPage()
+{
+   const Handle firstHandle = static_cast<Handle>( _pages.size() * PAGE_SIZE );
+   _pages.emplace_back( new Chunk[ PAGE_SIZE ] );
+
+   // Chain the new slots in front of the unused ones.
+   Chunk* page = _pages.back().get();
+   for ( uint32_t i = 0; i < PAGE_SIZE; ++i )
+   {
+      page[ i ].nextFree = i + 1 < PAGE_SIZE ? firstHandle + i + 1 : _firstUnused;
+   }
+   _firstUnused = firstHandle;
+}
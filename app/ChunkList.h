@@ -0,0 +1,73 @@
+#ifndef CHUNK_LIST_H_
+#define CHUNK_LIST_H_
+
+#include <vector>
+#include <memory>
+#include <inttypes.h>
+#include <limits>
+#include <assert.h>
+
+// Address ordered, doubly linked list of the chunks of a pool. Chunks live in a
+// paged slot array and are referred to by their slot index, so splitting or
+// merging never moves other chunks around and a handle stays valid for the
+// lifetime of its chunk. Growing the list only allocates a new page.
+class ChunkList
+{
+  public:
+   using Handle = uint32_t;
+   static constexpr Handle NULL_CHUNK = std::numeric_limits<uint32_t>::max();
+
+   struct Chunk
+   {
+      uint64_t offset;
+      uint64_t size;
+      // Neighbours in memory
+      Handle prev;
+      Handle next;
+      // Neighbours in a free list, for backends that keep some. Unused slots
+      // are also chained through nextFree.
+      Handle prevFree;
+      Handle nextFree;
+      bool isFree;
+   };
+
+   // Creates the list with a single free chunk covering the whole pool.
+   ChunkList( uint64_t poolSize, uint64_t reservedChunks );
+
+   Chunk& operator[]( Handle handle )
+   {
+      assert( handle != NULL_CHUNK );
+      return _pages[ handle >> PAGE_SIZE_LOG2 ][ handle & PAGE_MASK ];
+   }
+   const Chunk& operator[]( Handle handle ) const
+   {
+      assert( handle != NULL_CHUNK );
+      return _pages[ handle >> PAGE_SIZE_LOG2 ][ handle & PAGE_MASK ];
+   }
+
+   // The first chunk is never removed. It always starts at offset 0.
+   Handle first() const { return _first; }
+
+   // Takes the last 'size' bytes of 'handle' to create a new chunk right after it.
+   Handle split( Handle handle, uint64_t size );
+   // Merges 'handle' with the chunk after it. The next chunk handle becomes invalid.
+   void mergeNext( Handle handle );
+
+   size_t chunkCount() const { return _chunkCount; }
+
+  private:
+   static constexpr uint32_t PAGE_SIZE_LOG2 = 8;
+   static constexpr uint32_t PAGE_SIZE = 1 << PAGE_SIZE_LOG2;
+   static constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+
+   Handle createChunk();
+   void destroyChunk( Handle handle );
+   void addPage();
+
+   std::vector<std::unique_ptr<Chunk[]> > _pages;
+   Handle _first;
+   Handle _firstUnused;
+   size_t _chunkCount;
+};
+
+#endif  // CHUNK_LIST_H_
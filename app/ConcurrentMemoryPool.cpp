@@ -0,0 +1,227 @@
+#include "ConcurrentMemoryPool.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+// Gives each living thread its own cache slot. The slot is released when the
+// thread exits, the mutex making the cache content visible to its next owner.
+class CacheSlot
+{
+  public:
+   CacheSlot()
+   {
+      std::lock_guard<std::mutex> lock( mutex() );
+      std::vector<uint32_t>& released = releasedSlots();
+      if ( !released.empty() )
+      {
+         _index = released.back();
+         released.pop_back();
+      }
+      else
+      {
+         _index = nextSlot()++;
+      }
+   }
+
+   ~CacheSlot()
+   {
+      std::lock_guard<std::mutex> lock( mutex() );
+      releasedSlots().push_back( _index );
+   }
+
+   uint32_t index() const { return _index; }
+
+  private:
+   static std::mutex& mutex()
+   {
+      static std::mutex slotMutex;
+      return slotMutex;
+   }
+   static std::vector<uint32_t>& releasedSlots()
+   {
+      static std::vector<uint32_t> slots;
+      return slots;
+   }
+   static uint32_t& nextSlot()
+   {
+      static uint32_t slot = 0;
+      return slot;
+   }
+
+   uint32_t _index;
+};
+
+uint32_t threadCacheSlot()
+{
+   thread_local CacheSlot slot;
+   return slot.index();
+}
+}
+
+ConcurrentMemoryPool::ConcurrentMemoryPool( uint64_t size,
+                                            uint64_t reservedChunks /*= 256*/,
+                                            MemoryPool::Backend backend /*= TLSF*/ )
+    : _pool( size, reservedChunks, backend )
+{
+}
+
+ConcurrentMemoryPool::~ConcurrentMemoryPool() = default;
+
+ConcurrentMemoryPool::ThreadCache* ConcurrentMemoryPool::threadCache()
+{
+   const uint32_t slot = threadCacheSlot();
+   if ( slot >= MAX_THREAD_CACHES )
+   {
+      return nullptr;
+   }
+
+   std::unique_ptr<ThreadCache>& cache = _caches[ slot ];
+   if ( !cache )
+   {
+      cache = std::make_unique<ThreadCache>();
+      for ( auto& magazine : cache->magazines )
+      {
+         magazine.count = 0;
+      }
+   }
+   return cache.get();
+}
+
+ConcurrentMemoryPool::Allocation ConcurrentMemoryPool::allocShared( uint64_t size,
+                                                                    uint64_t alignment,
+                                                                    uint32_t sizeTag )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   const Handle handle = _pool.alloc( size, alignment );
+   if ( handle == INVALID_HANDLE )
+   {
+      return Allocation{INVALID_HANDLE, 0};
+   }
+
+   assert( handle <= POOL_HANDLE_MASK );
+   return Allocation{handle | ( sizeTag << CLASS_SHIFT ), _pool.offset( handle )};
+}
+
+void ConcurrentMemoryPool::refill( Magazine& magazine, uint32_t sizeClass )
+{
+   // Only fill half of it, so the next frees do not have to drain it right away.
+   const uint64_t blockSize = classSize( sizeClass );
+   const Handle tag = ( sizeClass + 1 ) << CLASS_SHIFT;
+
+   std::lock_guard<std::mutex> lock( _mutex );
+   while ( magazine.count < MAGAZINE_SIZE / 2 )
+   {
+      // Blocks are aligned on their size, so they satisfy any smaller alignment.
+      const Handle handle = _pool.alloc( blockSize, blockSize );
+      if ( handle == INVALID_HANDLE )
+      {
+         break;
+      }
+      assert( handle <= POOL_HANDLE_MASK );
+      magazine.blocks[ magazine.count++ ] = Allocation{handle | tag, _pool.offset( handle )};
+   }
+}
+
+void ConcurrentMemoryPool::drain( Magazine& magazine, uint32_t count )
+{
+   assert( count <= magazine.count );
+
+   std::lock_guard<std::mutex> lock( _mutex );
+   for ( ; count > 0; --count )
+   {
+      _pool.free( magazine.blocks[ --magazine.count ].handle & POOL_HANDLE_MASK );
+   }
+}
+
+ConcurrentMemoryPool::Allocation ConcurrentMemoryPool::alloc( uint64_t size, uint64_t alignment )
+{
+   // Alignment needs to be a power of two.
+   assert( isPowerOfTwo( alignment ) );
+
+   const uint64_t blockSize = nextPowerOfTwo( std::max( {size, alignment, MIN_CACHED_SIZE} ) );
+   const uint32_t sizeClass = mostSignificantBit( blockSize ) - mostSignificantBit( MIN_CACHED_SIZE );
+   if ( sizeClass >= SIZE_CLASS_COUNT )
+   {
+      Allocation alloc = allocShared( size, alignment, 0 );
+      if ( alloc.handle == INVALID_HANDLE )
+      {
+         // Some space may be held by our own cache, give it back and retry.
+         flushThreadCache();
+         alloc = allocShared( size, alignment, 0 );
+      }
+      return alloc;
+   }
+
+   ThreadCache* cache = threadCache();
+   if ( !cache )
+   {
+      return allocShared( blockSize, blockSize, sizeClass + 1 );
+   }
+
+   Magazine& magazine = cache->magazines[ sizeClass ];
+   if ( magazine.count == 0 )
+   {
+      refill( magazine, sizeClass );
+      if ( magazine.count == 0 )
+      {
+         // Out of space, cannot allocate.
+         return Allocation{INVALID_HANDLE, 0};
+      }
+   }
+
+   return magazine.blocks[ --magazine.count ];
+}
+
+void ConcurrentMemoryPool::free( const Allocation& alloc )
+{
+   assert( alloc.handle != INVALID_HANDLE );
+
+   const uint32_t sizeTag = alloc.handle >> CLASS_SHIFT;
+   ThreadCache* cache = sizeTag ? threadCache() : nullptr;
+   if ( !cache )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      _pool.free( alloc.handle & POOL_HANDLE_MASK );
+      return;
+   }
+
+   // Blocks can be freed by another thread than the one that allocated them.
+   // They just end up in the cache of the freeing thread.
+   Magazine& magazine = cache->magazines[ sizeTag - 1 ];
+   if ( magazine.count == MAGAZINE_SIZE )
+   {
+      drain( magazine, MAGAZINE_SIZE / 2 );
+   }
+   magazine.blocks[ magazine.count++ ] = alloc;
+}
+
+void ConcurrentMemoryPool::flushThreadCache()
+{
+   ThreadCache* cache = threadCache();
+   if ( !cache )
+   {
+      return;
+   }
+
+   for ( auto& magazine : cache->magazines )
+   {
+      if ( magazine.count )
+      {
+         drain( magazine, magazine.count );
+      }
+   }
+}
+
+uint64_t ConcurrentMemoryPool::spaceLeft() const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   return _pool.spaceLeft();
+}
+
+bool ConcurrentMemoryPool::_debugIsConform() const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   return _pool._debugIsConform();
+}
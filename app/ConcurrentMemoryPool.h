@@ -0,0 +1,83 @@
+#ifndef CONCURRENT_MEMORY_POOL_H_
+#define CONCURRENT_MEMORY_POOL_H_
+
+#include "MemoryPool.h"
+#include <array>
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+
+// MemoryPool that can be used from several threads at once. Small requests are
+// rounded to a power of two size class and served from a per-thread cache of
+// pre-reserved blocks (a magazine per class), without any locking. The shared
+// pool is only locked when a magazine needs to be refilled or drained, and for
+// the allocations too big to be cached.
+//
+// Cache slots are owned by a thread for its lifetime and then reused by the
+// next thread created, so the blocks cached by a finished thread are not lost.
+class ConcurrentMemoryPool
+{
+  public:
+   using Handle = MemoryPool::Handle;
+   static constexpr Handle INVALID_HANDLE = MemoryPool::INVALID_HANDLE;
+
+   static constexpr uint64_t MIN_CACHED_SIZE = 256;
+   static constexpr uint32_t SIZE_CLASS_COUNT = 8;  // 256 bytes to 32 KB
+   static constexpr uint32_t MAGAZINE_SIZE = 32;
+   // Threads past this count always go through the shared pool.
+   static constexpr uint32_t MAX_THREAD_CACHES = 64;
+
+   struct Allocation
+   {
+      Handle handle;
+      uint64_t offset;
+   };
+
+   ConcurrentMemoryPool( uint64_t size,
+                         uint64_t reservedChunks = 256,
+                         MemoryPool::Backend backend = MemoryPool::Backend::TLSF );
+   ~ConcurrentMemoryPool();
+
+   // Returns INVALID_HANDLE as handle if the pool is out of space.
+   Allocation alloc( uint64_t size, uint64_t alignment );
+   void free( const Allocation& alloc );
+
+   // Gives the blocks cached by the calling thread back to the shared pool.
+   void flushThreadCache();
+
+   // The blocks sitting in the thread caches are counted as used.
+   uint64_t spaceLeft() const;
+   uint64_t totalPoolSize() const { return _pool.totalPoolSize(); }
+
+   bool _debugIsConform() const;
+
+  private:
+   // The size class + 1 is stored in the high bits of the handles. 0 is for
+   // the allocations made directly in the shared pool.
+   static constexpr uint32_t CLASS_SHIFT = 27;
+   static constexpr Handle POOL_HANDLE_MASK = ( 1u << CLASS_SHIFT ) - 1;
+
+   struct Magazine
+   {
+      uint32_t count;
+      Allocation blocks[ MAGAZINE_SIZE ];
+   };
+
+   struct alignas( 64 ) ThreadCache
+   {
+      Magazine magazines[ SIZE_CLASS_COUNT ];
+   };
+
+   static uint64_t classSize( uint32_t sizeClass ) { return MIN_CACHED_SIZE << sizeClass; }
+   ThreadCache* threadCache();
+   Allocation allocShared( uint64_t size, uint64_t alignment, uint32_t sizeTag );
+   void refill( Magazine& magazine, uint32_t sizeClass );
+   void drain( Magazine& magazine, uint32_t count );
+
+   mutable std::mutex _mutex;
+   MemoryPool _pool;
+   // Slot N is only ever touched by the thread owning cache slot N.
+   std::array<std::unique_ptr<ThreadCache>, MAX_THREAD_CACHES> _caches;
+};
+
+#endif  // CONCURRENT_MEMORY_POOL_H_
@@ -0,0 +1,182 @@
+#include "FirstFitPool.h"
+#include <assert.h>
+
+FirstFitPool::FirstFitPool( uint64_t size, uint64_t reservedChunks )
+    : _chunks( size, reservedChunks ), _freeSpace( size ), _freeChunkCount( 1 )
+{
+   assert( size <= MAX_SIZE );  // Something is probably wrong...
+}
+
+FirstFitPool::Handle FirstFitPool::alloc( uint64_t size, uint64_t alignment )
+{
+   // Get the first free chunk that can contains the requested allocation
+   const uint64_t alignmentMask = alignment - 1;
+   ChunkList::Handle handle = _chunks.first();
+   for ( ; handle != ChunkList::NULL_CHUNK; handle = _chunks[ handle ].next )
+   {
+      // Get padding requirement for chunk. Equivalent of : ceil( cur / align ) * align
+      // plus its size
+      const ChunkList::Chunk& chunk = _chunks[ handle ];
+      if ( chunk.isFree &&
+           chunk.size >= ( ( alignment - ( chunk.offset & alignmentMask ) ) & alignmentMask ) + size )
+      {
+         break;
+      }
+   }
+
+   if ( handle == ChunkList::NULL_CHUNK )
+   {
+      // Out of space, cannot allocate.
+      return INVALID_HANDLE;
+   }
+
+   ChunkList::Chunk& chunk = _chunks[ handle ];
+   const uint64_t alignmentPadding = ( alignment - ( chunk.offset & alignmentMask ) ) & alignmentMask;
+
+   // The free chunk becomes the new allocated chunk. The remaining space is
+   // splitted to create a new free chunk.
+   if ( alignmentPadding )
+   {
+      // The first chunk starts at 0, so it never needs padding.
+      ChunkList::Chunk& prevChunk = _chunks[ chunk.prev ];
+      // We give the alignment offset to the previous chunk
+      prevChunk.size += alignmentPadding;
+      // We thus need to update current chunk offset
+      chunk.offset += alignmentPadding;
+      chunk.size -= alignmentPadding;
+
+      // We gave the space to the previous chunk. If it was used,
+      // we need to adjust the remaining free space.
+      if ( !prevChunk.isFree )
+      {
+         _freeSpace -= alignmentPadding;
+      }
+   }
+
+   // Free chunks are always merged, so the leftover memory cannot be appended
+   // to the next chunk. Create a new free chunk for it.
+   if ( chunk.size > size )
+   {
+      _chunks.split( handle, chunk.size - size );
+      ++_freeChunkCount;
+   }
+
+   // Modify the new allocated chunk
+   _chunks[ handle ].isFree = false;
+   --_freeChunkCount;
+   _freeSpace -= size;
+
+   return handle;
+}
+
+void FirstFitPool::free( Handle handle )
+{
+   ChunkList::Chunk& chunk = _chunks[ handle ];
+
+   // Already freed chunk
+   assert( !chunk.isFree );
+
+   // Current chunk is now free.
+   chunk.isFree = true;
+   _freeSpace += chunk.size;
+   ++_freeChunkCount;
+
+   // Try to merge the freed chunk with the one on the left and the right.
+   // We always merge to the left, so the chunk to the right is removed.
+   if ( chunk.next != ChunkList::NULL_CHUNK && _chunks[ chunk.next ].isFree )
+   {
+      _chunks.mergeNext( handle );
+      --_freeChunkCount;
+   }
+   if ( chunk.prev != ChunkList::NULL_CHUNK && _chunks[ chunk.prev ].isFree )
+   {
+      _chunks.mergeNext( chunk.prev );
+      --_freeChunkCount;
+   }
+}
+
+bool FirstFitPool::tryGrow( Handle& handle, uint64_t newSize )
+{
+   ChunkList::Chunk& chunk = _chunks[ handle ];
+   assert( !chunk.isFree );
+   if ( newSize <= chunk.size )
+   {
+      return true;
+   }
+
+   // Only the free chunk right after can give us space
+   const uint64_t missingSize = newSize - chunk.size;
+   if ( chunk.next == ChunkList::NULL_CHUNK || !_chunks[ chunk.next ].isFree ||
+        _chunks[ chunk.next ].size < missingSize )
+   {
+      return false;
+   }
+
+   ChunkList::Chunk& next = _chunks[ chunk.next ];
+   if ( next.size == missingSize )
+   {
+      _chunks.mergeNext( handle );
+      --_freeChunkCount;
+   }
+   else
+   {
+      next.offset += missingSize;
+      next.size -= missingSize;
+      chunk.size += missingSize;
+   }
+   _freeSpace -= missingSize;
+
+   return true;
+}
+
+void FirstFitPool::shrink( Handle& handle, uint64_t newSize )
+{
+   ChunkList::Chunk& chunk = _chunks[ handle ];
+   assert( !chunk.isFree && newSize > 0 && newSize <= chunk.size );
+
+   const uint64_t releasedSize = chunk.size - newSize;
+   if ( !releasedSize )
+   {
+      return;
+   }
+
+   // Give the space to the next chunk if it is free, otherwise it becomes a new free chunk.
+   if ( chunk.next != ChunkList::NULL_CHUNK && _chunks[ chunk.next ].isFree )
+   {
+      ChunkList::Chunk& next = _chunks[ chunk.next ];
+      next.offset -= releasedSize;
+      next.size += releasedSize;
+      chunk.size = newSize;
+   }
+   else
+   {
+      _chunks[ _chunks.split( handle, releasedSize ) ].isFree = true;
+      ++_freeChunkCount;
+   }
+   _freeSpace += releasedSize;
+}
+
+uint64_t FirstFitPool::largestFreeBlock() const
+{
+   uint64_t largest = 0;
+   for ( auto handle = _chunks.first(); handle != ChunkList::NULL_CHUNK;
+         handle = _chunks[ handle ].next )
+   {
+      const ChunkList::Chunk& chunk = _chunks[ handle ];
+      if ( chunk.isFree && chunk.size > largest )
+      {
+         largest = chunk.size;
+      }
+   }
+   return largest;
+}
+
+void FirstFitPool::_debugChunks( std::vector<Chunk>& chunks ) const
+{
+   for ( auto handle = _chunks.first(); handle != ChunkList::NULL_CHUNK;
+         handle = _chunks[ handle ].next )
+   {
+      const ChunkList::Chunk& chunk = _chunks[ handle ];
+      chunks.push_back( Chunk{chunk.offset, chunk.size, chunk.isFree} );
+   }
+}
@@ -0,0 +1,37 @@
+#ifndef FIRST_FIT_POOL_H_
+#define FIRST_FIT_POOL_H_
+
+#include "MemoryPoolBackend.h"
+#include "ChunkList.h"
+#include <vector>
+#include <inttypes.h>
+
+// Linear first-fit allocator. Finding a chunk walks the address ordered chunk
+// list, splitting and merging are constant time.
+class FirstFitPool : public MemoryPoolBackend
+{
+  public:
+   FirstFitPool( uint64_t size, uint64_t reservedChunks );
+   Handle alloc( uint64_t size, uint64_t alignment ) override;
+   void free( Handle handle ) override;
+   uint64_t offset( Handle handle ) const override { return _chunks[ handle ].offset; }
+   uint64_t size( Handle handle ) const override { return _chunks[ handle ].size; }
+   bool tryGrow( Handle& handle, uint64_t newSize ) override;
+   void shrink( Handle& handle, uint64_t newSize ) override;
+   uint64_t spaceLeft() const override { return _freeSpace; }
+   // Walks the whole chunk list, like the allocation does.
+   uint64_t largestFreeBlock() const override;
+   uint32_t chunkCount() const override { return static_cast<uint32_t>( _chunks.chunkCount() ); }
+   uint32_t freeChunkCount() const override { return _freeChunkCount; }
+
+   void _debugChunks( std::vector<Chunk>& chunks ) const override;
+
+  private:
+   static constexpr uint64_t MAX_SIZE = 1ull << 62;
+
+   ChunkList _chunks;
+   uint64_t _freeSpace;
+   uint32_t _freeChunkCount;
+};
+
+#endif  // FIRST_FIT_POOL_H_
@@ -1,137 +1,116 @@
 #include "MemoryPool.h"
-
-MemoryPool::MemoryPool( uint64_t size, uint64_t maxAllocCount /*=200*/ )
-    : _poolSize( size ), _freeSpace( size )
+#include "FirstFitPool.h"
+#include "TlsfPool.h"
+#include "BuddyPool.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <chrono>
+
+MemoryPool::MemoryPool( uint64_t size,
+                        uint64_t reservedChunks /*=256*/,
+                        Backend backend /*= Backend::TLSF*/ )
+    : _poolSize( size ), _backendType( backend )
 {
-   _allocatedChunks.reserve( maxAllocCount );
-   // Create first default free chunk
-   _allocatedChunks.emplace_back( size, 0 );
+   switch ( backend )
+   {
+      case Backend::FIRST_FIT:
+         _backend = std::make_unique<FirstFitPool>( size, reservedChunks );
+         break;
+      case Backend::TLSF:
+         _backend = std::make_unique<TlsfPool>( size, reservedChunks );
+         break;
+      case Backend::BUDDY:
+         _backend = std::make_unique<BuddyPool>( size );
+         break;
+   }
+   assert( _backend );
 }
 
-uint64_t MemoryPool::alloc( uint64_t size, uint64_t alignment )
+MemoryPool::Handle MemoryPool::alloc( uint64_t size, uint64_t alignment )
 {
    // Alignment needs to be a power of two.
    assert( ( alignment != 0 ) && !( alignment & ( alignment - 1 ) ) );
 
-   // Get the first free chunk that can contains the requested allocation
-   const auto endIt = _allocatedChunks.cend();
-   const uint64_t alignmentMask = alignment - 1;
-   auto it =
-      std::find_if( _allocatedChunks.begin(), _allocatedChunks.end(), [=]( const auto& chunk ) {
-         // Get padding requirement for chunk. Equivalent of : ceil( cur / align ) * align
-         // plus its size
-         return chunk.isFree &&
-                chunk.size >=
-                   ( alignment - ( ( chunk.offset & alignmentMask ) ) & alignmentMask ) + size;
-      } );
-
-   if ( it == endIt )
+   Handle handle;
+   if ( _trackLatency )
    {
-      // Out of space, cannot allocate.
-      return INVALID_OFFSET;
+      const auto start = std::chrono::steady_clock::now();
+      handle = _backend->alloc( size, alignment );
+      const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start )
+                              .count();
+      const uint32_t bucket = elapsed > 0 ? mostSignificantBit( elapsed ) : 0;
+      ++_allocLatencyNs[ std::min( bucket, LATENCY_BUCKET_COUNT - 1 ) ];
    }
-
-   const uint64_t alignmentPadding = ( alignment - ( it->offset & alignmentMask ) ) & alignmentMask;
-
-   // The free chunk becomes the new allocated chunk. The remaining space is
-   // splitted to create a new free chunk.
-   const uint64_t previousFreeSize = it->size;
-   if ( it != _allocatedChunks.begin() )
+   else
    {
-      auto prevIt = it - 1;
-      // We give the alignment offset to the previous chunk
-      prevIt->size += alignmentPadding;
-      // We thus need to update current chunk offset
-      it->offset += alignmentPadding;
-
-      // We gave the space to the previous chunk. If it was used,
-      // we need to adjust the remaining free space.
-      if ( !prevIt->isFree )
-      {
-         _freeSpace -= alignmentPadding;
-      }
+      handle = _backend->alloc( size, alignment );
    }
 
-   // Modify the new allocated chunk
-   it->isFree = false;
-   it->size = size;
-
-   // Append leftover memory the the next chunk or create a new free chunk if none exists.
-   if ( previousFreeSize > alignmentPadding + size )
+   ++_allocCount;
+   if ( handle == INVALID_HANDLE )
    {
-      const uint64_t leftOverMem = previousFreeSize - alignmentPadding - size;
-      const auto itNextChunk = it + 1;
-      if ( itNextChunk != endIt && itNextChunk->isFree )
-      {
-         itNextChunk->size += leftOverMem;
-         itNextChunk->offset -= leftOverMem;
-      }
-      else
-      {
-         // Vector will be reallocated. You should increase the starting capacity.
-         assert( _allocatedChunks.capacity() >= _allocatedChunks.size() );
-         it = --_allocatedChunks.insert( it + 1, AllocChunk{leftOverMem, it->offset + size} );
-      }
+      ++_failedAllocCount;
    }
 
-   _freeSpace -= size;
-
 #ifdef _DEBUG
    assert( _debugIsConform() );
 #endif  // DEBUG
 
-   return it->offset;
+   return handle;
 }
 
-void MemoryPool::free( uint64_t offset )
+void MemoryPool::free( Handle handle )
 {
-   // Find the chunk
-   auto it =
-      std::lower_bound( _allocatedChunks.begin(), _allocatedChunks.end(), offset,
-                        []( const AllocChunk& lhs, uint64_t val ) { return lhs.offset < val; } );
+   assert( handle != INVALID_HANDLE );
+   _backend->free( handle );
+   ++_freeCount;
 
-   // Unknown chunk or already freed chunk
-   assert( it != _allocatedChunks.end() && !it->isFree );
-
-   // Current chunk is now free.
-   it->isFree = true;
+#ifdef _DEBUG
+   assert( _debugIsConform() );
+#endif  // DEBUG
+}
 
-   _freeSpace += it->size;
+bool MemoryPool::tryGrow( Handle& handle, uint64_t newSize )
+{
+   assert( handle != INVALID_HANDLE );
+   const bool grown = _backend->tryGrow( handle, newSize );
 
-   // Try to merge the freed chunk with the one on the left and the right.
-   // Merge right if not last chunk and if next chunk exists.
-   const bool mergeRight =
-      it != _allocatedChunks.end() && ( it + 1 ) != _allocatedChunks.end() && ( it + 1 )->isFree;
-   // Merge left if not first chunk and if previous chunk exists.
-   const bool mergeLeft = it != _allocatedChunks.begin() &&
-                          ( it - 1 ) != _allocatedChunks.begin() && ( it - 1 )->isFree;
+#ifdef _DEBUG
+   assert( _debugIsConform() );
+#endif  // DEBUG
 
-   std::vector<AllocChunk>::iterator itToRemoves[ 2 ] = {it, it};
-   if ( mergeRight )
-   {
-      const auto nextIt = it + 1;
-      nextIt->size += it->size;
-      nextIt->offset -= it->size;
-      it = nextIt;  // The current block is now the next one merged.
-   }
-   if ( mergeLeft )
-   {
-      auto prevIt = it - 1;
-      if ( mergeRight )
-         --prevIt;
-      prevIt->size += it->size;
-   }
+   return grown;
+}
 
-   // Since we always merge to the left, we remove the chunk to
-   // the right, according to the number of merge done.
-   itToRemoves[ 1 ] += ( mergeLeft + mergeRight );
-   _allocatedChunks.erase( itToRemoves[ 0 ], itToRemoves[ 1 ] );
+void MemoryPool::shrink( Handle& handle, uint64_t newSize )
+{
+   assert( handle != INVALID_HANDLE );
+   _backend->shrink( handle, newSize );
 
 #ifdef _DEBUG
    assert( _debugIsConform() );
 #endif  // DEBUG
 }
 
+void MemoryPool::getStats( Stats& stats ) const
+{
+   stats.totalBytes = _poolSize;
+   stats.freeBytes = _backend->spaceLeft();
+   stats.usedBytes = _poolSize - stats.freeBytes;
+   stats.largestFreeBlock = _backend->largestFreeBlock();
+   stats.fragmentation = stats.freeBytes ? 1.0f - stats.largestFreeBlock /
+                                                     static_cast<float>( stats.freeBytes )
+                                         : 0.0f;
+   stats.chunkCount = _backend->chunkCount();
+   stats.freeChunkCount = _backend->freeChunkCount();
+   stats.allocCount = _allocCount;
+   stats.failedAllocCount = _failedAllocCount;
+   stats.freeCount = _freeCount;
+   std::copy( std::begin( _allocLatencyNs ), std::end( _allocLatencyNs ),
+              std::begin( stats.allocLatencyNs ) );
+}
+
 bool MemoryPool::_debugIsConform() const
 {
    bool isConform = true;
@@ -139,7 +118,9 @@ bool MemoryPool::_debugIsConform() const
    bool totalSizeMatch = true;
    uint64_t totalSize = 0;
    uint64_t freeSpace = 0;
-   for ( auto it = _allocatedChunks.begin(); it != _allocatedChunks.end(); ++it )
+   std::vector<MemoryPoolBackend::Chunk> chunks;
+   _backend->_debugChunks( chunks );
+   for ( auto it = chunks.begin(); it != chunks.end(); ++it )
    {
       isConform &= it->offset == totalSize;
       totalSize += it->size;
@@ -153,10 +134,13 @@ bool MemoryPool::_debugIsConform() const
    totalSizeMatch = totalSize == _poolSize;
    assert( totalSizeMatch );
 
-   freeSpaceMatch = freeSpace == _freeSpace;
+   freeSpaceMatch = freeSpace == spaceLeft();
    assert( freeSpaceMatch );
 
-   return isConform && totalSizeMatch && freeSpaceMatch;
+   const bool backendConform = _backend->_debugIsConform();
+   assert( backendConform );
+
+   return isConform && totalSizeMatch && freeSpaceMatch && backendConform;
 }
 
 std::string MemoryPool::_debugPrint( int rangeLength, char emptyChar, char usedChar ) const
@@ -166,18 +150,21 @@ std::string MemoryPool::_debugPrint( int rangeLength, char emptyChar, char usedC
    msg.reserve( rangeLength + 40 );
    msg.push_back( '[' );
 
-   const float range = static_cast<float>( rangeLength - 2 - _allocatedChunks.size() );
+   std::vector<MemoryPoolBackend::Chunk> chunks;
+   _backend->_debugChunks( chunks );
+
+   const float range = static_cast<float>( rangeLength - 2 - chunks.size() );
    const float unitSize = _poolSize / range;
    float curUnit = 0.0f;
-   auto it = _allocatedChunks.begin();
-   for ( int i = 0; i < range && it != _allocatedChunks.end(); ++i )
+   auto it = chunks.begin();
+   for ( int i = 0; i < range && it != chunks.end(); ++i )
    {
       msg.push_back( it->isFree ? emptyChar : usedChar );
       curUnit += unitSize;
       if ( curUnit > it->size )
       {
          ++it;
-         if ( it != _allocatedChunks.end() )
+         if ( it != chunks.end() )
          {
             msg.push_back( '|' );
          }
@@ -186,7 +173,7 @@ std::string MemoryPool::_debugPrint( int rangeLength, char emptyChar, char usedC
 
    msg.push_back( ']' );
 
-   const float percentUsed = ( _poolSize - _freeSpace ) / float( _poolSize );
+   const float percentUsed = ( _poolSize - spaceLeft() ) / float( _poolSize );
    std::string stats =
       " " + std::to_string( percentUsed ) + "% of " + std::to_string( _poolSize ) + " bytes used";
 
@@ -1,45 +1,82 @@
 #ifndef MEMORY_POOL_H_
 #define MEMORY_POOL_H_
 
+#include "MemoryPoolBackend.h"
 #include <vector>
 #include <inttypes.h>
-#include <limits>
-#include <algorithm>
+#include <memory>
 #include <assert.h>
 #include <string>
 
 class MemoryPool
 {
   public:
-   static constexpr uint64_t INVALID_OFFSET = std::numeric_limits<uint64_t>::max();
+   using Handle = MemoryPoolBackend::Handle;
+   static constexpr Handle INVALID_HANDLE = MemoryPoolBackend::INVALID_HANDLE;
 
-   MemoryPool( uint64_t size, uint64_t maxAllocCount = 200 );
-   uint64_t alloc( uint64_t size, uint64_t alignment );
-   void free( uint64_t offset );
+   enum class Backend
+   {
+      FIRST_FIT,  // Linear search in a sorted chunk list
+      TLSF,       // Two-level segregated fit, constant time alloc and free
+      BUDDY,      // Power of two blocks, O(log n) alloc and free with bounded fragmentation
+   };
+
+   static constexpr uint32_t LATENCY_BUCKET_COUNT = 16;
+
+   struct Stats
+   {
+      uint64_t totalBytes;
+      uint64_t usedBytes;
+      uint64_t freeBytes;
+      uint64_t largestFreeBlock;
+      // 0 when the free space is in a single block, close to 1 when it is scattered
+      float fragmentation;
+      uint32_t chunkCount;
+      uint32_t freeChunkCount;
+      uint64_t allocCount;
+      uint64_t failedAllocCount;
+      uint64_t freeCount;
+      // Bucket N counts the allocations that took [2^N, 2^(N+1)[ ns, the last one
+      // everything longer. Only filled while latency tracking is enabled.
+      uint64_t allocLatencyNs[ LATENCY_BUCKET_COUNT ];
+   };
+
+   // reservedChunks only pre-allocates chunk metadata, the pool grows it as needed.
+   MemoryPool( uint64_t size, uint64_t reservedChunks = 256, Backend backend = Backend::TLSF );
+   Handle alloc( uint64_t size, uint64_t alignment );
+   void free( Handle handle );
+   uint64_t offset( Handle handle ) const { return _backend->offset( handle ); }
+   // Usable size of the allocation, at least what was requested.
+   uint64_t size( Handle handle ) const { return _backend->size( handle ); }
+
+   // Resize an allocation without moving it, using the free space right after it. The
+   // handle can change, the offset never does. tryGrow returns false and leaves the
+   // allocation as it was if there is not enough free space after it.
+   bool tryGrow( Handle& handle, uint64_t newSize );
+   void shrink( Handle& handle, uint64_t newSize );
+
+   // Cheap enough to be called every frame.
+   void getStats( Stats& stats ) const;
+   // Times every allocation. Off by default, as reading the clock costs about as much as
+   // an allocation.
+   void setLatencyTracking( bool enabled ) { _trackLatency = enabled; }
 
    bool _debugIsConform() const;
    std::string _debugPrint( int length, char emptyChar, char usedChar ) const;
 
-   uint64_t spaceLeft() const { return _freeSpace; }
+   uint64_t spaceLeft() const { return _backend->spaceLeft(); }
    uint64_t totalPoolSize() const { return _poolSize; }
+   Backend backend() const { return _backendType; }
   private:
-   struct AllocChunk
-   {
-      static constexpr uint64_t MAX_SIZE = 1ull << 62;
-      AllocChunk( uint64_t allocSize, uint64_t allocOffset )
-          : isFree( true ), size( allocSize ), offset( allocOffset )
-      {
-         assert( allocSize <= MAX_SIZE );  // Something is probably wrong...
-      }
-
-      uint64_t isFree : 1;
-      uint64_t size : 63;
-      uint64_t offset;
-   };
-
-   std::vector<AllocChunk> _allocatedChunks;
+   std::unique_ptr<MemoryPoolBackend> _backend;
    const uint64_t _poolSize;
-   uint64_t _freeSpace;
+   const Backend _backendType;
+
+   uint64_t _allocCount = 0;
+   uint64_t _failedAllocCount = 0;
+   uint64_t _freeCount = 0;
+   bool _trackLatency = false;
+   uint64_t _allocLatencyNs[ LATENCY_BUCKET_COUNT ] = {};
 };
 
-#endif  // MEMORY_POOL_H_
\ No newline at end of file
+#endif  // MEMORY_POOL_H_
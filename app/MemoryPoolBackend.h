@@ -0,0 +1,48 @@
+#ifndef MEMORY_POOL_BACKEND_H_
+#define MEMORY_POOL_BACKEND_H_
+
+#include <inttypes.h>
+#include <vector>
+#include <limits>
+
+// Allocation strategy used by a MemoryPool. The backend only manages offsets
+// inside the pool range, it never touches the memory itself.
+class MemoryPoolBackend
+{
+  public:
+   // Opaque identifier of an allocation, only meaningful to the backend that returned it.
+   using Handle = uint32_t;
+   static constexpr Handle INVALID_HANDLE = std::numeric_limits<uint32_t>::max();
+
+   struct Chunk
+   {
+      uint64_t offset;
+      uint64_t size;
+      bool isFree;
+   };
+
+   virtual ~MemoryPoolBackend() = default;
+
+   virtual Handle alloc( uint64_t size, uint64_t alignment ) = 0;
+   virtual void free( Handle handle ) = 0;
+   virtual uint64_t offset( Handle handle ) const = 0;
+   // Space usable from the offset of the allocation. Can be more than what was requested.
+   virtual uint64_t size( Handle handle ) const = 0;
+   // Resizes the allocation without moving it. The handle can change, the offset never does.
+   // tryGrow returns false and leaves the allocation untouched if the space after it is used.
+   virtual bool tryGrow( Handle& handle, uint64_t newSize ) = 0;
+   virtual void shrink( Handle& handle, uint64_t newSize ) = 0;
+   virtual uint64_t spaceLeft() const = 0;
+   // Size of the biggest free chunk, the biggest allocation that can succeed without alignment.
+   virtual uint64_t largestFreeBlock() const = 0;
+   // Number of chunks, used and free.
+   virtual uint32_t chunkCount() const = 0;
+   virtual uint32_t freeChunkCount() const = 0;
+
+   // Backend specific invariants. The generic chunk checks are done by the MemoryPool.
+   virtual bool _debugIsConform() const { return true; }
+   // Appends every chunk of the pool, ordered by offset.
+   virtual void _debugChunks( std::vector<Chunk>& chunks ) const = 0;
+};
+
+#endif  // MEMORY_POOL_BACKEND_H_
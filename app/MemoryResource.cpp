@@ -0,0 +1,317 @@
+#include "MemoryResource.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstddef>
+#include <new>
+
+#if defined( WIN32 ) || defined( _WIN32 )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+uint64_t alignUp( uint64_t value, uint64_t alignment )
+{
+   return ( value + alignment - 1 ) & ~( alignment - 1 );
+}
+}
+
+void* HugePageMemoryResource::do_allocate( size_t bytes, size_t alignment )
+{
+   assert( alignment <= HUGE_PAGE_SIZE );
+   const size_t size = alignUp( bytes, HUGE_PAGE_SIZE );
+
+#if defined( WIN32 ) || defined( _WIN32 )
+   // Large pages need the lock memory privilege, use regular pages.
+   void* memory = VirtualAlloc( nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+   if ( !memory )
+   {
+      throw std::bad_alloc();
+   }
+#else
+   // Map one more huge page, to trim the mapping down to an aligned range the kernel can
+   // back with huge pages.
+   void* mapping =
+      mmap( nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0 );
+   if ( mapping == MAP_FAILED )
+   {
+      throw std::bad_alloc();
+   }
+
+   char* const mappingStart = static_cast<char*>( mapping );
+   char* const memory =
+      reinterpret_cast<char*>( alignUp( reinterpret_cast<uintptr_t>( mapping ), HUGE_PAGE_SIZE ) );
+   if ( memory != mappingStart )
+   {
+      munmap( mappingStart, memory - mappingStart );
+   }
+   munmap( memory + size, mappingStart + HUGE_PAGE_SIZE - memory );
+
+#ifdef MADV_HUGEPAGE
+   madvise( memory, size, MADV_HUGEPAGE );
+#endif
+
+   // MAP_POPULATE would fault the pages in before the madvise, with small pages. Populate
+   // them after instead.
+   if ( _prefault )
+   {
+#ifdef MADV_POPULATE_WRITE
+      if ( madvise( memory, size, MADV_POPULATE_WRITE ) != 0 )
+#endif
+      {
+         for ( size_t offset = 0; offset < size; offset += 4096 )
+         {
+            memory[ offset ] = 0;
+         }
+      }
+   }
+#endif
+
+   _mappedBytes += size;
+   return memory;
+}
+
+void HugePageMemoryResource::do_deallocate( void* p, size_t bytes, size_t )
+{
+   const size_t size = alignUp( bytes, HUGE_PAGE_SIZE );
+#if defined( WIN32 ) || defined( _WIN32 )
+   VirtualFree( p, 0, MEM_RELEASE );
+#else
+   munmap( p, size );
+#endif
+   _mappedBytes -= size;
+}
+
+bool HugePageMemoryResource::do_is_equal( const std::pmr::memory_resource& other ) const noexcept
+{
+   return this == &other;
+}
+
+ArenaMemoryResource::ArenaMemoryResource( uint64_t blockSize, std::pmr::memory_resource* upstream )
+    : _upstream( upstream ),
+      _blockSize( blockSize ),
+      _curBlock( 0 ),
+      _curOffset( 0 ),
+      _fullBlocksUsedBytes( 0 )
+{
+   assert( blockSize > 0 );
+}
+
+ArenaMemoryResource::~ArenaMemoryResource()
+{
+   release();
+}
+
+void* ArenaMemoryResource::bump( size_t bytes, size_t alignment )
+{
+   const Block& block = _blocks[ _curBlock ];
+   const uintptr_t base = reinterpret_cast<uintptr_t>( block.memory );
+   const uint64_t offset = alignUp( base + _curOffset, alignment ) - base;
+   if ( offset + bytes > block.size )
+   {
+      return nullptr;
+   }
+   _curOffset = offset + bytes;
+   return static_cast<char*>( block.memory ) + offset;
+}
+
+void* ArenaMemoryResource::do_allocate( size_t bytes, size_t alignment )
+{
+   if ( _curBlock < _blocks.size() )
+   {
+      if ( void* ptr = bump( bytes, alignment ) )
+         return ptr;
+      _fullBlocksUsedBytes += _curOffset;
+   }
+
+   // The current block is full. Move to the next one if it is big enough, otherwise
+   // insert a new block after the current one.
+   const size_t nextBlock = _blocks.empty() ? 0 : _curBlock + 1;
+   _curBlock = nextBlock;
+   _curOffset = 0;
+   if ( nextBlock < _blocks.size() )
+   {
+      if ( void* ptr = bump( bytes, alignment ) )
+         return ptr;
+   }
+
+   Block block;
+   block.size = std::max<uint64_t>( _blockSize, bytes );
+   block.alignment = std::max( alignment, alignof( std::max_align_t ) );
+   block.memory = _upstream->allocate( block.size, block.alignment );
+   _blocks.insert( _blocks.begin() + nextBlock, block );
+   return bump( bytes, alignment );
+}
+
+void ArenaMemoryResource::do_deallocate( void*, size_t, size_t )
+{
+   // Freed by reset()
+}
+
+bool ArenaMemoryResource::do_is_equal( const std::pmr::memory_resource& other ) const noexcept
+{
+   return this == &other;
+}
+
+void ArenaMemoryResource::reset()
+{
+   _curBlock = 0;
+   _curOffset = 0;
+   _fullBlocksUsedBytes = 0;
+}
+
+void ArenaMemoryResource::release()
+{
+   for ( const Block& block : _blocks )
+   {
+      _upstream->deallocate( block.memory, block.size, block.alignment );
+   }
+   _blocks.clear();
+   reset();
+}
+
+uint64_t ArenaMemoryResource::usedBytes() const
+{
+   return _fullBlocksUsedBytes + _curOffset;
+}
+
+uint64_t ArenaMemoryResource::reservedBytes() const
+{
+   uint64_t size = 0;
+   for ( const Block& block : _blocks )
+   {
+      size += block.size;
+   }
+   return size;
+}
+
+PoolMemoryResource::PoolMemoryResource( uint64_t blockSize,
+                                        MemoryPool::Backend backend,
+                                        std::pmr::memory_resource* upstream )
+    : _upstream( upstream ),
+      _blockSize( blockSize ),
+      _backend( backend ),
+      _lastBlock( 0 ),
+      _upstreamBytes( 0 )
+{
+   assert( blockSize > 0 );
+}
+
+PoolMemoryResource::~PoolMemoryResource()
+{
+   release();
+}
+
+size_t PoolMemoryResource::headerSize( size_t alignment )
+{
+   // Keeps the allocation aligned right after the header
+   return alignUp( sizeof( Header ), std::max( alignment, alignof( Header ) ) );
+}
+
+void* PoolMemoryResource::allocFromBlock( uint32_t blockIdx, size_t bytes, size_t alignment )
+{
+   const size_t header = headerSize( alignment );
+   Block& block = _blocks[ blockIdx ];
+   const MemoryPool::Handle handle =
+      block.pool->alloc( header + bytes, std::max( alignment, alignof( Header ) ) );
+   if ( handle == MemoryPool::INVALID_HANDLE )
+   {
+      return nullptr;
+   }
+
+   char* ptr = block.memory + block.pool->offset( handle ) + header;
+   *reinterpret_cast<Header*>( ptr - sizeof( Header ) ) = Header{blockIdx, handle};
+   _lastBlock = blockIdx;
+   return ptr;
+}
+
+void* PoolMemoryResource::allocFromUpstream( size_t bytes, size_t alignment )
+{
+   const size_t header = headerSize( alignment );
+   char* memory = static_cast<char*>(
+      _upstream->allocate( header + bytes, std::max( alignment, alignof( Header ) ) ) );
+   char* ptr = memory + header;
+   *reinterpret_cast<Header*>( ptr - sizeof( Header ) ) =
+      Header{UPSTREAM_BLOCK, MemoryPool::INVALID_HANDLE};
+   _upstreamBytes += header + bytes;
+   return ptr;
+}
+
+void* PoolMemoryResource::do_allocate( size_t bytes, size_t alignment )
+{
+   if ( alignment > BLOCK_ALIGNMENT || headerSize( alignment ) + bytes > _blockSize )
+   {
+      return allocFromUpstream( bytes, alignment );
+   }
+
+   if ( _lastBlock < _blocks.size() )
+   {
+      if ( void* ptr = allocFromBlock( _lastBlock, bytes, alignment ) )
+         return ptr;
+   }
+   for ( uint32_t i = 0; i < _blocks.size(); ++i )
+   {
+      if ( i == _lastBlock )
+         continue;
+      if ( void* ptr = allocFromBlock( i, bytes, alignment ) )
+         return ptr;
+   }
+
+   char* memory = static_cast<char*>( _upstream->allocate( _blockSize, BLOCK_ALIGNMENT ) );
+   _blocks.push_back( Block{memory, std::make_unique<MemoryPool>( _blockSize, 256, _backend )} );
+   void* ptr = allocFromBlock( static_cast<uint32_t>( _blocks.size() - 1 ), bytes, alignment );
+   // Can only fail if the backend rounds the size up past the block size (buddy)
+   return ptr ? ptr : allocFromUpstream( bytes, alignment );
+}
+
+void PoolMemoryResource::do_deallocate( void* p, size_t bytes, size_t alignment )
+{
+   const Header h = *reinterpret_cast<const Header*>( static_cast<char*>( p ) - sizeof( Header ) );
+   if ( h.block == UPSTREAM_BLOCK )
+   {
+      const size_t header = headerSize( alignment );
+      _upstream->deallocate( static_cast<char*>( p ) - header, header + bytes,
+                             std::max( alignment, alignof( Header ) ) );
+      _upstreamBytes -= header + bytes;
+      return;
+   }
+
+   assert( h.block < _blocks.size() );
+   _blocks[ h.block ].pool->free( h.handle );
+}
+
+bool PoolMemoryResource::do_is_equal( const std::pmr::memory_resource& other ) const noexcept
+{
+   return this == &other;
+}
+
+void PoolMemoryResource::release()
+{
+   for ( const Block& block : _blocks )
+   {
+      _upstream->deallocate( block.memory, _blockSize, BLOCK_ALIGNMENT );
+   }
+   _blocks.clear();
+   _lastBlock = 0;
+}
+
+uint64_t PoolMemoryResource::usedBytes() const
+{
+   uint64_t used = _upstreamBytes;
+   for ( const Block& block : _blocks )
+   {
+      used += block.pool->totalPoolSize() - block.pool->spaceLeft();
+   }
+   return used;
+}
+
+uint64_t PoolMemoryResource::reservedBytes() const
+{
+   return _blocks.size() * _blockSize + _upstreamBytes;
+}
@@ -0,0 +1,144 @@
+#ifndef MEMORY_RESOURCE_H_
+#define MEMORY_RESOURCE_H_
+
+#include "MemoryPool.h"
+#include <inttypes.h>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+// std::pmr::memory_resource implementations for the CPU side data, so containers can be
+// given an allocator with std::pmr::vector and friends instead of using the global heap.
+// None of them are thread safe: give each loader thread its own resource instead, which
+// also removes the contention on the global heap.
+
+// Maps its memory straight from the OS, in huge pages where possible, to cut the page
+// faults and TLB misses when filling big buffers. Meant to be the upstream of the other
+// resources: every allocation takes at least one huge page. On Linux the mapping is
+// aligned on a huge page and advised with MADV_HUGEPAGE for transparent huge pages.
+class HugePageMemoryResource : public std::pmr::memory_resource
+{
+  public:
+   static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+   // With prefault, the pages are touched on allocation instead of on first access.
+   explicit HugePageMemoryResource( bool prefault = false ) : _prefault( prefault ) {}
+   HugePageMemoryResource( const HugePageMemoryResource& ) = delete;
+   HugePageMemoryResource& operator=( const HugePageMemoryResource& ) = delete;
+
+   uint64_t mappedBytes() const { return _mappedBytes; }
+
+  private:
+   void* do_allocate( size_t bytes, size_t alignment ) override;
+   void do_deallocate( void* p, size_t bytes, size_t alignment ) override;
+   bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override;
+
+   const bool _prefault;
+   uint64_t _mappedBytes = 0;
+};
+
+// Monotonic arena. Allocating is bumping an offset in the current block and deallocating
+// does nothing: everything is freed at once with reset(). Meant for data with the lifetime
+// of a load or of a frame.
+class ArenaMemoryResource : public std::pmr::memory_resource
+{
+  public:
+   // Blocks of blockSize bytes are taken from upstream as needed. Bigger requests get a
+   // block of their own.
+   explicit ArenaMemoryResource(
+      uint64_t blockSize,
+      std::pmr::memory_resource* upstream = std::pmr::get_default_resource() );
+   ~ArenaMemoryResource();
+   ArenaMemoryResource( const ArenaMemoryResource& ) = delete;
+   ArenaMemoryResource& operator=( const ArenaMemoryResource& ) = delete;
+
+   // Frees every allocation. The blocks are kept for the next allocations.
+   void reset();
+   // Frees every allocation and gives the blocks back to upstream.
+   void release();
+
+   uint64_t usedBytes() const;
+   uint64_t reservedBytes() const;
+
+  private:
+   struct Block
+   {
+      void* memory;
+      uint64_t size;
+      size_t alignment;
+   };
+
+   // Allocates in the current block. Returns nullptr if it does not fit.
+   void* bump( size_t bytes, size_t alignment );
+
+   void* do_allocate( size_t bytes, size_t alignment ) override;
+   void do_deallocate( void* p, size_t bytes, size_t alignment ) override;
+   bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override;
+
+   std::pmr::memory_resource* const _upstream;
+   const uint64_t _blockSize;
+   std::vector<Block> _blocks;
+   // Block being filled and its first free byte
+   size_t _curBlock;
+   uint64_t _curOffset;
+   // Bytes used in the blocks before _curBlock
+   uint64_t _fullBlocksUsedBytes;
+};
+
+// General purpose resource over host blocks managed by MemoryPools. Allocations can be
+// freed individually, in any order. A new block is added when none of them has enough
+// space, and requests too big for a block are forwarded to upstream.
+class PoolMemoryResource : public std::pmr::memory_resource
+{
+  public:
+   explicit PoolMemoryResource(
+      uint64_t blockSize,
+      MemoryPool::Backend backend = MemoryPool::Backend::TLSF,
+      std::pmr::memory_resource* upstream = std::pmr::get_default_resource() );
+   ~PoolMemoryResource();
+   PoolMemoryResource( const PoolMemoryResource& ) = delete;
+   PoolMemoryResource& operator=( const PoolMemoryResource& ) = delete;
+
+   // Gives every block back to upstream, even if there are still allocations in them.
+   void release();
+
+   uint64_t usedBytes() const;
+   uint64_t reservedBytes() const;
+
+  private:
+   // Alignment of the blocks. Bigger alignments are forwarded to upstream.
+   static constexpr size_t BLOCK_ALIGNMENT = 4096;
+   static constexpr uint32_t UPSTREAM_BLOCK = ~0u;
+
+   // Stored right before every allocation, to find it back on deallocation.
+   struct Header
+   {
+      uint32_t block;
+      MemoryPool::Handle handle;
+   };
+
+   struct Block
+   {
+      char* memory;
+      std::unique_ptr<MemoryPool> pool;
+   };
+
+   static size_t headerSize( size_t alignment );
+
+   void* do_allocate( size_t bytes, size_t alignment ) override;
+   void do_deallocate( void* p, size_t bytes, size_t alignment ) override;
+   bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override;
+
+   void* allocFromBlock( uint32_t blockIdx, size_t bytes, size_t alignment );
+   void* allocFromUpstream( size_t bytes, size_t alignment );
+
+   std::pmr::memory_resource* const _upstream;
+   const uint64_t _blockSize;
+   const MemoryPool::Backend _backend;
+   std::vector<Block> _blocks;
+   // Last block an allocation was made in, tried first
+   uint32_t _lastBlock;
+   uint64_t _upstreamBytes;
+};
+
+#endif  // MEMORY_RESOURCE_H_
@@ -0,0 +1,140 @@
+#include "MemoryTrace.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+
+namespace
+{
+constexpr char MAGIC[ 4 ] = {'M', 'V', 'P', 'T'};
+constexpr uint8_t VERSION = 1;
+
+uint64_t nowNs()
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch() )
+      .count();
+}
+
+bool readVarint( std::istream& in, uint64_t& value )
+{
+   value = 0;
+   for ( uint32_t shift = 0; shift < 64; shift += 7 )
+   {
+      const int byte = in.get();
+      if ( byte == EOF )
+      {
+         return false;
+      }
+      value |= static_cast<uint64_t>( byte & 0x7f ) << shift;
+      if ( !( byte & 0x80 ) )
+      {
+         return true;
+      }
+   }
+   return false;
+}
+}
+
+namespace MemoryTrace
+{
+Writer::Writer( const std::string& path )
+    : _file( path, std::ios::binary ), _startTimeNs( nowNs() ), _lastTimeNs( 0 ), _nextId( 0 )
+{
+   if ( _file.is_open() )
+   {
+      _file.write( MAGIC, sizeof( MAGIC ) );
+      _file.put( VERSION );
+   }
+}
+
+void Writer::writeVarint( uint64_t value )
+{
+   do
+   {
+      const uint8_t byte = value & 0x7f;
+      value >>= 7;
+      _file.put( value ? byte | 0x80 : byte );
+   } while ( value );
+}
+
+void Writer::writeHeader( EventType type, uint32_t id )
+{
+   const uint64_t timeNs = nowNs() - _startTimeNs;
+   writeVarint( static_cast<uint64_t>( type ) );
+   writeVarint( id );
+   writeVarint( timeNs - _lastTimeNs );
+   _lastTimeNs = timeNs;
+}
+
+uint32_t Writer::recordAlloc( uint64_t size,
+                              uint64_t alignment,
+                              uint32_t properties,
+                              uint32_t memTypeBits )
+{
+   assert( isPowerOfTwo( alignment ) );
+   const uint32_t id = _nextId++;
+   writeHeader( EventType::ALLOC, id );
+   writeVarint( size );
+   writeVarint( mostSignificantBit( alignment ) );
+   writeVarint( properties );
+   writeVarint( memTypeBits );
+   return id;
+}
+
+void Writer::recordFree( uint32_t id )
+{
+   writeHeader( EventType::FREE, id );
+}
+
+void Writer::recordResize( uint32_t id, uint64_t newSize )
+{
+   writeHeader( EventType::RESIZE, id );
+   writeVarint( newSize );
+}
+
+bool read( const std::string& path, std::vector<Event>& events )
+{
+   std::ifstream file( path, std::ios::binary );
+   char magic[ sizeof( MAGIC ) ];
+   if ( !file.read( magic, sizeof( magic ) ) ||
+        !std::equal( magic, magic + sizeof( magic ), MAGIC ) || file.get() != VERSION )
+   {
+      return false;
+   }
+
+   uint64_t type, id, timeDelta;
+   uint64_t timeNs = 0;
+   while ( readVarint( file, type ) )
+   {
+      if ( type > static_cast<uint64_t>( EventType::RESIZE ) || !readVarint( file, id ) ||
+           !readVarint( file, timeDelta ) )
+      {
+         return false;
+      }
+      timeNs += timeDelta;
+
+      Event event = {static_cast<EventType>( type ), static_cast<uint32_t>( id ), timeNs, 0, 1,
+                     0, 0};
+      if ( event.type == EventType::ALLOC )
+      {
+         uint64_t alignLog2, properties, memTypeBits;
+         if ( !readVarint( file, event.size ) || !readVarint( file, alignLog2 ) ||
+              !readVarint( file, properties ) || !readVarint( file, memTypeBits ) )
+         {
+            return false;
+         }
+         event.alignment = 1ull << alignLog2;
+         event.properties = static_cast<uint32_t>( properties );
+         event.memTypeBits = static_cast<uint32_t>( memTypeBits );
+      }
+      else if ( event.type == EventType::RESIZE && !readVarint( file, event.size ) )
+      {
+         return false;
+      }
+      events.push_back( event );
+   }
+
+   return true;
+}
+}
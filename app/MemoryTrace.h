@@ -0,0 +1,70 @@
+#ifndef MEMORY_TRACE_H_
+#define MEMORY_TRACE_H_
+
+#include <inttypes.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary log of the allocations and frees of a memory manager, to replay real
+// allocation patterns against the MemoryPool backends.
+//
+// The file starts with a magic and a version, followed by one record per
+// event. Every field of a record is a LEB128 varint, so most events only take
+// a few bytes: the event type, the allocation id, the time since the previous
+// event in ns and, for allocations, the size, the log2 of the alignment, the
+// memory properties and the memory type bits. Resizes only add the new size.
+namespace MemoryTrace
+{
+enum class EventType : uint8_t
+{
+   ALLOC,
+   FREE,
+   // In place, the allocation keeps its offset
+   RESIZE,
+};
+
+struct Event
+{
+   EventType type;
+   // Identifies the allocation a free or a resize refers to
+   uint32_t id;
+   // Since the start of the trace
+   uint64_t timeNs;
+   // New size for resizes
+   uint64_t size;
+   uint64_t alignment;
+   uint32_t properties;
+   uint32_t memTypeBits;
+};
+
+class Writer
+{
+  public:
+   // Check isOpen() to know if the file could be created.
+   explicit Writer( const std::string& path );
+   bool isOpen() const { return _file.is_open(); }
+
+   // Returns the id of the allocation, to give to recordFree.
+   uint32_t recordAlloc( uint64_t size,
+                         uint64_t alignment,
+                         uint32_t properties,
+                         uint32_t memTypeBits );
+   void recordFree( uint32_t id );
+   void recordResize( uint32_t id, uint64_t newSize );
+
+  private:
+   void writeHeader( EventType type, uint32_t id );
+   void writeVarint( uint64_t value );
+
+   std::ofstream _file;
+   uint64_t _startTimeNs;
+   uint64_t _lastTimeNs;
+   uint32_t _nextId;
+};
+
+// Reads the whole trace. Returns false if the file cannot be read or is not a trace.
+bool read( const std::string& path, std::vector<Event>& events );
+}
+
+#endif  // MEMORY_TRACE_H_
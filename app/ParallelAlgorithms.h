@@ -0,0 +1,276 @@
+#ifndef _PARALLEL_ALGORITHMS_H_
+#define _PARALLEL_ALGORITHMS_H_
+
+#include "ThreadPool.h"
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <vector>
+#include <inttypes.h>
+
+// Fork/join algorithms over index or iterator ranges, run by a ThreadPool. The ranges are
+// split in halves recursively: a job keeps the lower half and gives the upper one to its
+// worker deque, where idle workers steal the biggest pieces first. The calling thread runs
+// jobs of the pool until the whole range is done, so these can be called from a job.
+//
+// A grain size of 0 picks one giving about 8 pieces per thread.
+
+namespace parallelDetail
+{
+inline size_t autoGrainSize( const ThreadPool& pool, size_t count )
+{
+   const size_t pieceCount = ( pool.threadCount() + 1 ) * 8;
+   return std::max<size_t>( 1, count / pieceCount );
+}
+
+template <typename F>
+struct ForContext
+{
+   ThreadPool& pool;
+   ThreadPool::JobCounter& counter;
+   const F& body;
+   size_t grainSize;
+};
+
+template <typename F>
+void forRange( const ForContext<F>& context, size_t begin, size_t end )
+{
+   while ( end - begin > context.grainSize )
+   {
+      const size_t mid = begin + ( end - begin ) / 2;
+      context.pool.submit( context.counter,
+                           [&context, mid, end]() { forRange( context, mid, end ); } );
+      end = mid;
+   }
+   context.body( begin, end );
+}
+
+template <typename T, typename Map, typename Combine>
+struct ReduceContext
+{
+   ThreadPool& pool;
+   const T& identity;
+   const Map& map;
+   const Combine& combine;
+   size_t grainSize;
+};
+
+template <typename T, typename Map, typename Combine>
+T reduceRange( const ReduceContext<T, Map, Combine>& context, size_t begin, size_t end )
+{
+   if ( end - begin <= context.grainSize )
+   {
+      return context.map( begin, end );
+   }
+
+   const size_t mid = begin + ( end - begin ) / 2;
+   T right = context.identity;
+   ThreadPool::JobCounter counter;
+   context.pool.submit( counter, [&context, &right, mid, end]() {
+      right = reduceRange( context, mid, end );
+   } );
+   T left = reduceRange( context, begin, mid );
+   context.pool.wait( counter );
+   return context.combine( left, right );
+}
+
+template <typename It, typename Compare>
+struct SortContext
+{
+   ThreadPool& pool;
+   ThreadPool::JobCounter& counter;
+   const Compare& comp;
+   size_t grainSize;
+};
+
+template <typename It, typename Compare>
+It medianOfThree( It a, It b, It c, const Compare& comp )
+{
+   if ( comp( *a, *b ) )
+   {
+      return comp( *b, *c ) ? b : ( comp( *a, *c ) ? c : a );
+   }
+   return comp( *a, *c ) ? a : ( comp( *b, *c ) ? c : b );
+}
+
+// Quick sort, the part above the pivot going to the pool. Past 'depthLeft' splits the
+// pivots are assumed to be bad and the range is sorted in place.
+template <typename It, typename Compare>
+void sortRange( const SortContext<It, Compare>& context, It first, It last, uint32_t depthLeft )
+{
+   using Value = typename std::iterator_traits<It>::value_type;
+   while ( static_cast<size_t>( last - first ) > context.grainSize && depthLeft > 0 )
+   {
+      --depthLeft;
+      const Value pivot = *medianOfThree( first, first + ( last - first ) / 2, last - 1,
+                                          context.comp );
+      // Lower than the pivot, then equal to it, then greater
+      const It lowerEnd = std::partition(
+         first, last, [&context, &pivot]( const Value& v ) { return context.comp( v, pivot ); } );
+      const It equalEnd = std::partition( lowerEnd, last, [&context, &pivot]( const Value& v ) {
+         return !context.comp( pivot, v );
+      } );
+
+      if ( equalEnd != last )
+      {
+         context.pool.submit( context.counter, [&context, equalEnd, last, depthLeft]() {
+            sortRange( context, equalEnd, last, depthLeft );
+         } );
+      }
+      last = lowerEnd;
+   }
+   std::sort( first, last, context.comp );
+}
+}  // namespace parallelDetail
+
+// Calls body( rangeBegin, rangeEnd ) on pieces of [begin, end) of at most 'grainSize'
+// indices.
+template <typename F>
+void parallelFor( ThreadPool& pool, size_t begin, size_t end, const F& body, size_t grainSize = 0 )
+{
+   if ( begin >= end )
+   {
+      return;
+   }
+   if ( grainSize == 0 )
+   {
+      grainSize = parallelDetail::autoGrainSize( pool, end - begin );
+   }
+
+   ThreadPool::JobCounter counter;
+   const parallelDetail::ForContext<F> context = {pool, counter, body, grainSize};
+   parallelDetail::forRange( context, begin, end );
+   pool.wait( counter );
+}
+
+// Reduces [begin, end): map( rangeBegin, rangeEnd ) returns the value of a piece and
+// combine( left, right ) merges the values of two adjacent pieces. The pieces are always
+// combined in order, so 'combine' only needs to be associative.
+template <typename T, typename Map, typename Combine>
+T parallelReduce( ThreadPool& pool,
+                  size_t begin,
+                  size_t end,
+                  const T& identity,
+                  const Map& map,
+                  const Combine& combine,
+                  size_t grainSize = 0 )
+{
+   if ( begin >= end )
+   {
+      return identity;
+   }
+   if ( grainSize == 0 )
+   {
+      grainSize = parallelDetail::autoGrainSize( pool, end - begin );
+   }
+
+   const parallelDetail::ReduceContext<T, Map, Combine> context = {pool, identity, map, combine,
+                                                                   grainSize};
+   return parallelDetail::reduceRange( context, begin, end );
+}
+
+// Not stable. The partition at each split is done by a single thread, so the first ones
+// limit the speed up on large ranges.
+template <typename It, typename Compare = std::less<>>
+void parallelSort( ThreadPool& pool,
+                   It first,
+                   It last,
+                   const Compare& comp = Compare(),
+                   size_t grainSize = 0 )
+{
+   // Smaller pieces cost more to hand to the pool than to sort
+   static constexpr size_t MIN_SORT_GRAIN_SIZE = 1024;
+
+   const size_t count = static_cast<size_t>( last - first );
+   if ( count < 2 )
+   {
+      return;
+   }
+   if ( grainSize == 0 )
+   {
+      grainSize = std::max( parallelDetail::autoGrainSize( pool, count ), MIN_SORT_GRAIN_SIZE );
+   }
+
+   uint32_t maxDepth = 0;
+   for ( size_t n = count; n > 1; n >>= 1 )
+   {
+      maxDepth += 2;
+   }
+
+   ThreadPool::JobCounter counter;
+   const parallelDetail::SortContext<It, Compare> context = {pool, counter, comp, grainSize};
+   parallelDetail::sortRange( context, first, last, maxDepth );
+   pool.wait( counter );
+}
+
+// Writes op( in[ 0 ], ..., in[ i ] ) to out[ i ]. The input and output can be the same.
+// Each piece is summed, the sums of the pieces are scanned, then each piece is scanned
+// starting from the sum of the pieces before it.
+template <typename InIt, typename OutIt, typename Op>
+void parallelInclusiveScan( ThreadPool& pool,
+                            InIt first,
+                            InIt last,
+                            OutIt out,
+                            const Op& op,
+                            size_t grainSize = 0 )
+{
+   using Value = typename std::iterator_traits<InIt>::value_type;
+
+   const size_t count = static_cast<size_t>( last - first );
+   if ( count == 0 )
+   {
+      return;
+   }
+   if ( grainSize == 0 )
+   {
+      grainSize = parallelDetail::autoGrainSize( pool, count );
+   }
+
+   const size_t pieceCount = ( count + grainSize - 1 ) / grainSize;
+   if ( pieceCount == 1 )
+   {
+      std::partial_sum( first, last, out, op );
+      return;
+   }
+
+   std::vector<Value> pieceSums( pieceCount );
+   parallelFor( pool, 0, pieceCount,
+                [&]( size_t pieceBegin, size_t pieceEnd ) {
+                   for ( size_t piece = pieceBegin; piece < pieceEnd; ++piece )
+                   {
+                      InIt it = first + piece * grainSize;
+                      const InIt end = first + std::min( count, ( piece + 1 ) * grainSize );
+                      Value sum = *it;
+                      while ( ++it != end )
+                      {
+                         sum = op( sum, *it );
+                      }
+                      pieceSums[ piece ] = sum;
+                   }
+                },
+                1 );
+
+   // Only a few pieces, not worth splitting
+   std::partial_sum( pieceSums.begin(), pieceSums.end(), pieceSums.begin(), op );
+
+   parallelFor( pool, 0, pieceCount,
+                [&]( size_t pieceBegin, size_t pieceEnd ) {
+                   for ( size_t piece = pieceBegin; piece < pieceEnd; ++piece )
+                   {
+                      const size_t offset = piece * grainSize;
+                      InIt it = first + offset;
+                      const InIt end = first + std::min( count, offset + grainSize );
+                      OutIt dst = out + offset;
+                      Value sum = piece == 0 ? *it : op( pieceSums[ piece - 1 ], *it );
+                      *dst = sum;
+                      while ( ++it != end )
+                      {
+                         sum = op( sum, *it );
+                         *++dst = sum;
+                      }
+                   }
+                },
+                1 );
+}
+
+#endif  // _PARALLEL_ALGORITHMS_H_
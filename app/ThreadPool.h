@@ -3,163 +3,284 @@
 
 #include <thread>
 #include <vector>
-#include <queue>
+#include <deque>
+#include <cstddef>
 #include <functional>
+#include <new>
+#include <tuple>
+#include <type_traits>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <future>
 #include <memory>
 #include <utility>
+#include <inttypes.h>
 #include <assert.h>
 
-class ThreadPool
+// Chase-Lev work stealing deque. Only the owner thread pushes and pops, at the bottom,
+// in LIFO order. Any other thread can steal from the top, in FIFO order. None of the
+// operations lock; the owner and a thief only race on the last item, settled by a CAS
+// on the top.
+//
+// The ring buffer grows when full. The previous buffers are kept until the deque is
+// destroyed, since a thief may still be reading from one of them.
+template <typename T>
+class WorkStealingDeque
 {
   public:
-   using Job = std::function<void()>;
+   static constexpr int64_t INITIAL_CAPACITY = 256;
 
-   class JobQueue
+   WorkStealingDeque() : _top( 0 ), _bottom( 0 )
    {
-      std::queue<Job> _jobs;
-      std::mutex _mutex;
-      std::condition_variable _isReady;
-      bool _stopped;
+      _buffers.emplace_back( new Buffer( INITIAL_CAPACITY ) );
+      _buffer.store( _buffers.back().get(), std::memory_order_relaxed );
+   }
 
-     public:
-      JobQueue() : _stopped( false ) {}
-      template <typename T>
-      bool tryAddJob( std::shared_ptr<std::packaged_task<T> >&& job )
+   WorkStealingDeque( const WorkStealingDeque& ) = delete;
+   WorkStealingDeque& operator=( const WorkStealingDeque& ) = delete;
+
+   // Owner only
+   void push( T* item )
+   {
+      const int64_t b = _bottom.load( std::memory_order_relaxed );
+      const int64_t t = _top.load( std::memory_order_acquire );
+      Buffer* buffer = _buffer.load( std::memory_order_relaxed );
+      if ( b - t > buffer->mask )
       {
-         {
-            std::unique_lock<std::mutex> lock( _mutex, std::try_to_lock );
-            if ( !lock.owns_lock() )
-               return false;
-            _jobs.emplace( [job]() { ( *job )(); } );
-         }
-         _isReady.notify_one();
-         return true;
+         buffer = grow( buffer, t, b );
       }
+      buffer->at( b ).store( item, std::memory_order_relaxed );
+      // Publishes the item to the thieves reading the bottom
+      _bottom.store( b + 1, std::memory_order_release );
+   }
+
+   // Owner only. Returns nullptr if the deque is empty.
+   T* pop()
+   {
+      const int64_t b = _bottom.load( std::memory_order_relaxed ) - 1;
+      Buffer* buffer = _buffer.load( std::memory_order_relaxed );
+      _bottom.store( b, std::memory_order_seq_cst );
+      int64_t t = _top.load( std::memory_order_seq_cst );
 
-      // This will block the thread, waiting to add the job
-      template <typename T>
-      void addJob( std::shared_ptr<std::packaged_task<T> >&& job )
+      T* item = nullptr;
+      if ( t <= b )
       {
+         item = buffer->at( b ).load( std::memory_order_relaxed );
+         if ( t == b )
          {
-            std::unique_lock<std::mutex> lock( _mutex );
-            _jobs.emplace( [job]() { ( *job )(); } );
+            // Last item, a thief may be taking it at the same time
+            if ( !_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                                                std::memory_order_relaxed ) )
+            {
+               item = nullptr;
+            }
+            _bottom.store( b + 1, std::memory_order_relaxed );
          }
-         _isReady.notify_one();
       }
+      else
+      {
+         _bottom.store( b + 1, std::memory_order_relaxed );
+      }
+      return item;
+   }
 
-      bool tryGetJob( Job& job )
+   // Any thread. Returns nullptr if the deque is empty or if another thread won the race
+   // for the top item.
+   T* steal()
+   {
+      int64_t t = _top.load( std::memory_order_seq_cst );
+      const int64_t b = _bottom.load( std::memory_order_seq_cst );
+      if ( t >= b )
       {
-         std::unique_lock<std::mutex> lock( _mutex, std::try_to_lock );
-         if ( !lock.owns_lock() || _jobs.empty() )
-            return false;
-         job = std::move( _jobs.front() );
-         _jobs.pop();
-         return true;
+         return nullptr;
       }
 
-      // This will block the thread, waiting for a job.
-      bool getJob( Job& job )
+      Buffer* buffer = _buffer.load( std::memory_order_acquire );
+      T* item = buffer->at( t ).load( std::memory_order_relaxed );
+      if ( !_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed ) )
       {
-         std::unique_lock<std::mutex> lock( _mutex );
-         while ( _jobs.empty() && !_stopped )
-            _isReady.wait( lock );
-         if ( _jobs.empty() )
-            return false;
-         job = std::move( _jobs.front() );
-         _jobs.pop();
-         return true;
+         return nullptr;
       }
+      return item;
+   }
 
-      void stop()
+   bool empty() const
+   {
+      return _top.load( std::memory_order_relaxed ) >= _bottom.load( std::memory_order_relaxed );
+   }
+
+  private:
+   struct Buffer
+   {
+      explicit Buffer( int64_t capacity )
+          : mask( capacity - 1 ), items( new std::atomic<T*>[ capacity ] )
       {
-         {
-            std::unique_lock<std::mutex> lock( _mutex );
-            _stopped = true;
-         }
-         _isReady.notify_all();
+         assert( ( capacity & mask ) == 0 && "Capacity must be a power of two" );
       }
+      std::atomic<T*>& at( int64_t i ) { return items[ i & mask ]; }
+
+      const int64_t mask;
+      std::unique_ptr<std::atomic<T*>[]> items;
    };
 
+   Buffer* grow( Buffer* buffer, int64_t top, int64_t bottom )
+   {
+      Buffer* newBuffer = new Buffer( ( buffer->mask + 1 ) * 2 );
+      for ( int64_t i = top; i < bottom; ++i )
+      {
+         newBuffer->at( i ).store( buffer->at( i ).load( std::memory_order_relaxed ),
+                                   std::memory_order_relaxed );
+      }
+      _buffers.emplace_back( newBuffer );
+      _buffer.store( newBuffer, std::memory_order_release );
+      return newBuffer;
+   }
 
-   std::vector<std::thread> _threads;
-   std::vector<JobQueue> _queues;
-   std::atomic<size_t> _queueIndex;
-   size_t _queueCount;
+   // The top is written by the thieves and the bottom by the owner, keep them apart.
+   alignas( 64 ) std::atomic<int64_t> _top;
+   alignas( 64 ) std::atomic<int64_t> _bottom;
+   std::atomic<Buffer*> _buffer;
+   // Owner only
+   std::vector<std::unique_ptr<Buffer>> _buffers;
+};
 
+// Each worker owns a work stealing deque. The jobs added from a worker go to its own deque
+// and are run in LIFO order while they are still hot in cache, the idle workers steal the
+// oldest ones. The jobs added from any other thread go to a shared injector queue.
+//
+// Workers look in their deque, then in the injector, then steal from the others, and go
+// to sleep once they found nothing. Adding a job wakes one of the sleeping workers.
+//
+// Jobs are stored in cache line sized blocks recycled through per thread caches, so adding
+// a job with submit() does not allocate as long as its callable fits in the block.
+class ThreadPool
+{
   public:
+   // Number of jobs submitted with it and not finished yet
+   class JobCounter
+   {
+     public:
+      JobCounter() : _pending( 0 ) {}
+      JobCounter( const JobCounter& ) = delete;
+      JobCounter& operator=( const JobCounter& ) = delete;
+
+      bool done() const { return _pending.load( std::memory_order_acquire ) == 0; }
+
+     private:
+      friend class ThreadPool;
+      std::atomic<uint32_t> _pending;
+   };
+
+   // Type erased callable. Callables up to INLINE_SIZE bytes are stored in the job itself,
+   // the bigger ones are allocated on the heap.
+   class alignas( 64 ) Job
+   {
+     public:
+      static constexpr size_t INLINE_SIZE = 40;
+
+      template <typename F>
+      Job( F&& f, JobCounter* counter ) : _counter( counter )
+      {
+         using Fn = typename std::decay<F>::type;
+         if constexpr ( sizeof( Fn ) <= INLINE_SIZE &&
+                        alignof( Fn ) <= alignof( std::max_align_t ) )
+         {
+            new ( _storage ) Fn( std::forward<F>( f ) );
+            _invoke = []( void* storage ) { ( *static_cast<Fn*>( storage ) )(); };
+            _destroy = []( void* storage ) { static_cast<Fn*>( storage )->~Fn(); };
+         }
+         else
+         {
+            new ( _storage ) Fn*( new Fn( std::forward<F>( f ) ) );
+            _invoke = []( void* storage ) { ( **static_cast<Fn**>( storage ) )(); };
+            _destroy = []( void* storage ) { delete *static_cast<Fn**>( storage ); };
+         }
+      }
+      ~Job() { _destroy( _storage ); }
+
+      Job( const Job& ) = delete;
+      Job& operator=( const Job& ) = delete;
+
+      void operator()() { _invoke( _storage ); }
+      JobCounter* counter() const { return _counter; }
+
+     private:
+      alignas( std::max_align_t ) unsigned char _storage[ INLINE_SIZE ];
+      void ( *_invoke )( void* );
+      void ( *_destroy )( void* );
+      JobCounter* _counter;
+   };
+   static_assert( sizeof( Job ) == 64, "Jobs should fill a cache line" );
+
    ThreadPool( size_t threadCount )
-       : _queues( threadCount ), _queueIndex( 0 ), _queueCount( threadCount )
+       : _queues( threadCount ), _stopped( false ), _sleepers( 0 ), _epoch( 0 )
    {
       _threads.reserve( threadCount );
       for ( size_t i = 0; i < threadCount; ++i )
       {
-         _threads.emplace_back( [this, threadCount, i]() {
-            for ( ;; )
-            {
-               Job job;
-               {
-                  // Try to get a job from current queue. If it fails, steal
-                  // a job from one of the other queue.
-                  for ( size_t j = 0; j < ( threadCount * 32 ) && !job; ++j )
-                  {
-                     _queues[ ( i + j ) % threadCount ].tryGetJob( job );
-                  }
-
-                  // If stealing did not work either, wait until we have a
-                  // job in our queue. If getJob fails, it means the thread
-                  // is shutting down, so our work is done here.
-                  if ( !job )
-                  {
-                     if ( !_queues[ i ].getJob( job ) )
-                        return;
-                  }
-
-                  // We should have a job if we get here.
-                  assert( job );
-               }
-
-               // Execute the job
-               job();
-            }
-         } );
+         _threads.emplace_back( [this, i]() { workerLoop( i ); } );
       }
    }
 
+   size_t threadCount() const { return _threads.size(); }
+
+   // Adds a job and returns a future to its result
    template <class F, class... Args>
    auto addJob( F&& f, Args&&... args )
    {
-      auto jobTask =
-         std::make_shared<std::packaged_task<typename std::result_of<F( Args... )>::type()> >(
-            std::bind( std::forward<F>( f ), std::forward<Args>( args )... ) );
+      auto call = bindArgs( std::forward<F>( f ), std::forward<Args>( args )... );
+      std::packaged_task<decltype( call() )()> jobTask( std::move( call ) );
+
+      auto futureRes = jobTask.get_future();
+      push( newJob( std::move( jobTask ), nullptr ) );
+      return futureRes;
+   }
 
-      auto futureRes = jobTask->get_future();
+   // Adds a job without any way to know when it is done
+   template <class F, class... Args>
+   void submit( F&& f, Args&&... args )
+   {
+      push( newJob( bindArgs( std::forward<F>( f ), std::forward<Args>( args )... ), nullptr ) );
+   }
+
+   // Adds a job, counted by 'counter' until it is done
+   template <class F, class... Args>
+   void submit( JobCounter& counter, F&& f, Args&&... args )
+   {
+      counter._pending.fetch_add( 1, std::memory_order_relaxed );
+      push( newJob( bindArgs( std::forward<F>( f ), std::forward<Args>( args )... ),
+                    &counter ) );
+   }
 
-      auto i = _queueIndex++;
-      for ( size_t j = 0; j < _queueCount; ++j )
+   // Runs the pending jobs of the pool until all the jobs of 'counter' are done. Can be
+   // called from a job.
+   void wait( const JobCounter& counter )
+   {
+      const WorkerId& worker = currentWorker();
+      const size_t index = worker.pool == this ? worker.index : NOT_A_WORKER;
+      while ( !counter.done() )
       {
-         const size_t qIndex = ( i + j ) % _queueCount;
-         if ( _queues[ qIndex ].tryAddJob( std::forward<decltype( jobTask )>( jobTask ) ) )
+         if ( Job* job = findJob( index ) )
+         {
+            runJob( job );
+         }
+         else
          {
-            return futureRes;
+            std::this_thread::yield();
          }
       }
-
-      // Blocks until we have added the job
-      _queues[ i % _queueCount ].addJob( std::forward<decltype( jobTask )>( jobTask ) );
-
-      return futureRes;
    }
 
+   // The workers finish the jobs they can find and exit.
    void stop()
    {
-      for ( auto& q : _queues )
       {
-         q.stop();
+         std::lock_guard<std::mutex> lock( _sleepMutex );
+         _stopped.store( true );
       }
+      _wakeUp.notify_all();
    }
 
    ~ThreadPool()
@@ -169,7 +290,304 @@ class ThreadPool
       {
          t.join();
       }
+
+      // Jobs added after stop were never run
+      for ( Job* job : _injector )
+      {
+         deleteJob( job );
+      }
+      for ( WorkerQueue& queue : _queues )
+      {
+         while ( Job* job = queue.jobs.pop() )
+         {
+            deleteJob( job );
+         }
+      }
    }
+
+  private:
+   static constexpr size_t NOT_A_WORKER = ~size_t( 0 );
+
+   // Aligned so that the deques of two workers never share a cache line
+   struct alignas( 64 ) WorkerQueue
+   {
+      WorkStealingDeque<Job> jobs;
+   };
+
+   // Pool and index of the worker running on the calling thread, if any
+   struct WorkerId
+   {
+      const ThreadPool* pool;
+      size_t index;
+   };
+   static WorkerId& currentWorker()
+   {
+      static thread_local WorkerId worker = {nullptr, 0};
+      return worker;
+   }
+
+   // Free job blocks, linked through their first bytes
+   struct FreeJob
+   {
+      FreeJob* next;
+   };
+   struct FreeList
+   {
+      FreeJob* head;
+      uint32_t count;
+   };
+
+   // Free blocks shared by all the threads, in lists of about BATCH_SIZE blocks
+   class JobDepot
+   {
+     public:
+      static constexpr uint32_t BATCH_SIZE = 64;
+
+      FreeList take()
+      {
+         std::lock_guard<std::mutex> lock( _mutex );
+         if ( !_lists.empty() )
+         {
+            const FreeList list = _lists.back();
+            _lists.pop_back();
+            return list;
+         }
+
+         _chunks.emplace_back( new Block[ BATCH_SIZE ] );
+         Block* blocks = _chunks.back().get();
+         FreeList list = {nullptr, BATCH_SIZE};
+         for ( uint32_t i = 0; i < BATCH_SIZE; ++i )
+         {
+            FreeJob* freeJob = reinterpret_cast<FreeJob*>( &blocks[ i ] );
+            freeJob->next = list.head;
+            list.head = freeJob;
+         }
+         return list;
+      }
+
+      void give( const FreeList& list )
+      {
+         std::lock_guard<std::mutex> lock( _mutex );
+         _lists.push_back( list );
+      }
+
+     private:
+      struct alignas( alignof( Job ) ) Block
+      {
+         unsigned char bytes[ sizeof( Job ) ];
+      };
+
+      std::mutex _mutex;
+      std::vector<FreeList> _lists;
+      std::vector<std::unique_ptr<Block[]>> _chunks;
+   };
+
+   // Two lists of free blocks per thread: the depot is only used once the thread allocated
+   // or freed BATCH_SIZE blocks in a row.
+   struct JobCache
+   {
+      FreeList loaded = {nullptr, 0};
+      FreeList spare = {nullptr, 0};
+
+      ~JobCache()
+      {
+         if ( loaded.count )
+            depot().give( loaded );
+         if ( spare.count )
+            depot().give( spare );
+      }
+   };
+
+   static JobDepot& depot()
+   {
+      static JobDepot jobDepot;
+      return jobDepot;
+   }
+   static JobCache& jobCache()
+   {
+      static thread_local JobCache cache;
+      return cache;
+   }
+
+   template <class F, class... Args>
+   static auto bindArgs( F&& f, Args&&... args )
+   {
+      return [f = std::forward<F>( f ),
+              args = std::make_tuple( std::forward<Args>( args )... )]() mutable {
+         return std::apply( f, args );
+      };
+   }
+
+   template <typename F>
+   static Job* newJob( F&& f, JobCounter* counter )
+   {
+      JobCache& cache = jobCache();
+      if ( cache.loaded.count == 0 )
+      {
+         if ( cache.spare.count )
+         {
+            std::swap( cache.loaded, cache.spare );
+         }
+         else
+         {
+            cache.loaded = depot().take();
+         }
+      }
+
+      FreeJob* block = cache.loaded.head;
+      cache.loaded.head = block->next;
+      --cache.loaded.count;
+      return new ( block ) Job( std::forward<F>( f ), counter );
+   }
+
+   static void deleteJob( Job* job )
+   {
+      job->~Job();
+
+      JobCache& cache = jobCache();
+      if ( cache.loaded.count >= JobDepot::BATCH_SIZE )
+      {
+         if ( cache.spare.count )
+         {
+            depot().give( cache.spare );
+         }
+         cache.spare = cache.loaded;
+         cache.loaded = {nullptr, 0};
+      }
+
+      FreeJob* block = reinterpret_cast<FreeJob*>( job );
+      block->next = cache.loaded.head;
+      cache.loaded.head = block;
+      ++cache.loaded.count;
+   }
+
+   static void runJob( Job* job )
+   {
+      ( *job )();
+      // The job is released before its counter, the waiter may free what it captured.
+      JobCounter* counter = job->counter();
+      deleteJob( job );
+      if ( counter )
+      {
+         counter->_pending.fetch_sub( 1, std::memory_order_release );
+      }
+   }
+
+   void push( Job* job )
+   {
+      const WorkerId& worker = currentWorker();
+      if ( worker.pool == this )
+      {
+         _queues[ worker.index ].jobs.push( job );
+      }
+      else
+      {
+         std::lock_guard<std::mutex> lock( _injectorMutex );
+         _injector.push_back( job );
+      }
+
+      // A worker going to sleep either sees the new epoch or is seen as a sleeper.
+      _epoch.fetch_add( 1 );
+      if ( _sleepers.load() > 0 )
+      {
+         {
+            std::lock_guard<std::mutex> lock( _sleepMutex );
+         }
+         _wakeUp.notify_one();
+      }
+   }
+
+   // 'index' is NOT_A_WORKER when called from a thread outside of the pool
+   Job* findJob( size_t index )
+   {
+      if ( index != NOT_A_WORKER )
+      {
+         if ( Job* job = _queues[ index ].jobs.pop() )
+         {
+            return job;
+         }
+      }
+
+      {
+         std::lock_guard<std::mutex> lock( _injectorMutex );
+         if ( !_injector.empty() )
+         {
+            Job* job = _injector.front();
+            _injector.pop_front();
+            return job;
+         }
+      }
+
+      const size_t queueCount = _queues.size();
+      const size_t first = index != NOT_A_WORKER ? index + 1 : 0;
+      for ( size_t i = 0; i < queueCount; ++i )
+      {
+         const size_t victim = ( first + i ) % queueCount;
+         if ( victim == index )
+         {
+            continue;
+         }
+         if ( Job* job = _queues[ victim ].jobs.steal() )
+         {
+            return job;
+         }
+      }
+      return nullptr;
+   }
+
+   void workerLoop( size_t index )
+   {
+      currentWorker() = {this, index};
+
+      for ( ;; )
+      {
+         const uint64_t epoch = _epoch.load();
+         Job* job = findJob( index );
+         if ( !job )
+         {
+            // A steal can fail on a race with another thief, so look again before sleeping.
+            for ( uint32_t attempt = 0; attempt < SPIN_ATTEMPTS && !job; ++attempt )
+            {
+               std::this_thread::yield();
+               job = findJob( index );
+            }
+         }
+
+         if ( !job )
+         {
+            std::unique_lock<std::mutex> lock( _sleepMutex );
+            if ( _stopped.load() )
+            {
+               return;
+            }
+            _sleepers.fetch_add( 1 );
+            while ( _epoch.load() == epoch && !_stopped.load() )
+            {
+               _wakeUp.wait( lock );
+            }
+            _sleepers.fetch_sub( 1 );
+            continue;
+         }
+
+         runJob( job );
+      }
+   }
+
+   static constexpr uint32_t SPIN_ATTEMPTS = 32;
+
+   std::vector<std::thread> _threads;
+   std::vector<WorkerQueue> _queues;
+
+   // Jobs added from outside of the workers
+   std::mutex _injectorMutex;
+   std::deque<Job*> _injector;
+
+   std::mutex _sleepMutex;
+   std::condition_variable _wakeUp;
+   std::atomic<bool> _stopped;
+   std::atomic<uint32_t> _sleepers;
+   // Bumped by every job added, the workers sleep until it changes
+   std::atomic<uint64_t> _epoch;
 };
 
-#endif  // _THREAD_POOL_H_
\ No newline at end of file
+#endif  // _THREAD_POOL_H_
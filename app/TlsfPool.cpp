@@ -0,0 +1,371 @@
+#include "TlsfPool.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <assert.h>
+
+TlsfPool::TlsfPool( uint64_t size, uint64_t reservedChunks )
+    : _blocks( size, reservedChunks ),
+      _flBitmap( 0 ),
+      _slBitmaps(),
+      _freeSpace( size ),
+      _freeBlockCount( 0 )
+{
+   for ( auto& lists : _freeLists )
+   {
+      for ( auto& head : lists )
+      {
+         head = NULL_BLOCK;
+      }
+   }
+
+   // The first block covers the whole pool
+   insertFreeBlock( _blocks.first() );
+}
+
+void TlsfPool::mappingInsert( uint64_t size, uint32_t& fl, uint32_t& sl )
+{
+   assert( size > 0 );
+   if ( size < SL_COUNT )
+   {
+      fl = 0;
+      sl = static_cast<uint32_t>( size );
+   }
+   else
+   {
+      const uint32_t log2 = mostSignificantBit( size );
+      fl = log2 - SL_LOG2 + 1;
+      sl = static_cast<uint32_t>( size >> ( log2 - SL_LOG2 ) ) - SL_COUNT;
+   }
+}
+
+void TlsfPool::mappingSearch( uint64_t size, uint32_t& fl, uint32_t& sl )
+{
+   // Round the size up to the next list so every block of the list found is big enough.
+   if ( size >= SL_COUNT )
+   {
+      size += ( 1ull << ( mostSignificantBit( size ) - SL_LOG2 ) ) - 1;
+   }
+   mappingInsert( size, fl, sl );
+}
+
+uint32_t TlsfPool::findFreeBlock( uint32_t fl, uint32_t sl ) const
+{
+   // First look for a non-empty list in the same first level
+   uint32_t slMap = _slBitmaps[ fl ] & ( ~0u << sl );
+   if ( !slMap )
+   {
+      // Nothing there, take the first non-empty list of a bigger first level.
+      const uint64_t flMap = fl + 1 < FL_COUNT ? _flBitmap & ( ~0ull << ( fl + 1 ) ) : 0;
+      if ( !flMap )
+      {
+         return NULL_BLOCK;
+      }
+
+      fl = countTrailingZeros( flMap );
+      slMap = _slBitmaps[ fl ];
+   }
+
+   sl = countTrailingZeros( slMap );
+   return _freeLists[ fl ][ sl ];
+}
+
+uint32_t TlsfPool::findFittingBlock( uint64_t size, uint64_t alignment ) const
+{
+   // Slow path, only taken when the good fit search failed. The lists between
+   // the requested size and the size with the worst padding may still contain
+   // a block that fits, so go through them.
+   const uint64_t alignmentMask = alignment - 1;
+   uint32_t fl, sl, lastFl, lastSl;
+   mappingInsert( size, fl, sl );
+   mappingSearch( size + alignmentMask, lastFl, lastSl );
+
+   for ( uint32_t list = fl * SL_COUNT + sl; list < lastFl * SL_COUNT + lastSl; ++list )
+   {
+      const uint32_t curFl = list / SL_COUNT;
+      const uint32_t curSl = list % SL_COUNT;
+      if ( !( _slBitmaps[ curFl ] & ( 1u << curSl ) ) )
+         continue;
+
+      for ( uint32_t i = _freeLists[ curFl ][ curSl ]; i != NULL_BLOCK; i = _blocks[ i ].nextFree )
+      {
+         const ChunkList::Chunk& block = _blocks[ i ];
+         const uint64_t padding = ( alignment - ( block.offset & alignmentMask ) ) & alignmentMask;
+         if ( block.size >= size + padding )
+         {
+            return i;
+         }
+      }
+   }
+
+   return NULL_BLOCK;
+}
+
+void TlsfPool::insertFreeBlock( uint32_t blockIdx )
+{
+   ChunkList::Chunk& block = _blocks[ blockIdx ];
+   uint32_t fl, sl;
+   mappingInsert( block.size, fl, sl );
+
+   const uint32_t head = _freeLists[ fl ][ sl ];
+   block.isFree = true;
+   block.prevFree = NULL_BLOCK;
+   block.nextFree = head;
+   if ( head != NULL_BLOCK )
+   {
+      _blocks[ head ].prevFree = blockIdx;
+   }
+   _freeLists[ fl ][ sl ] = blockIdx;
+
+   _flBitmap |= 1ull << fl;
+   _slBitmaps[ fl ] |= 1u << sl;
+   ++_freeBlockCount;
+}
+
+void TlsfPool::removeFreeBlock( uint32_t blockIdx )
+{
+   ChunkList::Chunk& block = _blocks[ blockIdx ];
+   assert( block.isFree );
+   uint32_t fl, sl;
+   mappingInsert( block.size, fl, sl );
+
+   if ( block.prevFree != NULL_BLOCK )
+   {
+      _blocks[ block.prevFree ].nextFree = block.nextFree;
+   }
+   if ( block.nextFree != NULL_BLOCK )
+   {
+      _blocks[ block.nextFree ].prevFree = block.prevFree;
+   }
+
+   if ( _freeLists[ fl ][ sl ] == blockIdx )
+   {
+      _freeLists[ fl ][ sl ] = block.nextFree;
+      if ( block.nextFree == NULL_BLOCK )
+      {
+         // The list is now empty, update the bitmaps.
+         _slBitmaps[ fl ] &= ~( 1u << sl );
+         if ( !_slBitmaps[ fl ] )
+         {
+            _flBitmap &= ~( 1ull << fl );
+         }
+      }
+   }
+
+   block.isFree = false;
+   block.prevFree = NULL_BLOCK;
+   block.nextFree = NULL_BLOCK;
+   --_freeBlockCount;
+}
+
+TlsfPool::Handle TlsfPool::alloc( uint64_t size, uint64_t alignment )
+{
+   assert( size > 0 );
+   const uint64_t alignmentMask = alignment - 1;
+
+   // Look for a list where any block can hold the allocation, whatever
+   // padding is required by the alignment. The head of the list is then
+   // guaranteed to fit.
+   uint32_t fl, sl;
+   mappingSearch( size + alignmentMask, fl, sl );
+   uint32_t blockIdx = findFreeBlock( fl, sl );
+   if ( blockIdx == NULL_BLOCK )
+   {
+      blockIdx = findFittingBlock( size, alignment );
+      if ( blockIdx == NULL_BLOCK )
+      {
+         // Out of space, cannot allocate.
+         return INVALID_HANDLE;
+      }
+   }
+
+   removeFreeBlock( blockIdx );
+
+   ChunkList::Chunk& block = _blocks[ blockIdx ];
+   const uint64_t alignmentPadding = ( alignment - ( block.offset & alignmentMask ) ) & alignmentMask;
+   if ( alignmentPadding )
+   {
+      // Free blocks are always merged and the first block starts at 0, so the
+      // previous block exists and is used. We give it the alignment padding,
+      // like the first fit pool does.
+      assert( block.prev != NULL_BLOCK && !_blocks[ block.prev ].isFree );
+      _blocks[ block.prev ].size += alignmentPadding;
+      block.offset += alignmentPadding;
+      block.size -= alignmentPadding;
+      _freeSpace -= alignmentPadding;
+   }
+
+   // Split the leftover memory in a new free block. The next block is
+   // necessarily used, so there is nothing to merge it with.
+   if ( block.size > size )
+   {
+      insertFreeBlock( _blocks.split( blockIdx, block.size - size ) );
+   }
+
+   _freeSpace -= size;
+
+   return blockIdx;
+}
+
+void TlsfPool::free( Handle handle )
+{
+   // Already freed block
+   assert( !_blocks[ handle ].isFree );
+
+   uint32_t blockIdx = handle;
+   _freeSpace += _blocks[ blockIdx ].size;
+
+   // Merge with the next block
+   const uint32_t nextIdx = _blocks[ blockIdx ].next;
+   if ( nextIdx != NULL_BLOCK && _blocks[ nextIdx ].isFree )
+   {
+      removeFreeBlock( nextIdx );
+      _blocks.mergeNext( blockIdx );
+   }
+
+   // Merge with the previous block. The previous block is kept so the first
+   // block always stays at offset 0.
+   const uint32_t prevIdx = _blocks[ blockIdx ].prev;
+   if ( prevIdx != NULL_BLOCK && _blocks[ prevIdx ].isFree )
+   {
+      removeFreeBlock( prevIdx );
+      _blocks.mergeNext( prevIdx );
+      blockIdx = prevIdx;
+   }
+
+   insertFreeBlock( blockIdx );
+}
+
+bool TlsfPool::tryGrow( Handle& handle, uint64_t newSize )
+{
+   ChunkList::Chunk& block = _blocks[ handle ];
+   assert( !block.isFree );
+   if ( newSize <= block.size )
+   {
+      return true;
+   }
+
+   // Only the free block right after can give us space
+   const uint64_t missingSize = newSize - block.size;
+   const uint32_t nextIdx = block.next;
+   if ( nextIdx == NULL_BLOCK || !_blocks[ nextIdx ].isFree ||
+        _blocks[ nextIdx ].size < missingSize )
+   {
+      return false;
+   }
+
+   // The next block changes size, so it also changes list
+   removeFreeBlock( nextIdx );
+   if ( _blocks[ nextIdx ].size == missingSize )
+   {
+      _blocks.mergeNext( handle );
+   }
+   else
+   {
+      _blocks[ nextIdx ].offset += missingSize;
+      _blocks[ nextIdx ].size -= missingSize;
+      block.size += missingSize;
+      insertFreeBlock( nextIdx );
+   }
+   _freeSpace -= missingSize;
+
+   return true;
+}
+
+void TlsfPool::shrink( Handle& handle, uint64_t newSize )
+{
+   ChunkList::Chunk& block = _blocks[ handle ];
+   assert( !block.isFree && newSize > 0 && newSize <= block.size );
+
+   const uint64_t releasedSize = block.size - newSize;
+   if ( !releasedSize )
+   {
+      return;
+   }
+
+   // Give the space to the next block if it is free, otherwise it becomes a new free block.
+   const uint32_t nextIdx = block.next;
+   if ( nextIdx != NULL_BLOCK && _blocks[ nextIdx ].isFree )
+   {
+      removeFreeBlock( nextIdx );
+      _blocks[ nextIdx ].offset -= releasedSize;
+      _blocks[ nextIdx ].size += releasedSize;
+      block.size = newSize;
+      insertFreeBlock( nextIdx );
+   }
+   else
+   {
+      insertFreeBlock( _blocks.split( handle, releasedSize ) );
+   }
+   _freeSpace += releasedSize;
+}
+
+uint64_t TlsfPool::largestFreeBlock() const
+{
+   if ( !_flBitmap )
+   {
+      return 0;
+   }
+
+   // The biggest block is in the last non-empty list, which only holds blocks of similar sizes.
+   const uint32_t fl = mostSignificantBit( _flBitmap );
+   const uint32_t sl = mostSignificantBit( _slBitmaps[ fl ] );
+   uint64_t largest = 0;
+   for ( uint32_t i = _freeLists[ fl ][ sl ]; i != NULL_BLOCK; i = _blocks[ i ].nextFree )
+   {
+      largest = std::max( largest, _blocks[ i ].size );
+   }
+   return largest;
+}
+
+bool TlsfPool::_debugIsConform() const
+{
+   bool isConform = true;
+
+   // No two free blocks can be neighbours.
+   size_t freeBlockCount = 0;
+   for ( uint32_t i = _blocks.first(); i != NULL_BLOCK; i = _blocks[ i ].next )
+   {
+      const ChunkList::Chunk& block = _blocks[ i ];
+      if ( block.isFree )
+      {
+         ++freeBlockCount;
+         isConform &= block.next == NULL_BLOCK || !_blocks[ block.next ].isFree;
+      }
+      isConform &= block.next == NULL_BLOCK || _blocks[ block.next ].prev == i;
+      assert( isConform );
+   }
+
+   // Every free block must be in the list matching its size and the bitmaps
+   // must match the lists.
+   size_t listedBlockCount = 0;
+   for ( uint32_t fl = 0; fl < FL_COUNT; ++fl )
+   {
+      for ( uint32_t sl = 0; sl < SL_COUNT; ++sl )
+      {
+         const bool listEmpty = _freeLists[ fl ][ sl ] == NULL_BLOCK;
+         isConform &= listEmpty == !( _slBitmaps[ fl ] & ( 1u << sl ) );
+         for ( uint32_t i = _freeLists[ fl ][ sl ]; i != NULL_BLOCK; i = _blocks[ i ].nextFree )
+         {
+            uint32_t blockFl, blockSl;
+            mappingInsert( _blocks[ i ].size, blockFl, blockSl );
+            isConform &= _blocks[ i ].isFree && blockFl == fl && blockSl == sl;
+            ++listedBlockCount;
+         }
+      }
+      isConform &= !_slBitmaps[ fl ] == !( _flBitmap & ( 1ull << fl ) );
+      assert( isConform );
+   }
+
+   isConform &= freeBlockCount == listedBlockCount && freeBlockCount == _freeBlockCount;
+   assert( isConform );
+
+   return isConform;
+}
+
+void TlsfPool::_debugChunks( std::vector<Chunk>& chunks ) const
+{
+   for ( uint32_t i = _blocks.first(); i != NULL_BLOCK; i = _blocks[ i ].next )
+   {
+      chunks.push_back( Chunk{_blocks[ i ].offset, _blocks[ i ].size, _blocks[ i ].isFree} );
+   }
+}
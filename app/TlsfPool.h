@@ -0,0 +1,57 @@
+#ifndef TLSF_POOL_H_
+#define TLSF_POOL_H_
+
+#include "MemoryPoolBackend.h"
+#include "ChunkList.h"
+#include <vector>
+#include <inttypes.h>
+
+// Two-level segregated fit allocator. Free blocks are binned by size in
+// FL_COUNT * SL_COUNT free lists. Two levels of bitmaps give the first
+// non-empty list big enough for a request in constant time.
+//
+// The memory is not touched, so the block headers usually found in a TLSF
+// implementation are kept aside in a ChunkList.
+class TlsfPool : public MemoryPoolBackend
+{
+  public:
+   TlsfPool( uint64_t size, uint64_t reservedChunks );
+   Handle alloc( uint64_t size, uint64_t alignment ) override;
+   void free( Handle handle ) override;
+   uint64_t offset( Handle handle ) const override { return _blocks[ handle ].offset; }
+   uint64_t size( Handle handle ) const override { return _blocks[ handle ].size; }
+   bool tryGrow( Handle& handle, uint64_t newSize ) override;
+   void shrink( Handle& handle, uint64_t newSize ) override;
+   uint64_t spaceLeft() const override { return _freeSpace; }
+   // Only walks the biggest non-empty free list.
+   uint64_t largestFreeBlock() const override;
+   uint32_t chunkCount() const override { return static_cast<uint32_t>( _blocks.chunkCount() ); }
+   uint32_t freeChunkCount() const override { return _freeBlockCount; }
+
+   bool _debugIsConform() const override;
+   void _debugChunks( std::vector<Chunk>& chunks ) const override;
+
+  private:
+   // Each power of two range is split in SL_COUNT linear sub ranges.
+   static constexpr uint32_t SL_LOG2 = 5;
+   static constexpr uint32_t SL_COUNT = 1 << SL_LOG2;
+   // Sizes below SL_COUNT all go in the first level 0.
+   static constexpr uint32_t FL_COUNT = 64 - SL_LOG2 + 1;
+   static constexpr uint32_t NULL_BLOCK = ChunkList::NULL_CHUNK;
+
+   static void mappingInsert( uint64_t size, uint32_t& fl, uint32_t& sl );
+   static void mappingSearch( uint64_t size, uint32_t& fl, uint32_t& sl );
+   uint32_t findFreeBlock( uint32_t fl, uint32_t sl ) const;
+   uint32_t findFittingBlock( uint64_t size, uint64_t alignment ) const;
+   void insertFreeBlock( uint32_t blockIdx );
+   void removeFreeBlock( uint32_t blockIdx );
+
+   ChunkList _blocks;
+   uint64_t _flBitmap;
+   uint32_t _slBitmaps[ FL_COUNT ];
+   uint32_t _freeLists[ FL_COUNT ][ SL_COUNT ];
+   uint64_t _freeSpace;
+   uint32_t _freeBlockCount;
+};
+
+#endif  // TLSF_POOL_H_
@@ -0,0 +1,57 @@
+#ifndef BIT_UTILS_H_
+#define BIT_UTILS_H_
+
+#include <inttypes.h>
+#include <assert.h>
+
+#if defined( _MSC_VER ) && !defined( __clang__ )
+#include <intrin.h>
+#endif
+
+// Index of the least significant set bit. Value must not be 0.
+inline uint32_t countTrailingZeros( uint64_t value )
+{
+   assert( value != 0 );
+#if defined( _MSC_VER ) && !defined( __clang__ )
+   unsigned long index;
+   _BitScanForward64( &index, value );
+   return static_cast<uint32_t>( index );
+#else
+   return static_cast<uint32_t>( __builtin_ctzll( value ) );
+#endif
+}
+
+// Index of the most significant set bit. Value must not be 0.
+inline uint32_t mostSignificantBit( uint64_t value )
+{
+   assert( value != 0 );
+#if defined( _MSC_VER ) && !defined( __clang__ )
+   unsigned long index;
+   _BitScanReverse64( &index, value );
+   return static_cast<uint32_t>( index );
+#else
+   return 63 - static_cast<uint32_t>( __builtin_clzll( value ) );
+#endif
+}
+
+inline uint32_t countSetBits( uint64_t value )
+{
+#if defined( _MSC_VER ) && !defined( __clang__ )
+   return static_cast<uint32_t>( __popcnt64( value ) );
+#else
+   return static_cast<uint32_t>( __builtin_popcountll( value ) );
+#endif
+}
+
+inline bool isPowerOfTwo( uint64_t value )
+{
+   return ( value != 0 ) && !( value & ( value - 1 ) );
+}
+
+// Smallest power of two greater or equal to value. Value must not be 0.
+inline uint64_t nextPowerOfTwo( uint64_t value )
+{
+   return isPowerOfTwo( value ) ? value : 1ull << ( mostSignificantBit( value ) + 1 );
+}
+
+#endif  // BIT_UTILS_H_
@@ -5,7 +5,7 @@ import getopt
 import datetime
 
 outName = "mvp"
-srcFiles = [ "main.cpp", "vulkanGraphic.cpp", "swapChain.cpp", "MemoryPool.cpp", "vMemoryPool.cpp", "vImage.cpp", "vCommandPool.cpp", "Camera.cpp"]
+srcFiles = [ "main.cpp", "vulkanGraphic.cpp", "swapChain.cpp", "MemoryPool.cpp", "FirstFitPool.cpp", "TlsfPool.cpp", "ChunkList.cpp", "BuddyPool.cpp", "MemoryTrace.cpp", "MemoryResource.cpp", "vMemoryPool.cpp", "vSlabAllocator.cpp", "vFrameAllocator.cpp", "vBufferArena.cpp", "vResizableBuffer.cpp", "vTransientAllocator.cpp", "vDefragmenter.cpp", "vImage.cpp", "vCommandPool.cpp", "Camera.cpp"]
 coreInclude = ["../core/"]
 
 # Third parties includes
@@ -8,6 +8,8 @@
 #include <GLFW/glfw3.h>
 
 #include "Camera.h"
+#include "MemoryResource.h"
+#include "ParallelAlgorithms.h"
 #include "utils.h"
 #include "vulkanGraphic.h"
 
@@ -15,6 +17,8 @@
 
 #include <assert.h>
 #include <chrono>
+#include <cstdlib>
+#include <future>
 #include <iostream>
 #include <string>
 
@@ -31,6 +35,7 @@
 using namespace std::chrono_literals;
 
 static constexpr int WINDOW_TITLE_SIZE = 256;
+static constexpr uint64_t MODEL_ARENA_BLOCK_SIZE = 16 * 1024 * 1024;
 
 void* loadSharedLibrary( const char* libNameNoExt, int iMode = 2 )
 {
@@ -147,9 +152,10 @@ const std::vector<uint32_t> indices = {0, 1, 2, 2, 3, 0, 4, 5, 6, 6, 7, 4};
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
-static bool loadModelImp( const std::string& path,
-                          std::vector<Vertex>* vertices,
-                          std::vector<uint32_t>* indices )
+static bool parseModel( ThreadPool* pool,
+                        const std::string& path,
+                        std::pmr::vector<Vertex>* vertices,
+                        std::pmr::vector<uint32_t>* indices )
 {
    tinyobj::attrib_t attrib;
    std::vector<tinyobj::shape_t> shapes;
@@ -159,32 +165,46 @@ static bool loadModelImp( const std::string& path,
    bool success = tinyobj::LoadObj( &attrib, &shapes, &materials, &err, path.c_str() );
    if ( success )
    {
-      vertices->reserve( attrib.vertices.size() / 3 );
-      indices->reserve( attrib.vertices.size() );
+      // One vertex per index. Sizing to the exact count avoids wasting space in the arena.
+      size_t indexCount = 0;
       for ( const auto& shape : shapes )
       {
-         for ( const auto& index : shape.mesh.indices )
-         {
-            Vertex vertex = {};
-            vertex.pos = {attrib.vertices[ 3 * index.vertex_index + 0 ],
-                          attrib.vertices[ 3 * index.vertex_index + 1 ],
-                          attrib.vertices[ 3 * index.vertex_index + 2 ]};
-            if ( !attrib.normals.empty() )
-            {
-               vertex.normal = {attrib.normals[ 3 * index.vertex_index + 0 ],
-                                attrib.normals[ 3 * index.vertex_index + 1 ],
-                                attrib.normals[ 3 * index.vertex_index + 2 ]};
-            }
+         indexCount += shape.mesh.indices.size();
+      }
+      vertices->resize( indexCount );
+      indices->resize( indexCount );
 
-            if ( attrib.texcoords.size() > 0 )
+      // Every index writes its own vertex, so the shapes are split among the pool threads.
+      size_t firstIndex = 0;
+      for ( const auto& shape : shapes )
+      {
+         const auto fillVertices = [&, firstIndex]( size_t begin, size_t end ) {
+            for ( size_t i = begin; i < end; ++i )
             {
-               vertex.texCoord = {attrib.texcoords[ 2 * index.texcoord_index + 0 ],
-                                  1.0f - attrib.texcoords[ 2 * index.texcoord_index + 1 ]};
+               const tinyobj::index_t& index = shape.mesh.indices[ i ];
+               Vertex vertex = {};
+               vertex.pos = {attrib.vertices[ 3 * index.vertex_index + 0 ],
+                             attrib.vertices[ 3 * index.vertex_index + 1 ],
+                             attrib.vertices[ 3 * index.vertex_index + 2 ]};
+               if ( !attrib.normals.empty() )
+               {
+                  vertex.normal = {attrib.normals[ 3 * index.vertex_index + 0 ],
+                                   attrib.normals[ 3 * index.vertex_index + 1 ],
+                                   attrib.normals[ 3 * index.vertex_index + 2 ]};
+               }
+
+               if ( attrib.texcoords.size() > 0 )
+               {
+                  vertex.texCoord = {attrib.texcoords[ 2 * index.texcoord_index + 0 ],
+                                     1.0f - attrib.texcoords[ 2 * index.texcoord_index + 1 ]};
+               }
+
+               ( *vertices )[ firstIndex + i ] = vertex;
+               ( *indices )[ firstIndex + i ] = static_cast<uint32_t>( firstIndex + i );
             }
-
-            vertices->push_back( vertex );
-            indices->push_back( (uint32_t)indices->size() );
-         }
+         };
+         parallelFor( *pool, 0, shape.mesh.indices.size(), fillVertices );
+         firstIndex += shape.mesh.indices.size();
       }
       return true;
    }
@@ -195,13 +215,30 @@ static bool loadModelImp( const std::string& path,
    return false;
 }
 
-#include "ThreadPool.h"
+// Parses the model, then creates its buffers and fills their staging memory once Vulkan is
+// ready. The render thread only has to upload it.
+static bool loadModelImp( ThreadPool* pool,
+                          const std::string& path,
+                          std::shared_future<VulkanGraphic*> vulkan,
+                          std::pmr::vector<Vertex>* vertices,
+                          std::pmr::vector<uint32_t>* indices,
+                          VStagedMesh* mesh )
+{
+   if ( !parseModel( pool, path, vertices, indices ) )
+   {
+      return false;
+   }
+   return vulkan.get()->stageMesh( *vertices, *indices, *mesh );
+}
+
 static auto loadModel( ThreadPool& jobPool,
                        const std::string& path,
-                       std::vector<Vertex>* vertices,
-                       std::vector<uint32_t>* indices )
+                       std::shared_future<VulkanGraphic*> vulkan,
+                       std::pmr::vector<Vertex>* vertices,
+                       std::pmr::vector<uint32_t>* indices,
+                       VStagedMesh* mesh )
 {
-   return jobPool.addJob( loadModelImp, path, vertices, indices );
+   return jobPool.addJob( loadModelImp, &jobPool, path, vulkan, vertices, indices, mesh );
 }
 
 static void initVulkan( VulkanGraphic& VK, GLFWwindow* window )
@@ -360,11 +397,17 @@ int main()
 
    ThreadPool threadPool( std::thread::hardware_concurrency() );
 
-   std::vector<Vertex> vertices;
-   std::vector<uint32_t> indices;
-   auto done = loadModel( threadPool, "../models/armadillo.obj", &vertices, &indices );
-   // auto done = loadModel(threadPool, "../models/crate.obj", &vertices,
-   // &indices);
+   // The model data only lives until it is uploaded, freed all at once with the arena. The
+   // arena blocks are filled right away, so fault their pages in when they are mapped.
+   HugePageMemoryResource hugePages( true );
+   ArenaMemoryResource loadArena( MODEL_ARENA_BLOCK_SIZE, &hugePages );
+   std::pmr::vector<Vertex> vertices( &loadArena );
+   std::pmr::vector<uint32_t> indices( &loadArena );
+   VStagedMesh stagedMesh;
+   std::promise<VulkanGraphic*> vulkanReady;
+   auto done = loadModel( threadPool, "../models/armadillo.obj", vulkanReady.get_future().share(),
+                          &vertices, &indices, &stagedMesh );
+   // auto done = loadModel(threadPool, "../models/crate.obj", ...);
 
    glfwWindowHint( GLFW_CLIENT_API, GLFW_NO_API );
    GLFWwindow* window = glfwCreateWindow( 800, 600, "MVP", nullptr, nullptr );
@@ -378,8 +421,16 @@ int main()
    std::copy( glfwExtensions, glfwExtensions + glfwExtensionCount, extensions.begin() );
 
    VulkanGraphic VK( extensions );
+
+   // Set MVP_MEMORY_TRACE to a file path to record the device memory allocations
+   if ( const char* tracePath = std::getenv( "MVP_MEMORY_TRACE" ) )
+   {
+      VERIFY( VK.startMemoryTrace( tracePath ), "Cannot create memory trace file." );
+   }
+
    initVulkan( VK, window );
    VKPtr = &VK;
+   vulkanReady.set_value( &VK );
 
    cam.setPos( glm::vec3( 0.0f, 0.0f, 10.0f ) );
 
@@ -405,8 +456,15 @@ int main()
    {
       if ( !modelLoaded && done.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready )
       {
-         VK.createVertexBuffer( vertices );
-         VK.createIndexBuffer( indices );
+         if ( done.get() )
+         {
+            VK.createMeshBuffers( stagedMesh );
+         }
+         vertices.clear();
+         vertices.shrink_to_fit();
+         indices.clear();
+         indices.shrink_to_fit();
+         loadArena.release();
          VK.recreateSwapChain();
          modelLoaded = true;
       }
@@ -432,6 +490,12 @@ int main()
       }
    }
 
+   // The loader job may still be using Vulkan, and its staging range must be freed with the rest
+   if ( !modelLoaded && done.get() )
+   {
+      VK.createMeshBuffers( stagedMesh );
+   }
+
    VK.savePipelineCacheToDisk();
 
    threadPool.stop();
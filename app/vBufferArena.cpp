@@ -0,0 +1,243 @@
+#include "vBufferArena.h"
+#include "vDefragmenter.h"
+#include <algorithm>
+#include <assert.h>
+
+VBufferArena::VBufferArena( const VDeleter<VkDevice>& device, VMemoryManager& memoryManager )
+    : _device( device ), _memoryManager( memoryManager )
+{
+}
+
+VBufferArena::~VBufferArena()
+{
+   for ( std::unique_ptr<Block>& block : _blocks )
+   {
+      if ( block )
+      {
+         releaseBlock( *block );
+      }
+   }
+}
+
+void VBufferArena::init( VkBufferUsageFlags usage,
+                         VkMemoryPropertyFlags properties,
+                         uint64_t blockSize,
+                         MemoryPool::Backend backend /*= MemoryPool::Backend::TLSF*/ )
+{
+   assert( blockSize > 0 && _blocks.empty() );
+   _usage = usage;
+   _properties = properties;
+   _blockSize = blockSize;
+   _backend = backend;
+}
+
+void VBufferArena::enableGrowth( uint64_t maxBlockSize,
+                                VCommandPool& commandPool,
+                                VkQueue queue )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   assert( _blockSize > 0 && maxBlockSize >= _blockSize && _blocks.empty() );
+   assert( !( _properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ) );
+   _maxBlockSize = maxBlockSize;
+   _commandPool = &commandPool;
+   _queue = queue;
+}
+
+void VBufferArena::enableDefragmentation( VDefragmenter& defragmenter )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   assert( !_defragmenter && !( _properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ) );
+   _defragmenter = &defragmenter;
+   for ( std::unique_ptr<Block>& block : _blocks )
+   {
+      if ( block )
+      {
+         registerBlock( *block );
+      }
+   }
+}
+
+VBufferRange VBufferArena::allocInBlock( uint32_t blockIdx, uint64_t size, uint64_t alignment )
+{
+   Block& block = *_blocks[ blockIdx ];
+   const MemoryPool::Handle handle = block.ranges.alloc( size, alignment );
+   if ( handle == MemoryPool::INVALID_HANDLE )
+   {
+      return VBufferRange{VK_NULL_HANDLE, 0, 0, nullptr, MemoryPool::INVALID_HANDLE, 0};
+   }
+
+   const uint64_t offset = block.ranges.offset( handle );
+   if ( offset + size > block.storage.size )
+   {
+      // Doubling keeps the number of resizes low when the block fills up range by range
+      resizeBlock( block, std::min( block.ranges.totalPoolSize(),
+                                    std::max( offset + size, 2 * block.storage.size ) ) );
+   }
+
+   uint8_t* const mappedData = static_cast<uint8_t*>( block.storage.memory.data );
+   return VBufferRange{block.storage.buffer, offset, size,
+                       mappedData ? mappedData + offset : nullptr, handle, blockIdx + 1};
+}
+
+VBufferRange VBufferArena::alloc( uint64_t size, uint64_t alignment )
+{
+   assert( _blockSize > 0 && "Arena not initialized" );
+   std::lock_guard<std::mutex> lock( _mutex );
+   for ( uint32_t i = 0; i < _blocks.size(); ++i )
+   {
+      if ( !_blocks[ i ] )
+      {
+         continue;
+      }
+
+      const VBufferRange range = allocInBlock( i, size, alignment );
+      if ( range.block )
+      {
+         return range;
+      }
+   }
+
+   addBlock( std::max( _blockSize, size ) );
+   return allocInBlock( static_cast<uint32_t>( _blocks.size() - 1 ), size, alignment );
+}
+
+void VBufferArena::free( VBufferRange& range )
+{
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      assert( range.block > 0 && range.block <= _blocks.size() && _blocks[ range.block - 1 ] );
+      _blocks[ range.block - 1 ]->ranges.free( range.handle );
+   }
+   range = VBufferRange{VK_NULL_HANDLE, 0, 0, nullptr, MemoryPool::INVALID_HANDLE, 0};
+}
+
+VkBuffer VBufferArena::buffer( const VBufferRange& range ) const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   assert( range.block > 0 && range.block <= _blocks.size() && _blocks[ range.block - 1 ] );
+   return _blocks[ range.block - 1 ]->storage.buffer;
+}
+
+void VBufferArena::addBlock( uint64_t size )
+{
+   _blocks.emplace_back(
+      std::make_unique<Block>( _device, std::max( _maxBlockSize, size ), _backend ) );
+   Block& block = *_blocks.back();
+
+   // The ranges are sub-allocated on the CPU side only, the memory manager sees the whole
+   // block as a single allocation.
+   createResizableBuffer( _device, _memoryManager, _properties, size, _usage, block.storage );
+
+   block.defragId = VDefragmenter::INVALID_ID;
+   if ( _defragmenter )
+   {
+      registerBlock( block );
+   }
+}
+
+void VBufferArena::registerBlock( Block& block )
+{
+   block.defragId = _defragmenter->registerBuffer(
+      block.storage.buffer, block.storage.size, block.storage.usage, block.storage.memory,
+      [this, &block]( VkBuffer newBuffer, const VMemAlloc& newAlloc ) {
+         // The defragmenter destroys the old buffer and frees its memory
+         std::lock_guard<std::mutex> lock( _mutex );
+         block.storage.buffer.release();
+         *&block.storage.buffer = newBuffer;
+         block.storage.memory = newAlloc;
+      } );
+}
+
+void VBufferArena::releaseBlock( Block& block )
+{
+   if ( block.defragId != VDefragmenter::INVALID_ID )
+   {
+      _defragmenter->unregister( block.defragId );
+      block.defragId = VDefragmenter::INVALID_ID;
+   }
+
+   freeResizableBuffer( _memoryManager, block.storage );
+}
+
+void VBufferArena::resizeBlock( Block& block, uint64_t newSize )
+{
+   assert( _commandPool && "Arena blocks cannot grow" );
+
+   // The defragmenter expects its buffers to keep their size
+   const bool registered = block.defragId != VDefragmenter::INVALID_ID;
+   if ( registered )
+   {
+      _defragmenter->unregister( block.defragId );
+      block.defragId = VDefragmenter::INVALID_ID;
+   }
+
+   resizeBuffer( _device, _memoryManager, *_commandPool, _queue, block.storage, newSize );
+
+   if ( registered )
+   {
+      registerBlock( block );
+   }
+}
+
+void VBufferArena::releaseEmptyBlocks()
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   const uint64_t capacity = std::max( _maxBlockSize, _blockSize );
+   bool keptOne = false;
+   for ( std::unique_ptr<Block>& block : _blocks )
+   {
+      if ( !block )
+      {
+         continue;
+      }
+
+      const bool empty = block->ranges.spaceLeft() == block->ranges.totalPoolSize();
+      // Keeping an oversized block would pin its memory for the whole run
+      if ( !keptOne && block->ranges.totalPoolSize() == capacity )
+      {
+         keptOne = true;
+         if ( empty && block->storage.size > _blockSize )
+         {
+            resizeBlock( *block, _blockSize );
+         }
+      }
+      else if ( empty )
+      {
+         releaseBlock( *block );
+         block.reset();
+      }
+   }
+
+   while ( !_blocks.empty() && !_blocks.back() )
+   {
+      _blocks.pop_back();
+   }
+}
+
+uint64_t VBufferArena::usedBytes() const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   uint64_t used = 0;
+   for ( const auto& block : _blocks )
+   {
+      if ( block )
+      {
+         used += block->ranges.totalPoolSize() - block->ranges.spaceLeft();
+      }
+   }
+   return used;
+}
+
+uint64_t VBufferArena::totalBytes() const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   uint64_t total = 0;
+   for ( const auto& block : _blocks )
+   {
+      if ( block )
+      {
+         total += block->storage.size;
+      }
+   }
+   return total;
+}
@@ -0,0 +1,113 @@
+#ifndef VK_BUFFER_ARENA_H_
+#define VK_BUFFER_ARENA_H_
+
+#include "vkUtils.h"
+#include "vMemoryPool.h"
+#include "vResizableBuffer.h"
+#include <vulkan/vulkan.h>
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class VCommandPool;
+class VDefragmenter;
+
+struct VBufferRange
+{
+   // Buffer of the arena block. A block moved by the defragmenter or grown gets a new
+   // buffer, see VBufferArena::buffer.
+   VkBuffer buffer;
+   uint64_t offset;
+   uint64_t size;
+   // Host pointer to the range if the arena memory is host visible, nullptr otherwise.
+   void* data;
+   MemoryPool::Handle handle;
+   // Index + 1 of the arena block, 0 if the allocation failed.
+   uint32_t block;
+};
+
+// Hands out ranges of a few big buffers sharing the same usage and memory properties,
+// instead of creating and binding a VkBuffer for each resource. Each block is a single
+// VkBuffer bound to an allocation of the memory manager, and the ranges are sub-allocated
+// in it. Ranges of the same block can be bound once and used with offsets.
+//
+// Ranges can be allocated and freed from several threads, so loader jobs can fill their
+// staging data themselves.
+class VBufferArena
+{
+  public:
+   VBufferArena( const VDeleter<VkDevice>& device, VMemoryManager& memoryManager );
+   ~VBufferArena();
+
+   // Blocks of blockSize bytes are created as needed. Bigger requests get a block of
+   // their own. Host visible arenas must also be HOST_COHERENT to be written through the
+   // range pointers.
+   void init( VkBufferUsageFlags usage,
+              VkMemoryPropertyFlags properties,
+              uint64_t blockSize,
+              MemoryPool::Backend backend = MemoryPool::Backend::TLSF );
+   // Registers every block with 'defragmenter', which can then move them whole. For
+   // device local arenas only, the host pointers of the ranges do not follow the moves.
+   // The arena must then be used from the thread running the defragmentation, and the
+   // defragmenter must outlive it.
+   void enableDefragmentation( VDefragmenter& defragmenter );
+   // Lets the blocks grow up to maxBlockSize bytes before a new one is created. A block
+   // starts with blockSize bytes and its buffer is resized when a range ends past it, see
+   // resizeBuffer. For device local arenas only, and to be called before the first alloc.
+   // The allocations then wait for the device to be idle when a block grows, and the arena
+   // must be used from a single thread.
+   void enableGrowth( uint64_t maxBlockSize, VCommandPool& commandPool, VkQueue queue );
+
+   VBufferRange alloc( uint64_t size, uint64_t alignment );
+   void free( VBufferRange& range );
+   // Current buffer of the block of 'range'.
+   VkBuffer buffer( const VBufferRange& range ) const;
+
+   // Gives the blocks without any range back to the memory manager. The first block of
+   // blockSize bytes is kept, the blocks made for bigger requests are always released. A
+   // kept block that grew is shrunk back to blockSize once empty.
+   void releaseEmptyBlocks();
+
+   uint64_t usedBytes() const;
+   uint64_t totalBytes() const;
+
+  private:
+   struct Block
+   {
+      Block( const VDeleter<VkDevice>& device, uint64_t capacity, MemoryPool::Backend backend )
+          : storage( device ), ranges( capacity, 256, backend )
+      {
+      }
+
+      // Buffer and memory of the block. Its size is blockSize unless the block grew or
+      // was made for a bigger request.
+      VResizableBuffer storage;
+      // Offsets of the ranges in the buffer, up to the size the block can grow to
+      MemoryPool ranges;
+      uint32_t defragId;
+   };
+
+   VBufferRange allocInBlock( uint32_t blockIdx, uint64_t size, uint64_t alignment );
+   void addBlock( uint64_t size );
+   void registerBlock( Block& block );
+   void releaseBlock( Block& block );
+   void resizeBlock( Block& block, uint64_t newSize );
+
+   const VDeleter<VkDevice>& _device;
+   VMemoryManager& _memoryManager;
+   VDefragmenter* _defragmenter = nullptr;
+   mutable std::mutex _mutex;
+   VkBufferUsageFlags _usage = 0;
+   VkMemoryPropertyFlags _properties = 0;
+   uint64_t _blockSize = 0;
+   // 0 if the blocks cannot grow
+   uint64_t _maxBlockSize = 0;
+   VCommandPool* _commandPool = nullptr;
+   VkQueue _queue = VK_NULL_HANDLE;
+   MemoryPool::Backend _backend = MemoryPool::Backend::TLSF;
+   // Released blocks are kept as nullptr, so the block index of the ranges stays valid.
+   std::vector<std::unique_ptr<Block> > _blocks;
+};
+
+#endif  // VK_BUFFER_ARENA_H_
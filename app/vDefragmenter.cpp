@@ -0,0 +1,328 @@
+#include "vDefragmenter.h"
+#include <algorithm>
+#include <assert.h>
+
+VDefragmenter::VDefragmenter( const VDeleter<VkDevice>& device,
+                              VMemoryManager& memoryManager,
+                              uint32_t framesInFlight )
+    : _device( device ), _memoryManager( memoryManager ), _framesInFlight( framesInFlight )
+{
+}
+
+VDefragmenter::~VDefragmenter()
+{
+   for ( auto& move : _pendingMoves )
+   {
+      destroy( move.newBuffer, move.newImage );
+      _memoryManager.free( move.newAlloc );
+   }
+   for ( auto& retired : _retired )
+   {
+      destroy( retired.buffer, retired.image );
+      _memoryManager.free( retired.alloc );
+   }
+}
+
+uint32_t VDefragmenter::registerBuffer( VkBuffer buffer,
+                                        VkDeviceSize size,
+                                        VkBufferUsageFlags usage,
+                                        const VMemAlloc& alloc,
+                                        BufferMovedCallback onMoved )
+{
+   Resource res = {};
+   res.isImage = false;
+   res.registered = true;
+   res.buffer = buffer;
+   res.bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   res.bufferInfo.size = size;
+   // The buffer is the destination of its own move, and the source of the next one.
+   res.bufferInfo.usage =
+      usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+   res.bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   res.alloc = alloc;
+   res.onBufferMoved = std::move( onMoved );
+
+   if ( !_freeIds.empty() )
+   {
+      const uint32_t id = _freeIds.back();
+      _freeIds.pop_back();
+      _resources[ id ] = std::move( res );
+      return id;
+   }
+
+   _resources.push_back( std::move( res ) );
+   return static_cast<uint32_t>( _resources.size() - 1 );
+}
+
+uint32_t VDefragmenter::registerImage( VkImage image,
+                                       const VkImageCreateInfo& createInfo,
+                                       VkImageLayout layout,
+                                       VkImageAspectFlags aspect,
+                                       const VMemAlloc& alloc,
+                                       ImageMovedCallback onMoved )
+{
+   Resource res = {};
+   res.isImage = true;
+   res.registered = true;
+   res.image = image;
+   res.imageInfo = createInfo;
+   res.imageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+   res.layout = layout;
+   res.aspect = aspect;
+   res.alloc = alloc;
+   res.onImageMoved = std::move( onMoved );
+
+   if ( !_freeIds.empty() )
+   {
+      const uint32_t id = _freeIds.back();
+      _freeIds.pop_back();
+      _resources[ id ] = std::move( res );
+      return id;
+   }
+
+   _resources.push_back( std::move( res ) );
+   return static_cast<uint32_t>( _resources.size() - 1 );
+}
+
+void VDefragmenter::unregister( uint32_t id )
+{
+   assert( id < _resources.size() && _resources[ id ].registered );
+   _resources[ id ].registered = false;
+
+   // A pending move of the resource is dropped when the moves complete, keep the id until then.
+   const bool movePending =
+      std::find_if( _pendingMoves.begin(), _pendingMoves.end(),
+                    [id]( const Move& move ) { return move.id == id; } ) != _pendingMoves.end();
+   if ( !movePending )
+   {
+      _freeIds.push_back( id );
+   }
+}
+
+void VDefragmenter::destroy( VkBuffer buffer, VkImage image )
+{
+   if ( buffer != VK_NULL_HANDLE )
+   {
+      vkDestroyBuffer( _device, buffer, nullptr );
+   }
+   if ( image != VK_NULL_HANDLE )
+   {
+      vkDestroyImage( _device, image, nullptr );
+   }
+}
+
+void VDefragmenter::recordBufferCopy( VkCommandBuffer cmdBuffer,
+                                      const Resource& res,
+                                      VkBuffer newBuffer )
+{
+   VkBufferCopy copyRegion = {};
+   copyRegion.size = res.bufferInfo.size;
+   vkCmdCopyBuffer( cmdBuffer, res.buffer, newBuffer, 1, &copyRegion );
+}
+
+void VDefragmenter::recordImageCopy( VkCommandBuffer cmdBuffer,
+                                     const Resource& res,
+                                     VkImage newImage )
+{
+   VkImageMemoryBarrier barriers[ 2 ] = {};
+   for ( auto& barrier : barriers )
+   {
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.subresourceRange.aspectMask = res.aspect;
+      barrier.subresourceRange.baseMipLevel = 0;
+      barrier.subresourceRange.levelCount = res.imageInfo.mipLevels;
+      barrier.subresourceRange.baseArrayLayer = 0;
+      barrier.subresourceRange.layerCount = res.imageInfo.arrayLayers;
+   }
+
+   barriers[ 0 ].image = res.image;
+   barriers[ 0 ].oldLayout = res.layout;
+   barriers[ 0 ].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+   barriers[ 0 ].srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+   barriers[ 0 ].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+   barriers[ 1 ].image = newImage;
+   barriers[ 1 ].oldLayout = res.imageInfo.initialLayout;
+   barriers[ 1 ].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+   barriers[ 1 ].srcAccessMask = 0;
+   barriers[ 1 ].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+   vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers );
+
+   // Copy every mip level
+   std::vector<VkImageCopy> regions( res.imageInfo.mipLevels );
+   for ( uint32_t mip = 0; mip < res.imageInfo.mipLevels; ++mip )
+   {
+      VkImageCopy& region = regions[ mip ];
+      region.srcSubresource.aspectMask = res.aspect;
+      region.srcSubresource.mipLevel = mip;
+      region.srcSubresource.baseArrayLayer = 0;
+      region.srcSubresource.layerCount = res.imageInfo.arrayLayers;
+      region.dstSubresource = region.srcSubresource;
+      region.srcOffset = {0, 0, 0};
+      region.dstOffset = {0, 0, 0};
+      region.extent.width = std::max( res.imageInfo.extent.width >> mip, 1u );
+      region.extent.height = std::max( res.imageInfo.extent.height >> mip, 1u );
+      region.extent.depth = std::max( res.imageInfo.extent.depth >> mip, 1u );
+   }
+   vkCmdCopyImage( cmdBuffer, res.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, newImage,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>( regions.size() ),
+                   regions.data() );
+
+   // Put both images back in the layout the owner expects
+   barriers[ 0 ].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+   barriers[ 0 ].newLayout = res.layout;
+   barriers[ 0 ].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+   barriers[ 0 ].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+   barriers[ 1 ].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+   barriers[ 1 ].newLayout = res.layout;
+   barriers[ 1 ].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+   barriers[ 1 ].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+   vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 2,
+                         barriers );
+}
+
+uint64_t VDefragmenter::recordMoves( VkCommandBuffer cmdBuffer, uint64_t maxBytes )
+{
+   if ( !_pendingMoves.empty() )
+   {
+      return 0;
+   }
+
+   // Evacuate the least used pools first, starting from the end of each pool.
+   struct Candidate
+   {
+      uint64_t poolUsed;
+      uint64_t offset;
+      uint32_t id;
+   };
+   std::vector<Candidate> candidates;
+   for ( uint32_t id = 0; id < _resources.size(); ++id )
+   {
+      const Resource& res = _resources[ id ];
+      if ( res.registered && !res.alloc.slab )
+      {
+         candidates.push_back(
+            Candidate{_memoryManager.poolUsedSpace( res.alloc ), res.alloc.offset, id} );
+      }
+   }
+   std::sort( candidates.begin(), candidates.end(), []( const Candidate& a, const Candidate& b ) {
+      return a.poolUsed != b.poolUsed ? a.poolUsed < b.poolUsed : a.offset > b.offset;
+   } );
+
+   uint64_t movedBytes = 0;
+   for ( const auto& candidate : candidates )
+   {
+      const Resource& res = _resources[ candidate.id ];
+
+      VkMemoryRequirements requirements;
+      if ( res.isImage )
+         vkGetImageMemoryRequirements( _device, res.image, &requirements );
+      else
+         vkGetBufferMemoryRequirements( _device, res.buffer, &requirements );
+
+      // The first move can go over the budget, so big resources are moved too.
+      if ( movedBytes > 0 && movedBytes + requirements.size > maxBytes )
+      {
+         break;
+      }
+
+      Move move = {candidate.id, VK_NULL_HANDLE, VK_NULL_HANDLE, {}};
+      if ( !_memoryManager.allocForMove( res.alloc, requirements, move.newAlloc ) )
+      {
+         continue;
+      }
+
+      if ( res.isImage )
+      {
+         VK_CALL( vkCreateImage( _device, &res.imageInfo, nullptr, &move.newImage ) );
+         VK_CALL( vkBindImageMemory( _device, move.newImage, move.newAlloc.memory,
+                                     move.newAlloc.offset ) );
+         recordImageCopy( cmdBuffer, res, move.newImage );
+      }
+      else
+      {
+         VK_CALL( vkCreateBuffer( _device, &res.bufferInfo, nullptr, &move.newBuffer ) );
+         VK_CALL( vkBindBufferMemory( _device, move.newBuffer, move.newAlloc.memory,
+                                      move.newAlloc.offset ) );
+         recordBufferCopy( cmdBuffer, res, move.newBuffer );
+      }
+
+      _pendingMoves.push_back( move );
+      movedBytes += requirements.size;
+   }
+
+   if ( movedBytes > 0 )
+   {
+      // Make the copies visible to whatever uses the new resources
+      VkMemoryBarrier barrier = {};
+      barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+      vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0,
+                            nullptr );
+   }
+
+   return movedBytes;
+}
+
+void VDefragmenter::completeMoves()
+{
+   // The callbacks may register or unregister resources, work on a copy.
+   std::vector<Move> moves;
+   moves.swap( _pendingMoves );
+
+   for ( auto& move : moves )
+   {
+      Resource& res = _resources[ move.id ];
+      if ( !res.registered )
+      {
+         // Unregistered while it was being moved, the copy is useless.
+         _retired.push_back( Retired{move.newBuffer, move.newImage, move.newAlloc, 0} );
+         _freeIds.push_back( move.id );
+         continue;
+      }
+
+      // The owner may still have frames in flight using the old resource.
+      _retired.push_back( Retired{res.buffer, res.image, res.alloc, _framesInFlight} );
+      res.buffer = move.newBuffer;
+      res.image = move.newImage;
+      res.alloc = move.newAlloc;
+
+      if ( res.isImage )
+      {
+         const ImageMovedCallback onMoved = res.onImageMoved;
+         onMoved( move.newImage, move.newAlloc );
+      }
+      else
+      {
+         const BufferMovedCallback onMoved = res.onBufferMoved;
+         onMoved( move.newBuffer, move.newAlloc );
+      }
+   }
+}
+
+void VDefragmenter::onNewFrame()
+{
+   // The pools emptied by the moves are released by VMemoryManager::onNewFrame, once they
+   // stayed empty for the trim delay.
+   for ( size_t i = 0; i < _retired.size(); )
+   {
+      Retired& retired = _retired[ i ];
+      if ( retired.framesLeft > 0 )
+      {
+         --retired.framesLeft;
+         ++i;
+         continue;
+      }
+
+      destroy( retired.buffer, retired.image );
+      _memoryManager.free( retired.alloc );
+
+      std::swap( retired, _retired.back() );
+      _retired.pop_back();
+   }
+}
@@ -0,0 +1,108 @@
+#ifndef VK_DEFRAGMENTER_H_
+#define VK_DEFRAGMENTER_H_
+
+#include "vkUtils.h"
+#include "vMemoryPool.h"
+#include <vulkan/vulkan.h>
+#include <functional>
+#include <inttypes.h>
+#include <vector>
+
+// Incremental defragmentation of the VMemoryManager pools. Resources that can
+// be moved are registered with a callback. Each step records the copies of a
+// few of them, up to a byte budget, to places that empty the least used pools
+// or pack the allocations lower in their pool.
+//
+// Vulkan resources cannot be rebound, so a new buffer or image is created on
+// the new memory. Once the copies are done on the GPU, the callback hands the
+// new resource to its owner, which must release the old one without destroying
+// it (VDeleter::release). The old resource and memory are kept alive until the
+// frames that may still use them are done.
+class VDefragmenter
+{
+  public:
+   static constexpr uint32_t INVALID_ID = ~0u;
+
+   using BufferMovedCallback = std::function<void( VkBuffer newBuffer, const VMemAlloc& newAlloc )>;
+   using ImageMovedCallback = std::function<void( VkImage newImage, const VMemAlloc& newAlloc )>;
+
+   // framesInFlight is the number of frames that can use a resource after it was moved.
+   VDefragmenter( const VDeleter<VkDevice>& device,
+                  VMemoryManager& memoryManager,
+                  uint32_t framesInFlight );
+   ~VDefragmenter();
+
+   // Returns an id to unregister the resource before it is destroyed. Resources must have
+   // been created with the TRANSFER_SRC usage to be copied.
+   uint32_t registerBuffer( VkBuffer buffer,
+                            VkDeviceSize size,
+                            VkBufferUsageFlags usage,
+                            const VMemAlloc& alloc,
+                            BufferMovedCallback onMoved );
+   // The image must stay in 'layout' while registered. It is transitioned for the copy, so the
+   // GPU must not be using it when the moves are recorded.
+   uint32_t registerImage( VkImage image,
+                           const VkImageCreateInfo& createInfo,
+                           VkImageLayout layout,
+                           VkImageAspectFlags aspect,
+                           const VMemAlloc& alloc,
+                           ImageMovedCallback onMoved );
+   void unregister( uint32_t id );
+
+   // Records the copies of the next moves in cmdBuffer, up to maxBytes. Returns the number
+   // of bytes that will be moved. No new moves are recorded until completeMoves is called.
+   uint64_t recordMoves( VkCommandBuffer cmdBuffer, uint64_t maxBytes );
+   // To call once the command buffer given to recordMoves is done executing.
+   void completeMoves();
+   // To call once per frame, after waiting on the frame fence. Frees the old resources.
+   void onNewFrame();
+
+   bool hasPendingMoves() const { return !_pendingMoves.empty(); }
+
+  private:
+   struct Resource
+   {
+      bool isImage;
+      bool registered;
+      VkBuffer buffer;
+      VkImage image;
+      VkBufferCreateInfo bufferInfo;
+      VkImageCreateInfo imageInfo;
+      VkImageLayout layout;
+      VkImageAspectFlags aspect;
+      VMemAlloc alloc;
+      BufferMovedCallback onBufferMoved;
+      ImageMovedCallback onImageMoved;
+   };
+
+   struct Move
+   {
+      uint32_t id;
+      VkBuffer newBuffer;
+      VkImage newImage;
+      VMemAlloc newAlloc;
+   };
+
+   struct Retired
+   {
+      VkBuffer buffer;
+      VkImage image;
+      VMemAlloc alloc;
+      uint32_t framesLeft;
+   };
+
+   void recordBufferCopy( VkCommandBuffer cmdBuffer, const Resource& res, VkBuffer newBuffer );
+   void recordImageCopy( VkCommandBuffer cmdBuffer, const Resource& res, VkImage newImage );
+   void destroy( VkBuffer buffer, VkImage image );
+
+   const VDeleter<VkDevice>& _device;
+   VMemoryManager& _memoryManager;
+   const uint32_t _framesInFlight;
+   std::vector<Resource> _resources;
+   // Ids of the unregistered resources, reused first
+   std::vector<uint32_t> _freeIds;
+   std::vector<Move> _pendingMoves;
+   std::vector<Retired> _retired;
+};
+
+#endif  // VK_DEFRAGMENTER_H_
@@ -0,0 +1,84 @@
+#include "vFrameAllocator.h"
+#include "bitUtils.h"
+#include <assert.h>
+
+VFrameAllocator::VFrameAllocator( const VDeleter<VkDevice>& device ) : _device( device )
+{
+}
+
+void VFrameAllocator::init( const VkPhysicalDevice& physDevice,
+                            uint32_t frameCount,
+                            uint64_t gpuSegmentSize,
+                            uint64_t cpuSegmentSize,
+                            VkBufferUsageFlags usage )
+{
+   assert( frameCount > 0 && !_mappedData );
+   _frameCount = frameCount;
+   _gpuSegmentSize = gpuSegmentSize;
+   _cpuSegmentSize = cpuSegmentSize;
+
+   VkBufferCreateInfo bufferInfo = {};
+   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   bufferInfo.size = gpuSegmentSize * frameCount;
+   bufferInfo.usage = usage;
+   bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+   VK_CALL( vkCreateBuffer( _device, &bufferInfo, nullptr, &_buffer ) );
+
+   VkMemoryRequirements memRequirements;
+   vkGetBufferMemoryRequirements( _device, _buffer, &memRequirements );
+
+   // The allocator has its own device memory, so the whole buffer is in a single
+   // mapping, bound at the start of the memory.
+   _memory = std::make_unique<VMemoryPool>(
+      memRequirements.size, physDevice, _device, memRequirements.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT );
+
+   VK_CALL( vkBindBufferMemory( _device, _buffer, *_memory, 0 ) );
+
+   // Host visible pools are mapped for their whole lifetime
+   _mappedData = _memory->mappedData();
+
+   _scratch.resize( cpuSegmentSize * frameCount );
+
+   reset( 0 );
+}
+
+void VFrameAllocator::reset( uint32_t frameIdx )
+{
+   assert( frameIdx < _frameCount );
+   _gpuSegmentStart = frameIdx * _gpuSegmentSize;
+   _cpuSegmentStart = frameIdx * _cpuSegmentSize;
+   _gpuHead = _gpuSegmentStart;
+   _cpuHead = _cpuSegmentStart;
+}
+
+VFrameAlloc VFrameAllocator::alloc( uint64_t size, uint64_t alignment )
+{
+   assert( isPowerOfTwo( alignment ) );
+   const uint64_t offset = ( _gpuHead + alignment - 1 ) & ~( alignment - 1 );
+   if ( offset + size > _gpuSegmentStart + _gpuSegmentSize )
+   {
+      // Out of space for this frame.
+      return VFrameAlloc{_buffer, 0, nullptr};
+   }
+
+   _gpuHead = offset + size;
+   return VFrameAlloc{_buffer, offset, _mappedData + offset};
+}
+
+void* VFrameAllocator::allocScratch( uint64_t size, uint64_t alignment )
+{
+   assert( isPowerOfTwo( alignment ) );
+   // Align the address and not the offset, the vector storage has no particular alignment.
+   const uintptr_t base = reinterpret_cast<uintptr_t>( _scratch.data() );
+   const uint64_t offset = ( ( base + _cpuHead + alignment - 1 ) & ~( alignment - 1 ) ) - base;
+   if ( offset + size > _cpuSegmentStart + _cpuSegmentSize )
+   {
+      // Out of space for this frame.
+      return nullptr;
+   }
+
+   _cpuHead = offset + size;
+   return _scratch.data() + offset;
+}
@@ -0,0 +1,63 @@
+#ifndef VK_FRAME_ALLOCATOR_H_
+#define VK_FRAME_ALLOCATOR_H_
+
+#include "vkUtils.h"
+#include "vMemoryPool.h"
+#include <vulkan/vulkan.h>
+#include <inttypes.h>
+#include <memory>
+#include <vector>
+
+struct VFrameAlloc
+{
+   VkBuffer buffer;
+   uint64_t offset;
+   // Host pointer to the allocation, nullptr if the frame segment is full.
+   void* data;
+};
+
+// Linear allocator for data living for a single frame. The memory is split in
+// one segment per frame in flight. Allocating bumps the head of the current
+// segment and nothing is ever freed individually: the whole segment is reset
+// once the fence of its frame has signaled.
+//
+// The GPU part is a host visible and coherent buffer owned by the allocator
+// and mapped once for its whole lifetime. The CPU part is plain scratch memory.
+class VFrameAllocator
+{
+  public:
+   VFrameAllocator( const VDeleter<VkDevice>& device );
+
+   void init( const VkPhysicalDevice& physDevice,
+              uint32_t frameCount,
+              uint64_t gpuSegmentSize,
+              uint64_t cpuSegmentSize,
+              VkBufferUsageFlags usage );
+
+   // Starts allocating from the segment of frameIdx. The previous content of
+   // the segment is dropped, so the GPU must be done with it.
+   void reset( uint32_t frameIdx );
+
+   VFrameAlloc alloc( uint64_t size, uint64_t alignment );
+   // Returns nullptr if the frame segment is full.
+   void* allocScratch( uint64_t size, uint64_t alignment );
+
+   VkBuffer buffer() const { return _buffer; }
+
+  private:
+   const VDeleter<VkDevice>& _device;
+   VDeleter<VkBuffer> _buffer{_device, vkDestroyBuffer};
+   std::unique_ptr<VMemoryPool> _memory;
+   uint8_t* _mappedData = nullptr;
+   std::vector<uint8_t> _scratch;
+
+   uint32_t _frameCount = 0;
+   uint64_t _gpuSegmentSize = 0;
+   uint64_t _cpuSegmentSize = 0;
+   uint64_t _gpuSegmentStart = 0;
+   uint64_t _cpuSegmentStart = 0;
+   uint64_t _gpuHead = 0;
+   uint64_t _cpuHead = 0;
+};
+
+#endif  // VK_FRAME_ALLOCATOR_H_
@@ -1,4 +1,7 @@
 #include "vMemoryPool.h"
+#include "vSlabAllocator.h"
+#include "bitUtils.h"
+#include <algorithm>
 #include <assert.h>
 
 namespace
@@ -31,6 +34,17 @@ uint32_t findMemoryType( uint32_t typeFilter,
 
    return index;
 }
+
+// Higher is better. Every preferred flag the type has counts for it, and every flag
+// neither required nor preferred counts against it: host visible device memory is
+// scarce, and the host should not read from memory that is device local or uncached.
+int memoryTypeScore( VkMemoryPropertyFlags typeFlags,
+                     VkMemoryPropertyFlags required,
+                     VkMemoryPropertyFlags preferred )
+{
+   return 2 * static_cast<int>( countSetBits( typeFlags & preferred ) ) -
+          static_cast<int>( countSetBits( typeFlags & ~( required | preferred ) ) );
+}
 }
 
 VMemoryPool::VMemoryPool( uint64_t size,
@@ -38,32 +52,72 @@ VMemoryPool::VMemoryPool( uint64_t size,
                           const VDeleter<VkDevice>& device,
                           uint32_t memTypeMask,
                           VkMemoryPropertyFlags type,
-                          uint64_t maxAllocCount /*= 200*/ )
-    : _device( device ), _pool( size, maxAllocCount ), _type( type )
+                          MemoryPool::Backend backend /*= MemoryPool::Backend::TLSF*/,
+                          uint64_t reservedChunks /*= 256*/,
+                          const VkMemoryDedicatedAllocateInfoKHR* dedicatedInfo /*= nullptr*/ )
+    : _device( device ), _pool( size, reservedChunks, backend ), _type( type )
 {
    vkGetPhysicalDeviceMemoryProperties( physDevice, &_memProperties );
    VkMemoryAllocateInfo allocInfo = {};
    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+   allocInfo.pNext = dedicatedInfo;
    allocInfo.allocationSize = size;
    allocInfo.memoryTypeIndex = findMemoryType( memTypeMask, _memProperties, _type );
 
    VK_CALL( vkAllocateMemory( _device, &allocInfo, nullptr, &_memory ) );
+
+   // Mapping once saves a map and unmap on every host access. Non coherent memory is left
+   // unmapped, nothing would flush the writes.
+   const VkMemoryPropertyFlags mappedFlags =
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+   const VkMemoryPropertyFlags typeFlags =
+      _memProperties.memoryTypes[ allocInfo.memoryTypeIndex ].propertyFlags;
+   if ( ( typeFlags & mappedFlags ) == mappedFlags )
+   {
+      void* data;
+      VK_CALL( vkMapMemory( _device, _memory, 0, VK_WHOLE_SIZE, 0, &data ) );
+      _mappedData = static_cast<uint8_t*>( data );
+   }
 }
 
-uint64_t VMemoryPool::alloc( uint64_t size, uint64_t alignment )
+VMemoryPool::~VMemoryPool()
+{
+   if ( _mappedData )
+   {
+      vkUnmapMemory( _device, _memory );
+   }
+}
+
+MemoryPool::Handle VMemoryPool::alloc( uint64_t size, uint64_t alignment )
 {
    return _pool.alloc( size, alignment );
 }
 
 void VMemoryPool::free( VMemAlloc& mem )
 {
-   _pool.free( mem.offset );
+   _pool.free( mem.handle );
 #ifdef DEBUG
    mem.memory = nullptr;
    mem.offset = -1;
+   mem.handle = MemoryPool::INVALID_HANDLE;
 #endif  // DEBUG
 }
 
+bool VMemoryPool::tryGrow( VMemAlloc& mem, uint64_t newSize )
+{
+   return _pool.tryGrow( mem.handle, newSize );
+}
+
+void VMemoryPool::shrink( VMemAlloc& mem, uint64_t newSize )
+{
+   _pool.shrink( mem.handle, newSize );
+}
+
+uint64_t VMemoryPool::offset( MemoryPool::Handle handle ) const
+{
+   return _pool.offset( handle );
+}
+
 uint64_t VMemoryPool::spaceLeft() const
 {
    return _pool.spaceLeft();
@@ -74,6 +128,16 @@ uint64_t VMemoryPool::totalSize() const
    return _pool.totalPoolSize();
 }
 
+void VMemoryPool::getStats( MemoryPool::Stats& stats ) const
+{
+   _pool.getStats( stats );
+}
+
+void VMemoryPool::setLatencyTracking( bool enabled )
+{
+   _pool.setLatencyTracking( enabled );
+}
+
 std::string VMemoryPool::_debugPrint( int totalLength, char empty, char used ) const
 {
    return _pool._debugPrint( totalLength, empty, used );
@@ -87,103 +151,926 @@ VMemoryPool::operator VkDeviceMemory()
 ////////////////////////////////////////
 
 VMemoryManager::VMemoryManager( const VkPhysicalDevice& physDevice,
-                                const VDeleter<VkDevice>& device )
-    : _physDevice( physDevice ), _device( device )
+                                const VDeleter<VkDevice>& device,
+                                MemoryPool::Backend poolBackend /*= MemoryPool::Backend::TLSF*/ )
+    : _physDevice( physDevice ), _device( device ), _poolBackend( poolBackend )
+{
+}
+
+VMemoryManager::~VMemoryManager() = default;
+
+void VMemoryManager::setSlabThreshold( uint64_t threshold )
+{
+   _slabThreshold = threshold;
+}
+
+void VMemoryManager::setPoolPolicy( const PoolPolicy& policy )
+{
+   assert( policy.poolSize > 0 && policy.smallHeapPoolSize > 0 );
+   _poolPolicy = policy;
+}
+
+void VMemoryManager::setPoolTrimDelay( uint32_t frames )
+{
+   _poolTrimDelay = frames;
+}
+
+void VMemoryManager::onNewFrame()
+{
+   ++_frame;
+   trimPools( _poolTrimDelay );
+   if ( _hasMemProperties )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      updateBudget();
+   }
+}
+
+void VMemoryManager::enableMemoryBudget(
+   PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   _getMemoryProperties2 = getMemoryProperties2;
+   if ( _hasMemProperties )
+   {
+      updateBudget();
+   }
+}
+
+void VMemoryManager::enableDedicatedAllocation()
+{
+   _getImageMemoryRequirements2 = reinterpret_cast<PFN_vkGetImageMemoryRequirements2KHR>(
+      vkGetDeviceProcAddr( _device, "vkGetImageMemoryRequirements2KHR" ) );
+}
+
+uint64_t VMemoryManager::poolSize( uint32_t memTypeIdx ) const
 {
+   const uint32_t heapIdx = _memProperties.memoryTypes[ memTypeIdx ].heapIndex;
+   const uint64_t size = _memProperties.memoryHeaps[ heapIdx ].size <= _poolPolicy.smallHeapSize
+                            ? _poolPolicy.smallHeapPoolSize
+                            : _poolPolicy.poolSize;
+
+   // The buddy allocator cannot use the space past the last power of two, so do not allocate it.
+   return _poolBackend == MemoryPool::Backend::BUDDY ? nextPowerOfTwo( size ) : size;
 }
 
 VMemAlloc VMemoryManager::alloc( const VkMemoryRequirements& requirements,
-                                 const VkMemoryPropertyFlags& properties )
+                                 const VkMemoryPropertyFlags& properties,
+                                 const TypeHints& hints /*= {}*/ )
+{
+   const uint32_t memTypeIdx = memoryTypeIndex( requirements, properties, hints );
+   const VMemAlloc mem = std::max( requirements.size, requirements.alignment ) <= _slabThreshold
+                            ? allocFromSlab( memTypeIdx, requirements )
+                            : allocBlock( memTypeIdx, requirements );
+   recordAlloc( mem, requirements, properties );
+   return mem;
+}
+
+VMemAlloc VMemoryManager::allocForImage( VkImage image,
+                                         VkImageTiling tiling,
+                                         const VkMemoryPropertyFlags& properties,
+                                         const TypeHints& hints /*= {}*/ )
+{
+   VkMemoryRequirements requirements;
+   bool prefersDedicated = false;
+   if ( _getImageMemoryRequirements2 )
+   {
+      VkImageMemoryRequirementsInfo2KHR info = {};
+      info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2_KHR;
+      info.image = image;
+      VkMemoryDedicatedRequirementsKHR dedicatedRequirements = {};
+      dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR;
+      VkMemoryRequirements2KHR requirements2 = {};
+      requirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2_KHR;
+      requirements2.pNext = &dedicatedRequirements;
+      _getImageMemoryRequirements2( _device, &info, &requirements2 );
+
+      requirements = requirements2.memoryRequirements;
+      prefersDedicated = dedicatedRequirements.prefersDedicatedAllocation ||
+                         dedicatedRequirements.requiresDedicatedAllocation;
+   }
+   else
+   {
+      vkGetImageMemoryRequirements( _device, image, &requirements );
+   }
+
+   const bool optimal = tiling == VK_IMAGE_TILING_OPTIMAL;
+   const uint32_t memTypeIdx = memoryTypeIndex( requirements, properties, hints, optimal );
+   const uint32_t set = poolSetOf( memTypeIdx, optimal );
+   VMemAlloc mem;
+   if ( prefersDedicated )
+   {
+      mem = allocDedicated( memTypeIdx, requirements, image );
+   }
+   else if ( std::max( requirements.size, requirements.alignment ) <= _slabThreshold )
+   {
+      mem = allocFromSlab( set, requirements );
+   }
+   else
+   {
+      mem = allocBlock( set, requirements, image );
+   }
+   recordAlloc( mem, requirements, properties );
+   return mem;
+}
+
+VMemAlloc VMemoryManager::allocForOptimalImages( const VkMemoryRequirements& requirements,
+                                                 const VkMemoryPropertyFlags& properties,
+                                                 const TypeHints& hints /*= {}*/ )
+{
+   const uint32_t set = poolSetOf( memoryTypeIndex( requirements, properties, hints, true ), true );
+   const VMemAlloc mem = std::max( requirements.size, requirements.alignment ) <= _slabThreshold
+                            ? allocFromSlab( set, requirements )
+                            : allocBlock( set, requirements );
+   recordAlloc( mem, requirements, properties );
+   return mem;
+}
+
+void VMemoryManager::recordAlloc( const VMemAlloc& alloc,
+                                  const VkMemoryRequirements& requirements,
+                                  const VkMemoryPropertyFlags& properties )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   if ( _trace )
+   {
+      const uint32_t id = _trace->recordAlloc( requirements.size, requirements.alignment,
+                                               properties, requirements.memoryTypeBits );
+      _traceIds[ {alloc.memory, alloc.offset} ] = {id, properties};
+   }
+}
+
+void VMemoryManager::recordMove( const VMemAlloc& alloc,
+                                 const VMemAlloc& newAlloc,
+                                 const VkMemoryRequirements& requirements )
+{
+   VkMemoryPropertyFlags properties;
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      const auto it = _traceIds.find( {alloc.memory, alloc.offset} );
+      // Allocations made before the trace started are not in it
+      if ( !_trace || it == _traceIds.end() )
+      {
+         return;
+      }
+      properties = it->second.properties;
+   }
+   recordAlloc( newAlloc, requirements, properties );
+}
+
+void VMemoryManager::recordResize( const VMemAlloc& alloc, uint64_t newSize )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   if ( _trace )
+   {
+      const auto it = _traceIds.find( {alloc.memory, alloc.offset} );
+      if ( it != _traceIds.end() )
+      {
+         _trace->recordResize( it->second.id, newSize );
+      }
+   }
+}
+
+std::vector<VMemAlloc> VMemoryManager::allocBatch(
+   const std::vector<VkMemoryRequirements>& requirements,
+   const VkMemoryPropertyFlags& properties )
+{
+   std::vector<VMemAlloc> allocs( requirements.size() );
+
+   // The whole batch is a single allocation, so it needs a memory type every request supports.
+   uint32_t memTypeBits = ~0u;
+   for ( const auto& req : requirements )
+   {
+      memTypeBits &= req.memoryTypeBits;
+   }
+   if ( requirements.size() < 2 || !memTypeBits )
+   {
+      for ( size_t i = 0; i < requirements.size(); ++i )
+      {
+         allocs[ i ] = alloc( requirements[ i ], properties );
+      }
+      return allocs;
+   }
+
+   std::vector<uint32_t> order( requirements.size() );
+   for ( uint32_t i = 0; i < order.size(); ++i )
+   {
+      order[ i ] = i;
+   }
+   std::sort( order.begin(), order.end(), [&requirements]( uint32_t a, uint32_t b ) {
+      const VkMemoryRequirements& reqA = requirements[ a ];
+      const VkMemoryRequirements& reqB = requirements[ b ];
+      return reqA.alignment != reqB.alignment ? reqA.alignment > reqB.alignment
+                                              : reqA.size > reqB.size;
+   } );
+
+   // Offsets relative to the start of the batch, which is aligned on the biggest alignment.
+   std::vector<uint64_t> offsets( requirements.size() );
+   uint64_t batchSize = 0;
+   for ( uint32_t idx : order )
+   {
+      const uint64_t alignMask = requirements[ idx ].alignment - 1;
+      offsets[ idx ] = ( batchSize + alignMask ) & ~alignMask;
+      batchSize = offsets[ idx ] + requirements[ idx ].size;
+   }
+
+   VkMemoryRequirements batchRequirements = {};
+   batchRequirements.size = batchSize;
+   batchRequirements.alignment = requirements[ order[ 0 ] ].alignment;
+   batchRequirements.memoryTypeBits = memTypeBits;
+   const VMemAlloc batchAlloc =
+      allocBlock( memoryTypeIndex( batchRequirements, properties, {} ), batchRequirements );
+
+   std::lock_guard<std::mutex> lock( _mutex );
+   uint32_t batchIdx;
+   if ( _freeBatches.empty() )
+   {
+      batchIdx = static_cast<uint32_t>( _batchLiveCounts.size() );
+      _batchLiveCounts.push_back( 0 );
+   }
+   else
+   {
+      batchIdx = _freeBatches.back();
+      _freeBatches.pop_back();
+   }
+   _batchLiveCounts[ batchIdx ] = static_cast<uint32_t>( requirements.size() );
+
+   for ( size_t i = 0; i < requirements.size(); ++i )
+   {
+      allocs[ i ] = batchAlloc;
+      allocs[ i ].offset += offsets[ i ];
+      if ( batchAlloc.data )
+      {
+         allocs[ i ].data = static_cast<uint8_t*>( batchAlloc.data ) + offsets[ i ];
+      }
+      allocs[ i ].batch = batchIdx + 1;
+
+      if ( _trace )
+      {
+         const uint32_t id =
+            _trace->recordAlloc( requirements[ i ].size, requirements[ i ].alignment, properties,
+                                 requirements[ i ].memoryTypeBits );
+         _traceIds[ {allocs[ i ].memory, allocs[ i ].offset} ] = {id, properties};
+      }
+   }
+
+   return allocs;
+}
+
+void VMemoryManager::initDeviceProperties()
+{
+   std::call_once( _initOnce, [this]() {
+      vkGetPhysicalDeviceMemoryProperties( _physDevice, &_memProperties );
+
+      std::lock_guard<std::mutex> lock( _mutex );
+      updateBudget();
+      _hasMemProperties = true;
+   } );
+}
+
+VMemoryManager::TypeLocks VMemoryManager::lockAllTypes() const
+{
+   TypeLocks locks;
+   for ( uint32_t i = 0; i < POOL_SET_COUNT; ++i )
+   {
+      locks[ i ] = std::unique_lock<std::mutex>( _typeMutexes[ i ] );
+   }
+   return locks;
+}
+
+uint32_t VMemoryManager::memoryTypeIndex( const VkMemoryRequirements& requirements,
+                                          const VkMemoryPropertyFlags& properties,
+                                          const TypeHints& hints,
+                                          bool optimalImages /*= false*/ )
+{
+   initDeviceProperties();
+
+   uint32_t memTypeIdx =
+      bestMemoryType( requirements, properties, hints.preferred, true, optimalImages );
+   if ( memTypeIdx == VK_MAX_MEMORY_TYPES && hints.demotable &&
+        ( properties & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ) )
+   {
+      // The device can still use host memory, only slower.
+      memTypeIdx = bestMemoryType( requirements, properties & ~VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                   hints.preferred & ~VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true,
+                                   optimalImages );
+      if ( memTypeIdx != VK_MAX_MEMORY_TYPES )
+      {
+         ++_demotedCount;
+      }
+   }
+   if ( memTypeIdx == VK_MAX_MEMORY_TYPES )
+   {
+      // Over the budget everywhere. The driver may still manage it by paging memory out.
+      memTypeIdx =
+         bestMemoryType( requirements, properties, hints.preferred, false, optimalImages );
+   }
+
+   assert( memTypeIdx != VK_MAX_MEMORY_TYPES && "Cannot get memory from device" );
+   return memTypeIdx;
+}
+
+uint32_t VMemoryManager::bestMemoryType( const VkMemoryRequirements& requirements,
+                                         VkMemoryPropertyFlags required,
+                                         VkMemoryPropertyFlags preferred,
+                                         bool withinBudget,
+                                         bool optimalImages ) const
+{
+   // Other threads can change it meanwhile, the choice is only as good as the snapshot.
+   uint64_t heapBudgetsLeft[ VK_MAX_MEMORY_HEAPS ];
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      for ( uint32_t i = 0; i < _memProperties.memoryHeapCount; ++i )
+      {
+         heapBudgetsLeft[ i ] = heapBudgetLeft( i );
+      }
+   }
+
+   uint32_t bestIdx = VK_MAX_MEMORY_TYPES;
+   int bestScore = 0;
+   uint64_t bestBudgetLeft = 0;
+   for ( uint32_t i = 0; i < _memProperties.memoryTypeCount; ++i )
+   {
+      const VkMemoryType& type = _memProperties.memoryTypes[ i ];
+      if ( !( requirements.memoryTypeBits & ( 1u << i ) ) ||
+           ( type.propertyFlags & required ) != required )
+      {
+         continue;
+      }
+
+      const uint64_t budgetLeft = heapBudgetsLeft[ type.heapIndex ];
+      if ( withinBudget &&
+           allocationSize( poolSetOf( i, optimalImages ), requirements ) > budgetLeft )
+      {
+         continue;
+      }
+
+      // On equal scores, the type with the most budget left wins
+      const int score = memoryTypeScore( type.propertyFlags, required, preferred );
+      if ( bestIdx == VK_MAX_MEMORY_TYPES || score > bestScore ||
+           ( score == bestScore && budgetLeft > bestBudgetLeft ) )
+      {
+         bestIdx = i;
+         bestScore = score;
+         bestBudgetLeft = budgetLeft;
+      }
+   }
+   return bestIdx;
+}
+
+bool VMemoryManager::isDedicatedSize( uint32_t memTypeIdx, uint64_t size ) const
+{
+   return ( _poolPolicy.dedicatedThreshold && size >= _poolPolicy.dedicatedThreshold ) ||
+          size > poolSize( memTypeIdx );
+}
+
+uint64_t VMemoryManager::allocationSize( uint32_t poolSet,
+                                         const VkMemoryRequirements& requirements ) const
+{
+   const uint32_t memTypeIdx = memoryTypeOf( poolSet );
+   if ( isDedicatedSize( memTypeIdx, requirements.size ) )
+   {
+      return requirements.size;
+   }
+
+   std::lock_guard<std::mutex> lock( _typeMutexes[ poolSet ] );
+   for ( const PoolEntry* entry : _pools[ poolSet ] )
+   {
+      if ( entry->pool->spaceLeft() >= requirements.size )
+      {
+         return 0;
+      }
+   }
+   return poolSize( memTypeIdx );
+}
+
+void VMemoryManager::updateBudget()
+{
+   if ( _getMemoryProperties2 )
+   {
+      VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+      budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+      VkPhysicalDeviceMemoryProperties2KHR properties = {};
+      properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+      properties.pNext = &budget;
+      _getMemoryProperties2( _physDevice, &properties );
+
+      for ( uint32_t i = 0; i < _memProperties.memoryHeapCount; ++i )
+      {
+         _heapBudget[ i ] = budget.heapBudget[ i ];
+         _heapUsageAtUpdate[ i ] = budget.heapUsage[ i ];
+         _ownHeapUsageAtUpdate[ i ] = _ownHeapUsage[ i ];
+      }
+   }
+   else
+   {
+      // Only our own allocations are known. Leave some room for the rest of the system.
+      for ( uint32_t i = 0; i < _memProperties.memoryHeapCount; ++i )
+      {
+         _heapBudget[ i ] = _memProperties.memoryHeaps[ i ].size / 10 * 8;
+         _heapUsageAtUpdate[ i ] = _ownHeapUsage[ i ];
+         _ownHeapUsageAtUpdate[ i ] = _ownHeapUsage[ i ];
+      }
+   }
+}
+
+uint64_t VMemoryManager::heapUsage( uint32_t heapIdx ) const
+{
+   // What we allocated or freed since the last update is not in the driver numbers yet
+   const uint64_t usage = _heapUsageAtUpdate[ heapIdx ] + _ownHeapUsage[ heapIdx ];
+   return usage > _ownHeapUsageAtUpdate[ heapIdx ] ? usage - _ownHeapUsageAtUpdate[ heapIdx ]
+                                                   : 0;
+}
+
+uint64_t VMemoryManager::heapBudgetLeft( uint32_t heapIdx ) const
+{
+   const uint64_t usage = heapUsage( heapIdx );
+   return _heapBudget[ heapIdx ] > usage ? _heapBudget[ heapIdx ] - usage : 0;
+}
+
+VMemAlloc VMemoryManager::allocInPool( PoolEntry& entry, const VkMemoryRequirements& requirements )
+{
+   VMemoryPool& pool = *entry.pool;
+   const MemoryPool::Handle handle = pool.alloc( requirements.size, requirements.alignment );
+   if ( handle == MemoryPool::INVALID_HANDLE )
+   {
+      return VMemAlloc{VK_NULL_HANDLE, 0, nullptr, MemoryPool::INVALID_HANDLE};
+   }
+   entry.lastUsedFrame = _frame;
+
+   const uint64_t offset = pool.offset( handle );
+   uint8_t* const data = pool.mappedData() ? pool.mappedData() + offset : nullptr;
+   return VMemAlloc{pool, offset, data, handle, entry.id + 1};
+}
+
+VMemAlloc VMemoryManager::allocBlock( uint32_t poolSet,
+                                      const VkMemoryRequirements& requirements,
+                                      VkImage dedicatedImage /*= VK_NULL_HANDLE*/ )
+{
+   const uint32_t memTypeIdx = memoryTypeOf( poolSet );
+   if ( isDedicatedSize( memTypeIdx, requirements.size ) )
+   {
+      return allocDedicated( memTypeIdx, requirements, dedicatedImage );
+   }
+
+   std::lock_guard<std::mutex> lock( _typeMutexes[ poolSet ] );
+   return allocFromPools( poolSet, requirements );
+}
+
+VMemAlloc VMemoryManager::allocFromPools( uint32_t poolSet,
+                                          const VkMemoryRequirements& requirements )
+{
+   const uint32_t memTypeIdx = memoryTypeOf( poolSet );
+   std::vector<PoolEntry*>& validPools = _pools[ poolSet ];
+   for ( PoolEntry* entry : validPools )
+   {
+      const VMemAlloc mem = allocInPool( *entry, requirements );
+      if ( mem.handle != MemoryPool::INVALID_HANDLE )
+      {
+         return mem;
+      }
+   }
+
+   // No pool meets the requirement. Lets create one. Every pool of a memory type has
+   // the same size, allocBlock sends the bigger requests to dedicated allocations.
+   auto newEntry = std::make_unique<PoolEntry>();
+   newEntry->pool = std::make_unique<VMemoryPool>(
+      poolSize( memTypeIdx ), _physDevice, _device, 1u << memTypeIdx,
+      _memProperties.memoryTypes[ memTypeIdx ].propertyFlags, _poolBackend );
+   newEntry->memTypeIdx = memTypeIdx;
+   newEntry->poolSet = poolSet;
+   newEntry->dedicated = false;
+   newEntry->pool->setLatencyTracking( _trackLatency );
+   PoolEntry& entry = *newEntry;
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      addPool( std::move( newEntry ) );
+   }
+   validPools.push_back( &entry );
+
+   return allocInPool( entry, requirements );
+}
+
+VMemAlloc VMemoryManager::allocDedicated( uint32_t memTypeIdx,
+                                          const VkMemoryRequirements& requirements,
+                                          VkImage image )
+{
+   VkMemoryDedicatedAllocateInfoKHR dedicatedInfo = {};
+   dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO_KHR;
+   dedicatedInfo.image = image;
+   const bool useDedicatedInfo = _getImageMemoryRequirements2 && image != VK_NULL_HANDLE;
+
+   // A single chunk, first fit is enough. The pool is only seen by its allocation, so it
+   // does not need the lock of its type.
+   auto entry = std::make_unique<PoolEntry>();
+   entry->pool = std::make_unique<VMemoryPool>(
+      requirements.size, _physDevice, _device, 1u << memTypeIdx,
+      _memProperties.memoryTypes[ memTypeIdx ].propertyFlags, MemoryPool::Backend::FIRST_FIT, 2,
+      useDedicatedInfo ? &dedicatedInfo : nullptr );
+   entry->memTypeIdx = memTypeIdx;
+   entry->poolSet = memTypeIdx;
+   entry->dedicated = true;
+   VMemAlloc mem = allocInPool( *entry, requirements );
+   assert( mem.handle != MemoryPool::INVALID_HANDLE && mem.offset == 0 );
+
+   std::lock_guard<std::mutex> lock( _mutex );
+   mem.pool = addPool( std::move( entry ) ) + 1;
+   return mem;
+}
+
+uint32_t VMemoryManager::addPool( std::unique_ptr<PoolEntry> entry )
 {
-   PoolsType curType{requirements, properties};
-   std::vector<std::unique_ptr<VMemoryPool> >* validPools = nullptr;
-   for ( size_t i = 0; i < _poolsProperties.size(); ++i )
+   uint32_t poolId;
+   if ( _freePoolIds.empty() )
    {
-      if ( curType == _poolsProperties[ i ] )
+      poolId = static_cast<uint32_t>( _poolTable.size() );
+      _poolTable.emplace_back();
+   }
+   else
+   {
+      poolId = _freePoolIds.back();
+      _freePoolIds.pop_back();
+   }
+
+   entry->id = poolId;
+   _ownHeapUsage[ _memProperties.memoryTypes[ entry->memTypeIdx ].heapIndex ] +=
+      entry->pool->totalSize();
+   _poolTable[ poolId ] = std::move( entry );
+   return poolId;
+}
+
+void VMemoryManager::releasePool( uint32_t poolId )
+{
+   const PoolEntry& entry = *_poolTable[ poolId ];
+   _ownHeapUsage[ _memProperties.memoryTypes[ entry.memTypeIdx ].heapIndex ] -=
+      entry.pool->totalSize();
+   _poolTable[ poolId ].reset();
+   _freePoolIds.push_back( poolId );
+}
+
+VMemoryManager::PoolEntry& VMemoryManager::entryOf( const VMemAlloc& alloc ) const
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   assert( alloc.pool > 0 && alloc.pool <= _poolTable.size() && _poolTable[ alloc.pool - 1 ] );
+   return *_poolTable[ alloc.pool - 1 ];
+}
+
+VMemAlloc VMemoryManager::allocFromSlab( uint32_t poolSet,
+                                         const VkMemoryRequirements& requirements )
+{
+   // Slots are aligned on their size, so a slot big enough also satisfies the alignment.
+   const uint64_t slotSize = nextPowerOfTwo(
+      std::max( {requirements.size, requirements.alignment, VSlabAllocator::MIN_SLOT_SIZE} ) );
+   const size_t sizeClass =
+      mostSignificantBit( slotSize ) - mostSignificantBit( VSlabAllocator::MIN_SLOT_SIZE );
+
+   std::lock_guard<std::mutex> typeLock( _typeMutexes[ poolSet ] );
+   auto& slabClasses = _slabClasses[ poolSet ];
+   if ( slabClasses.size() <= sizeClass )
+   {
+      slabClasses.resize( sizeClass + 1, {nullptr, 0} );
+   }
+   if ( !slabClasses[ sizeClass ].first )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      _slabs.emplace_back( std::make_unique<VSlabAllocator>( slotSize ) );
+      slabClasses[ sizeClass ] = {_slabs.back().get(), static_cast<uint32_t>( _slabs.size() )};
+   }
+
+   VSlabAllocator& slab = *slabClasses[ sizeClass ].first;
+   VMemAlloc mem = {};
+   if ( !slab.alloc( mem ) )
+   {
+      // Every slab is full, get a new one from the pools.
+      VkMemoryRequirements slabRequirements = requirements;
+      slabRequirements.size = slab.slabSize();
+      slabRequirements.alignment = slab.slotSize();
+      slab.addSlab( allocFromPools( poolSet, slabRequirements ), _frame );
+
+      const bool slotFound = slab.alloc( mem );
+      assert( slotFound );
+   }
+
+   mem.slab = slabClasses[ sizeClass ].second;
+   return mem;
+}
+
+void VMemoryManager::free( VMemAlloc& alloc )
+{
+   PoolEntry* entry;
+   VSlabAllocator* slab = nullptr;
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      if ( _trace )
+      {
+         // Allocations made before the trace started are not in it
+         const auto it = _traceIds.find( {alloc.memory, alloc.offset} );
+         if ( it != _traceIds.end() )
+         {
+            _trace->recordFree( it->second.id );
+            _traceIds.erase( it );
+         }
+      }
+
+      if ( alloc.slab )
       {
-         // We have found the list of pools that are valid with requested alloc
-         validPools = &_pools[ i ];
-         uint64_t allocOffset = MemoryPool::INVALID_OFFSET;
-         for ( size_t j = 0; j < validPools->size(); ++j )
+         slab = _slabs[ alloc.slab - 1 ].get();
+      }
+      else if ( alloc.batch )
+      {
+         // The pool allocation is shared by the whole batch
+         if ( --_batchLiveCounts[ alloc.batch - 1 ] > 0 )
          {
-            allocOffset = ( *validPools )[ j ]->alloc( requirements.size, requirements.alignment );
-            if ( allocOffset != MemoryPool::INVALID_OFFSET )
-            {
-               return VMemAlloc{*( *validPools )[ j ], allocOffset};
-            }
+            return;
          }
+         _freeBatches.push_back( alloc.batch - 1 );
       }
+
+      assert( alloc.pool > 0 && alloc.pool <= _poolTable.size() );
+      entry = _poolTable[ alloc.pool - 1 ].get();
    }
 
-   // No pool meets the requirement. Lets create one.
+   if ( entry->dedicated )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      entry->pool->free( alloc );
+      releasePool( entry->id );
+      return;
+   }
 
-   // If no pools satisfies the type required, create new list of pools
-   VMemoryPool* pool = nullptr;
-   if ( !validPools )
+   std::lock_guard<std::mutex> typeLock( _typeMutexes[ entry->poolSet ] );
+   if ( slab )
    {
-      // Creates a new list of pool, with a first pool containing enough space to allocate 4 times
-      // the requested amount.
-      _pools.emplace_back();
-      _pools.back().emplace_back( std::make_unique<VMemoryPool>(
-         requirements.size * 4, _physDevice, _device, requirements.memoryTypeBits, properties ) );
+      slab->free( alloc );
+   }
+   else
+   {
+      entry->pool->free( alloc );
+   }
+}
 
-      // Add the new pool properties to the list property.
-      _poolsProperties.emplace_back( requirements, properties );
-      pool = _pools.back().back().get();
+bool VMemoryManager::tryGrow( VMemAlloc& alloc, uint64_t newSize )
+{
+   bool grown;
+   if ( alloc.slab )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      grown = newSize <= _slabs[ alloc.slab - 1 ]->slotSize();
+   }
+   else if ( alloc.batch )
+   {
+      grown = false;
    }
    else
    {
-      // There is already a list of pools satisfying the required types. We need more memory of this
-      // type.
-      // Lets create a new pool, doubling the size of the previous pool.
-      const uint64_t newSize =
-         std::max( validPools->back()->totalSize() * 2, requirements.size * 4 );
-      validPools->emplace_back( std::unique_ptr<VMemoryPool>{std::make_unique<VMemoryPool>(
-         newSize, _physDevice, _device, requirements.memoryTypeBits, properties )} );
-      pool = validPools->back().get();
+      PoolEntry& entry = entryOf( alloc );
+      std::lock_guard<std::mutex> typeLock( _typeMutexes[ entry.poolSet ] );
+      grown = entry.pool->tryGrow( alloc, newSize );
    }
 
-   assert( pool );
+   if ( grown )
+   {
+      recordResize( alloc, newSize );
+   }
+   return grown;
+}
 
-   return VMemAlloc{*pool, pool->alloc( requirements.size, requirements.alignment )};
+void VMemoryManager::shrink( VMemAlloc& alloc, uint64_t newSize )
+{
+   // Slots have a fixed size and batches share their allocation, only the trace sees
+   // them shrink.
+   if ( !alloc.slab && !alloc.batch )
+   {
+      PoolEntry& entry = entryOf( alloc );
+      std::lock_guard<std::mutex> typeLock( _typeMutexes[ entry.poolSet ] );
+      entry.pool->shrink( alloc, newSize );
+   }
+   recordResize( alloc, newSize );
 }
 
-void VMemoryManager::free( VMemAlloc& alloc )
+void VMemoryManager::getStats( Stats& stats ) const
+{
+   const TypeLocks typeLocks = lockAllTypes();
+   std::lock_guard<std::mutex> lock( _mutex );
+
+   stats.totalBytes = 0;
+   stats.usedBytes = 0;
+   stats.poolCount = 0;
+   stats.dedicatedCount = 0;
+   stats.maxFragmentation = 0.0f;
+   stats.demotedCount = _demotedCount;
+   stats.pools.clear();
+   stats.heaps.resize( _hasMemProperties ? _memProperties.memoryHeapCount : 0 );
+   for ( uint32_t i = 0; i < stats.heaps.size(); ++i )
+   {
+      stats.heaps[ i ] = HeapStats{_heapBudget[ i ], heapUsage( i )};
+   }
+   for ( const auto& entry : _poolTable )
+   {
+      if ( !entry )
+      {
+         continue;
+      }
+
+      stats.pools.emplace_back();
+      PoolStats& poolStats = stats.pools.back();
+      poolStats.properties = _memProperties.memoryTypes[ entry->memTypeIdx ].propertyFlags;
+      poolStats.memTypeBits = 1u << entry->memTypeIdx;
+      poolStats.dedicated = entry->dedicated;
+      entry->pool->getStats( poolStats.stats );
+
+      stats.totalBytes += poolStats.stats.totalBytes;
+      stats.usedBytes += poolStats.stats.usedBytes;
+      stats.maxFragmentation = std::max( stats.maxFragmentation, poolStats.stats.fragmentation );
+      if ( entry->dedicated )
+      {
+         ++stats.dedicatedCount;
+      }
+      else
+      {
+         ++stats.poolCount;
+      }
+   }
+}
+
+void VMemoryManager::setLatencyTracking( bool enabled )
+{
+   const TypeLocks typeLocks = lockAllTypes();
+   std::lock_guard<std::mutex> lock( _mutex );
+   _trackLatency = enabled;
+   for ( const auto& entry : _poolTable )
+   {
+      if ( entry )
+      {
+         entry->pool->setLatencyTracking( enabled );
+      }
+   }
+}
+
+bool VMemoryManager::startTrace( const std::string& path )
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   _traceIds.clear();
+   _trace = std::make_unique<MemoryTrace::Writer>( path );
+   if ( !_trace->isOpen() )
+   {
+      _trace.reset();
+      return false;
+   }
+   return true;
+}
+
+void VMemoryManager::stopTrace()
+{
+   std::lock_guard<std::mutex> lock( _mutex );
+   _trace.reset();
+   _traceIds.clear();
+}
+
+uint64_t VMemoryManager::poolUsedSpace( const VMemAlloc& alloc ) const
+{
+   if ( !alloc.pool )
+   {
+      return 0;
+   }
+
+   const PoolEntry& entry = entryOf( alloc );
+   std::lock_guard<std::mutex> typeLock( _typeMutexes[ entry.poolSet ] );
+   return entry.pool->totalSize() - entry.pool->spaceLeft();
+}
+
+bool VMemoryManager::allocForMove( const VMemAlloc& alloc,
+                                   const VkMemoryRequirements& requirements,
+                                   VMemAlloc& newAlloc )
 {
-#ifdef _DEBUG
-   bool allocFreed = false;
-#endif
+   // Slab slots are not moved one by one and dedicated allocations have nowhere to go.
+   // The members of a batch share their pool range, which is only freed with the last one.
+   if ( alloc.slab || alloc.batch || !alloc.pool )
+   {
+      return false;
+   }
+   PoolEntry& curEntry = entryOf( alloc );
+   if ( curEntry.dedicated )
+   {
+      return false;
+   }
 
-   for ( auto& poolList : _pools )
+
+   // Moving to a fuller pool empties the others, so they can be released. Moving
+   // lower in the same pool packs the allocations at its start. Both always make
+   // progress, so allocations cannot go back and forth between two places.
+   std::lock_guard<std::mutex> typeLock( _typeMutexes[ curEntry.poolSet ] );
+   VMemoryPool& curPool = *curEntry.pool;
+   const uint64_t curUsed = curPool.totalSize() - curPool.spaceLeft();
+   for ( PoolEntry* entry : _pools[ curEntry.poolSet ] )
    {
-      for ( auto& pool : poolList )
+      const VMemoryPool& pool = *entry->pool;
+      if ( pool.totalSize() - pool.spaceLeft() <= curUsed )
+      {
+         continue;
+      }
+
+      newAlloc = allocInPool( *entry, requirements );
+      if ( newAlloc.handle != MemoryPool::INVALID_HANDLE )
       {
-         if ( *pool.get() == alloc.memory )
+         recordMove( alloc, newAlloc, requirements );
+         return true;
+      }
+   }
+
+   newAlloc = allocInPool( curEntry, requirements );
+   if ( newAlloc.handle == MemoryPool::INVALID_HANDLE )
+   {
+      return false;
+   }
+
+   if ( newAlloc.offset > alloc.offset )
+   {
+      curPool.free( newAlloc );
+      return false;
+   }
+   recordMove( alloc, newAlloc, requirements );
+   return true;
+}
+
+void VMemoryManager::trimPools( uint64_t idleFrames )
+{
+   const uint64_t frame = _frame;
+   std::vector<VMemAlloc> releasedSlabs;
+   for ( uint32_t poolSet = 0; poolSet < POOL_SET_COUNT; ++poolSet )
+   {
+      std::lock_guard<std::mutex> typeLock( _typeMutexes[ poolSet ] );
+
+      // The memory of the idle slabs goes back to the pools first, so that the pools they
+      // emptied are released after the same delay.
+      releasedSlabs.clear();
+      for ( const auto& slabClass : _slabClasses[ poolSet ] )
+      {
+         if ( slabClass.first )
          {
-            pool->free( alloc );
-#ifdef _DEBUG
-            allocFreed = true;
-#endif
+            slabClass.first->releaseEmptySlabs( frame, idleFrames, releasedSlabs );
          }
       }
-   }
+      for ( VMemAlloc& slabMemory : releasedSlabs )
+      {
+         PoolEntry* entry;
+         {
+            std::lock_guard<std::mutex> lock( _mutex );
+            entry = _poolTable[ slabMemory.pool - 1 ].get();
+         }
+         entry->pool->free( slabMemory );
+      }
 
-#ifdef _DEBUG
-   assert( allocFreed );
-#endif
+      std::vector<PoolEntry*>& pools = _pools[ poolSet ];
+      // From the newest pool, so the oldest one is the one kept.
+      for ( size_t i = pools.size(); i-- > 0; )
+      {
+         PoolEntry& entry = *pools[ i ];
+         if ( entry.pool->spaceLeft() != entry.pool->totalSize() )
+         {
+            entry.lastUsedFrame = frame;
+         }
+         else if ( frame - entry.lastUsedFrame >= idleFrames && pools.size() > 1 )
+         {
+            pools.erase( pools.begin() + i );
+            std::lock_guard<std::mutex> lock( _mutex );
+            releasePool( entry.id );
+         }
+      }
+   }
 }
 
 #include <iostream>
 void VMemoryManager::_debugPrint() const
 {
    using namespace std;
-   for ( size_t i = 0; i < _poolsProperties.size(); ++i )
+   const TypeLocks typeLocks = lockAllTypes();
+   std::lock_guard<std::mutex> lock( _mutex );
+   for ( uint32_t i = 0; i < POOL_SET_COUNT; ++i )
    {
-      cout << "Properties : " << _poolsProperties[ i ]._properties
-           << " | Mem Type bits : " << _poolsProperties[ i ]._memTypeBits << endl;
-      for ( const auto& pool : _pools[ i ] )
+      if ( _pools[ i ].empty() )
+      {
+         continue;
+      }
+
+      const uint32_t memTypeIdx = memoryTypeOf( i );
+      cout << "Memory type : " << memTypeIdx
+           << " | Properties : " << _memProperties.memoryTypes[ memTypeIdx ].propertyFlags
+           << ( i != memTypeIdx ? " | OPTIMAL images" : "" ) << endl;
+      for ( const PoolEntry* entry : _pools[ i ] )
       {
-         cout << pool->_debugPrint( 80, ' ', '=' ) << '\n';
+         cout << entry->pool->_debugPrint( 80, ' ', '=' ) << '\n';
       }
    }
+   for ( const auto& entry : _poolTable )
+   {
+      if ( entry && entry->dedicated )
+      {
+         cout << "Dedicated : " << entry->pool->totalSize() << " bytes | Memory type : "
+              << entry->memTypeIdx << endl;
+      }
+   }
+   for ( const auto& slab : _slabs )
+   {
+      cout << slab->_debugPrint() << '\n';
+   }
 }
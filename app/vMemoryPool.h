@@ -3,14 +3,36 @@
 
 #include "vkUtils.h"
 #include "MemoryPool.h"
+#include "MemoryTrace.h"
 #include <vulkan/vulkan.h>
 #include <inttypes.h>
+#include <array>
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class VSlabAllocator;
 
 struct VMemAlloc
 {
    VkDeviceMemory memory;
    uint64_t offset;
+   // Host pointer to the allocation if its memory is host visible and coherent, nullptr
+   // otherwise. The host writes are never flushed, so the memory must be HOST_COHERENT to
+   // write through it.
+   void* data;
+   MemoryPool::Handle handle;
+   // Index + 1 of the pool in the VMemoryManager pool table the memory comes from, 0 if
+   // there is none.
+   uint32_t pool;
+   // Index + 1 of the slab allocator the memory comes from. 0 if it comes from a pool.
+   uint32_t slab;
+   // Index + 1 of the batch the allocation is part of, 0 if it is not. The allocations of
+   // a batch share a single pool allocation, given back once all of them are freed.
+   uint32_t batch;
 };
 
 class VMemoryPool
@@ -21,12 +43,24 @@ class VMemoryPool
                 const VDeleter<VkDevice>& device,
                 uint32_t memTypeMask,
                 VkMemoryPropertyFlags type,
-                uint64_t maxAllocCount = 200 );
+                MemoryPool::Backend backend = MemoryPool::Backend::TLSF,
+                uint64_t reservedChunks = 256,
+                const VkMemoryDedicatedAllocateInfoKHR* dedicatedInfo = nullptr );
+   ~VMemoryPool();
 
-   uint64_t alloc( uint64_t size, uint64_t alignment );
+   MemoryPool::Handle alloc( uint64_t size, uint64_t alignment );
    void free( VMemAlloc& mem );
+   // In place resize, see MemoryPool::tryGrow. Updates the handle of 'mem'.
+   bool tryGrow( VMemAlloc& mem, uint64_t newSize );
+   void shrink( VMemAlloc& mem, uint64_t newSize );
+   uint64_t offset( MemoryPool::Handle handle ) const;
+   // Host visible and coherent memory is mapped once for the lifetime of the pool. nullptr
+   // otherwise.
+   uint8_t* mappedData() const { return _mappedData; }
    uint64_t spaceLeft() const;
    uint64_t totalSize() const;
+   void getStats( MemoryPool::Stats& stats ) const;
+   void setLatencyTracking( bool enabled );
    operator VkDeviceMemory();
 
    std::string _debugPrint( int totalLength, char empty, char used ) const;
@@ -37,37 +71,292 @@ class VMemoryPool
    MemoryPool _pool;
    VkPhysicalDeviceMemoryProperties _memProperties;
    VkMemoryPropertyFlags _type;
+   uint8_t* _mappedData = nullptr;
 };
 
+// Can be used from several threads at once. Every memory type has its own lock, held while
+// sub-allocating in its pools, so threads allocating different kinds of memory do not wait
+// on each other. The rest of the bookkeeping is behind a lock held for short lookups only.
+// The OPTIMAL images have pools of their own in every memory type, so they never share a
+// bufferImageGranularity page with the linear resources.
+// The set* and enable* functions are not thread safe, they are for the setup.
 class VMemoryManager
 {
   public:
-   VMemoryManager( const VkPhysicalDevice& physDevice, const VDeleter<VkDevice>& device );
+   // poolBackend is the allocation strategy used by every pool the manager creates.
+   VMemoryManager( const VkPhysicalDevice& physDevice,
+                   const VDeleter<VkDevice>& device,
+                   MemoryPool::Backend poolBackend = MemoryPool::Backend::TLSF );
+   ~VMemoryManager();
+
+   // Allocations of at least dedicatedThreshold bytes get a device memory of their own, the
+   // others are sub-allocated in pools of a fixed size, so the device memory taken grows
+   // by steps known in advance. The pools of the heaps of at most smallHeapSize bytes use
+   // smallHeapPoolSize, so a few of them cannot take the whole heap.
+   struct PoolPolicy
+   {
+      // 0 disables the dedicated allocations
+      uint64_t dedicatedThreshold = 32 * 1024 * 1024;
+      uint64_t poolSize = 256 * 1024 * 1024;
+      uint64_t smallHeapPoolSize = 64 * 1024 * 1024;
+      uint64_t smallHeapSize = 1024 * 1024 * 1024;
+   };
+
+   // Hints for the choice of the memory type of an allocation
+   struct TypeHints
+   {
+      // Flags to get on top of the required ones if a type has them, for instance
+      // HOST_VISIBLE for small device local buffers updated every frame.
+      VkMemoryPropertyFlags preferred;
+      // The allocation can go to host memory when the device local heaps are out of
+      // budget, instead of going over it.
+      bool demotable;
+   };
+
+   struct HeapStats
+   {
+      uint64_t budget;
+      // Device memory used by the whole process, ours included
+      uint64_t usage;
+   };
+
+   struct PoolStats
+   {
+      VkMemoryPropertyFlags properties;
+      uint32_t memTypeBits;
+      // Device memory of a single resource
+      bool dedicated;
+      MemoryPool::Stats stats;
+   };
+
+   struct Stats
+   {
+      // Device memory taken by the pools and the dedicated allocations
+      uint64_t totalBytes;
+      uint64_t usedBytes;
+      uint32_t poolCount;
+      uint32_t dedicatedCount;
+      // Fragmentation of the most fragmented pool
+      float maxFragmentation;
+      // Allocations sent to host memory for lack of device budget, since the creation
+      uint32_t demotedCount;
+      std::vector<PoolStats> pools;
+      // By heap index
+      std::vector<HeapStats> heaps;
+   };
+
+   // The memory type is the one with 'properties' scoring best with 'hints', among the
+   // ones with enough budget left on their heap. Without any, demotable allocations go to
+   // host memory, the others go over the budget.
    VMemAlloc alloc( const VkMemoryRequirements& requirements,
-                    const VkMemoryPropertyFlags& properties );
+                    const VkMemoryPropertyFlags& properties,
+                    const TypeHints& hints = {} );
+   // Same as alloc, for the memory 'image' will be bound to. The image gets a dedicated
+   // allocation when the driver asks for it, see enableDedicatedAllocation. OPTIMAL images
+   // go to the pools and slabs kept for them.
+   VMemAlloc allocForImage( VkImage image,
+                            VkImageTiling tiling,
+                            const VkMemoryPropertyFlags& properties,
+                            const TypeHints& hints = {} );
+   // Same as alloc, for memory shared by several OPTIMAL images, such as aliased render
+   // targets. Taken from the OPTIMAL image pools, like in allocForImage.
+   VMemAlloc allocForOptimalImages( const VkMemoryRequirements& requirements,
+                                    const VkMemoryPropertyFlags& properties,
+                                    const TypeHints& hints = {} );
+   // Allocates every request next to each other in a single pool allocation. Requests are
+   // placed by decreasing alignment, then size, to limit the padding. The allocations are
+   // in the order of the requests and can still be freed one by one. Falls back to
+   // separate allocations if the requests have no memory type in common. Batches come from
+   // the pools of the linear resources, so they are for buffers only.
+   std::vector<VMemAlloc> allocBatch( const std::vector<VkMemoryRequirements>& requirements,
+                                      const VkMemoryPropertyFlags& properties );
    void free( VMemAlloc& alloc );
 
+   // Resizes 'alloc' without moving it. tryGrow returns false and leaves 'alloc' unchanged
+   // when the memory right after it is used. Slab allocations can only grow up to their
+   // slot size and batch allocations cannot be resized.
+   bool tryGrow( VMemAlloc& alloc, uint64_t newSize );
+   void shrink( VMemAlloc& alloc, uint64_t newSize );
+
+   // Requests whose size and alignment are both below or equal to the threshold
+   // are served by fixed size slabs instead of the pools. 0 disables the slabs.
+   void setSlabThreshold( uint64_t threshold );
+   // Only applies to the pools created after the call.
+   void setPoolPolicy( const PoolPolicy& policy );
+   // Pools empty for more than 'frames' calls to onNewFrame are given back to the device.
+   // Empty slabs are given back to their pool after the same delay.
+   // The last pool of every memory type is kept, for the linear resources and for the
+   // OPTIMAL images, so allocating again does not go back to vkAllocateMemory right away.
+   void setPoolTrimDelay( uint32_t frames );
+   // To call once per frame. Releases the pools idle for too long, see setPoolTrimDelay,
+   // and updates the budget of the heaps.
+   void onNewFrame();
+   // The device was created with VK_KHR_get_memory_requirements2 and
+   // VK_KHR_dedicated_allocation. The driver is then told which image a dedicated allocation
+   // is for and can ask for one.
+   void enableDedicatedAllocation();
+   // The device was created with VK_EXT_memory_budget. The budget of the heaps then comes
+   // from the driver instead of a share of their size. 'getMemoryProperties2' comes from
+   // the instance, created with VK_KHR_get_physical_device_properties2.
+   void enableMemoryBudget( PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 );
+
+   // Cheap enough to be called every frame. Reusing the same Stats avoids any allocation.
+   void getStats( Stats& stats ) const;
+   // Times the allocations of every pool, see MemoryPool::setLatencyTracking.
+   void setLatencyTracking( bool enabled );
+
+   // Logs every alloc and free to 'path' until stopTrace, see MemoryTrace. Returns false if
+   // the file cannot be created.
+   bool startTrace( const std::string& path );
+   void stopTrace();
+
+   // Used by the defragmentation. Finds a better place for 'alloc' among the pools of its
+   // type: in a pool fuller than its own, or lower in its own pool. Returns false if there
+   // is none, or if the allocation is a slab slot, a batch member or dedicated. Never
+   // creates a pool.
+   bool allocForMove( const VMemAlloc& alloc,
+                      const VkMemoryRequirements& requirements,
+                      VMemAlloc& newAlloc );
+   // Allocated bytes in the pool 'alloc' comes from.
+   uint64_t poolUsedSpace( const VMemAlloc& alloc ) const;
+
    void _debugPrint() const;
 
   private:
-   struct PoolsType
+   struct PoolEntry
    {
-      VkMemoryPropertyFlags _properties;
-      uint32_t _memTypeBits;
-      PoolsType( const VkMemoryRequirements& requirements, const VkMemoryPropertyFlags& properties )
-          : _properties( properties ), _memTypeBits( requirements.memoryTypeBits )
-      {
-      }
-      bool operator==( const PoolsType& rhs )
-      {
-         return _memTypeBits & rhs._memTypeBits && ( _properties & rhs._properties ) == _properties;
-      }
+      std::unique_ptr<VMemoryPool> pool;
+      uint32_t id;
+      uint32_t memTypeIdx;
+      // Index of the pool set in _pools, see poolSetOf
+      uint32_t poolSet;
+      // Holds a single allocation and is released with it
+      bool dedicated;
+      // Last frame the pool had an allocation
+      uint64_t lastUsedFrame;
    };
 
-   std::vector<std::vector<std::unique_ptr<VMemoryPool> > > _pools;
-   std::vector<PoolsType> _poolsProperties;
+   // Every memory type has a set of pools and slabs for the linear resources and one for
+   // the OPTIMAL images, with a lock each. The set of the linear resources has the index
+   // of the memory type.
+   static constexpr uint32_t POOL_SET_COUNT = 2 * VK_MAX_MEMORY_TYPES;
+   static uint32_t poolSetOf( uint32_t memTypeIdx, bool optimalImages )
+   {
+      return optimalImages ? memTypeIdx + VK_MAX_MEMORY_TYPES : memTypeIdx;
+   }
+   static uint32_t memoryTypeOf( uint32_t poolSet ) { return poolSet % VK_MAX_MEMORY_TYPES; }
+
+   using TypeLocks = std::array<std::unique_lock<std::mutex>, POOL_SET_COUNT>;
+
+   // The physical device is not picked yet when the manager is created
+   void initDeviceProperties();
+   // For the walks over every pool. Taken in pool set order, before _mutex.
+   TypeLocks lockAllTypes() const;
+   void recordAlloc( const VMemAlloc& alloc,
+                     const VkMemoryRequirements& requirements,
+                     const VkMemoryPropertyFlags& properties );
+   // The new place of a moved allocation is traced as a new allocation, with the
+   // properties 'alloc' was traced with. Its free is then traced when it is released.
+   void recordMove( const VMemAlloc& alloc,
+                    const VMemAlloc& newAlloc,
+                    const VkMemoryRequirements& requirements );
+   void recordResize( const VMemAlloc& alloc, uint64_t newSize );
+   // Memory type the pools of a request come from. Bounded by the number of memory types.
+   uint32_t memoryTypeIndex( const VkMemoryRequirements& requirements,
+                             const VkMemoryPropertyFlags& properties,
+                             const TypeHints& hints,
+                             bool optimalImages = false );
+   // Best scoring type with the 'required' flags, VK_MAX_MEMORY_TYPES if there is none.
+   uint32_t bestMemoryType( const VkMemoryRequirements& requirements,
+                            VkMemoryPropertyFlags required,
+                            VkMemoryPropertyFlags preferred,
+                            bool withinBudget,
+                            bool optimalImages ) const;
+   // Device memory allocating 'requirements' in the pool set would add, 0 if it fits in
+   // one of its pools.
+   uint64_t allocationSize( uint32_t poolSet, const VkMemoryRequirements& requirements ) const;
+   // Whether a request of 'size' bytes skips the pools of the memory type, following the policy
+   bool isDedicatedSize( uint32_t memTypeIdx, uint64_t size ) const;
+   // The budget functions expect _mutex to be held.
+   void updateBudget();
+   uint64_t heapUsage( uint32_t heapIdx ) const;
+   uint64_t heapBudgetLeft( uint32_t heapIdx ) const;
+   // Goes to a dedicated allocation or to the pools of the set, following the policy. Takes
+   // the lock of the pool set.
+   VMemAlloc allocBlock( uint32_t poolSet,
+                         const VkMemoryRequirements& requirements,
+                         VkImage dedicatedImage = VK_NULL_HANDLE );
+   // Expects the lock of the pool set to be held, like allocInPool.
+   VMemAlloc allocFromPools( uint32_t poolSet, const VkMemoryRequirements& requirements );
+   VMemAlloc allocDedicated( uint32_t memTypeIdx,
+                             const VkMemoryRequirements& requirements,
+                             VkImage image );
+   VMemAlloc allocFromSlab( uint32_t poolSet, const VkMemoryRequirements& requirements );
+   // Returns an allocation with an invalid handle if the pool is full.
+   VMemAlloc allocInPool( PoolEntry& entry, const VkMemoryRequirements& requirements );
+   // Size of the next pool of the memory type
+   uint64_t poolSize( uint32_t memTypeIdx ) const;
+   // Entry of the pool 'alloc' comes from. It stays valid as long as the allocation lives.
+   PoolEntry& entryOf( const VMemAlloc& alloc ) const;
+   // The table functions expect _mutex to be held.
+   uint32_t addPool( std::unique_ptr<PoolEntry> entry );
+   void releasePool( uint32_t poolId );
+   // Releases the slabs and the pools empty since more than 'idleFrames' frames, keeping
+   // one pool per type.
+   void trimPools( uint64_t idleFrames );
+
+   // Guards everything but the pools and slabs, which are behind the lock of their set.
+   // Dedicated allocations are behind _mutex.
+   mutable std::mutex _mutex;
+   mutable std::mutex _typeMutexes[ POOL_SET_COUNT ];
+
+   // Every pool, by id. Allocations keep the id + 1 of their pool, so finding it is a
+   // lookup. The ids of the released pools are reused. The entries do not move when the
+   // table grows, so they can be used without _mutex once found.
+   std::vector<std::unique_ptr<PoolEntry> > _poolTable;
+   std::vector<uint32_t> _freePoolIds;
+   // Pools of every pool set, in creation order, behind the lock of the set. Dedicated
+   // allocations are only in the table.
+   std::vector<PoolEntry*> _pools[ POOL_SET_COUNT ];
+   std::once_flag _initOnce;
+   std::atomic<bool> _hasMemProperties{false};
+   VkPhysicalDeviceMemoryProperties _memProperties = {};
+
+   PFN_vkGetPhysicalDeviceMemoryProperties2KHR _getMemoryProperties2 = nullptr;
+   uint64_t _heapBudget[ VK_MAX_MEMORY_HEAPS ] = {};
+   // Usage of the heaps at the last budget update, and our part of it. The usage in
+   // between is estimated from our own allocations.
+   uint64_t _heapUsageAtUpdate[ VK_MAX_MEMORY_HEAPS ] = {};
+   uint64_t _ownHeapUsageAtUpdate[ VK_MAX_MEMORY_HEAPS ] = {};
+   // Device memory allocated by the manager on every heap
+   uint64_t _ownHeapUsage[ VK_MAX_MEMORY_HEAPS ] = {};
+   std::atomic<uint32_t> _demotedCount{0};
+
+   std::vector<std::unique_ptr<VSlabAllocator> > _slabs;
+   // For each pool set, allocator and index + 1 in _slabs of every slot size class, behind
+   // the lock of the set.
+   std::vector<std::pair<VSlabAllocator*, uint32_t> > _slabClasses[ POOL_SET_COUNT ];
+   uint64_t _slabThreshold = 4096;
+   PoolPolicy _poolPolicy;
+   uint32_t _poolTrimDelay = 120;
+   std::atomic<uint64_t> _frame{0};
+   PFN_vkGetImageMemoryRequirements2KHR _getImageMemoryRequirements2 = nullptr;
+   // Allocations not freed yet of every batch. Unused batch indices are kept in _freeBatches.
+   std::vector<uint32_t> _batchLiveCounts;
+   std::vector<uint32_t> _freeBatches;
+   bool _trackLatency = false;
+
+   std::unique_ptr<MemoryTrace::Writer> _trace;
+   // Trace id of the live allocations, by memory and offset
+   struct TraceEntry
+   {
+      uint32_t id;
+      VkMemoryPropertyFlags properties;
+   };
+   std::map<std::pair<VkDeviceMemory, uint64_t>, TraceEntry> _traceIds;
    const VkPhysicalDevice& _physDevice;
    const VDeleter<VkDevice>& _device;
+   const MemoryPool::Backend _poolBackend;
 };
 
 #endif  // VK_MEMORY_POOL_
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "vResizableBuffer.h"
+#include "vCommandPool.h"
+#include <algorithm>
+
+static VkMemoryRequirements createUnboundBuffer( const VDeleter<VkDevice>& device,
+                                                 VkDeviceSize size,
+                                                 VkBufferUsageFlags usage,
+                                                 VDeleter<VkBuffer>& buffer )
+{
+   VkBufferCreateInfo bufferInfo = {};
+   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   bufferInfo.size = size;
+   bufferInfo.usage = usage;
+   bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+   VK_CALL( vkCreateBuffer( device, &bufferInfo, nullptr, &buffer ) );
+
+   VkMemoryRequirements memRequirements;
+   vkGetBufferMemoryRequirements( device, buffer, &memRequirements );
+   return memRequirements;
+}
+
+void createResizableBuffer( const VDeleter<VkDevice>& device,
+                            VMemoryManager& memoryManager,
+                            VkMemoryPropertyFlags memProperty,
+                            VkDeviceSize size,
+                            VkBufferUsageFlags usage,
+                            VResizableBuffer& buffer )
+{
+   // Needed by the copy when the buffer cannot be resized in place
+   buffer.usage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+   buffer.memProperty = memProperty;
+   buffer.size = size;
+   const VkMemoryRequirements memRequirements =
+      createUnboundBuffer( device, size, buffer.usage, buffer.buffer );
+   buffer.memory = memoryManager.alloc( memRequirements, memProperty );
+   buffer.memorySize = memRequirements.size;
+   VK_CALL( vkBindBufferMemory( device, buffer.buffer, buffer.memory.memory,
+                                buffer.memory.offset ) );
+}
+
+bool resizeBuffer( const VDeleter<VkDevice>& device,
+                   VMemoryManager& memoryManager,
+                   VCommandPool& commandPool,
+                   VkQueue queue,
+                   VResizableBuffer& buffer,
+                   VkDeviceSize newSize )
+{
+   // The old buffer may still be used by the frames in flight
+   vkDeviceWaitIdle( device );
+
+   VDeleter<VkBuffer> newBuffer{device, vkDestroyBuffer};
+   const VkMemoryRequirements memRequirements =
+      createUnboundBuffer( device, newSize, buffer.usage, newBuffer );
+
+   // A new buffer bound to the same memory sees the content of the old one, so
+   // there is nothing to copy if the memory can be resized in place.
+   const bool inPlace = buffer.memory.offset % memRequirements.alignment == 0 &&
+                        ( memRequirements.size <= buffer.memorySize ||
+                          memoryManager.tryGrow( buffer.memory, memRequirements.size ) );
+   if ( inPlace )
+   {
+      VK_CALL( vkBindBufferMemory( device, newBuffer, buffer.memory.memory,
+                                   buffer.memory.offset ) );
+      *&buffer.buffer = newBuffer.release();
+      if ( memRequirements.size < buffer.memorySize )
+      {
+         memoryManager.shrink( buffer.memory, memRequirements.size );
+      }
+   }
+   else
+   {
+      const VMemAlloc newMemory = memoryManager.alloc( memRequirements, buffer.memProperty );
+      VK_CALL( vkBindBufferMemory( device, newBuffer, newMemory.memory, newMemory.offset ) );
+
+      VkCommandBuffer commandBuffer =
+         commandPool.alloc( VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT );
+      VkBufferCopy copyRegion = {};
+      copyRegion.size = std::min( buffer.size, newSize );
+      vkCmdCopyBuffer( commandBuffer, buffer.buffer, newBuffer, 1, &copyRegion );
+      VK_CALL( vkEndCommandBuffer( commandBuffer ) );
+
+      VkSubmitInfo submitInfo = {};
+      submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submitInfo.commandBufferCount = 1;
+      submitInfo.pCommandBuffers = &commandBuffer;
+      VK_CALL( vkQueueSubmit( queue, 1, &submitInfo, VK_NULL_HANDLE ) );
+      VK_CALL( vkQueueWaitIdle( queue ) );
+      commandPool.free( commandBuffer );
+
+      *&buffer.buffer = newBuffer.release();
+      memoryManager.free( buffer.memory );
+      buffer.memory = newMemory;
+   }
+
+   buffer.size = newSize;
+   buffer.memorySize = memRequirements.size;
+
+   return inPlace;
+}
+
+void freeResizableBuffer( VMemoryManager& memoryManager, VResizableBuffer& buffer )
+{
+   *&buffer.buffer = VK_NULL_HANDLE;
+   memoryManager.free( buffer.memory );
+   buffer.memory = {};
+   buffer.size = 0;
+   buffer.memorySize = 0;
+}
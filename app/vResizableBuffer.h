@@ -0,0 +1,43 @@
+#ifndef VK_RESIZABLE_BUFFER_H_
+#define VK_RESIZABLE_BUFFER_H_
+
+#include "vkUtils.h"
+#include "vMemoryPool.h"
+#include <vulkan/vulkan.h>
+
+class VCommandPool;
+
+// Buffer that can be resized with resizeBuffer. The defragmenter expects its buffers to keep
+// their size, a registered buffer must be unregistered while it is resized.
+struct VResizableBuffer
+{
+   VResizableBuffer( const VDeleter<VkDevice>& device ) : buffer{device, vkDestroyBuffer} {}
+
+   VDeleter<VkBuffer> buffer;
+   VMemAlloc memory = {};
+   VkDeviceSize size = 0;
+   // Size the memory was allocated or resized with
+   VkDeviceSize memorySize = 0;
+   VkBufferUsageFlags usage = 0;
+   VkMemoryPropertyFlags memProperty = 0;
+};
+
+void createResizableBuffer( const VDeleter<VkDevice>& device,
+                            VMemoryManager& memoryManager,
+                            VkMemoryPropertyFlags memProperty,
+                            VkDeviceSize size,
+                            VkBufferUsageFlags usage,
+                            VResizableBuffer& buffer );
+// Keeps the content of the buffer, up to the new size. The memory is grown or shrunk in
+// place when possible, otherwise the content is copied to a new allocation through a command
+// buffer of 'commandPool' submitted to 'queue'. Waits for the device to be idle and replaces
+// the VkBuffer in both cases. Returns true if the buffer was resized in place.
+bool resizeBuffer( const VDeleter<VkDevice>& device,
+                   VMemoryManager& memoryManager,
+                   VCommandPool& commandPool,
+                   VkQueue queue,
+                   VResizableBuffer& buffer,
+                   VkDeviceSize newSize );
+void freeResizableBuffer( VMemoryManager& memoryManager, VResizableBuffer& buffer );
+
+#endif  // VK_RESIZABLE_BUFFER_H_
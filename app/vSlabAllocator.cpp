@@ -0,0 +1,109 @@
+#include "vSlabAllocator.h"
+#include "bitUtils.h"
+#include <algorithm>
+#include <assert.h>
+
+VSlabAllocator::VSlabAllocator( uint64_t slotSize ) : _slotSize( slotSize )
+{
+   assert( isPowerOfTwo( slotSize ) && slotSize >= MIN_SLOT_SIZE );
+}
+
+bool VSlabAllocator::alloc( VMemAlloc& mem )
+{
+   if ( _partialSlabs.empty() )
+   {
+      return false;
+   }
+
+   const uint32_t slabIdx = _partialSlabs.back();
+   Slab& slab = _slabs[ slabIdx ];
+   const uint32_t slot = countTrailingZeros( slab.freeSlots );
+   slab.freeSlots &= slab.freeSlots - 1;
+   if ( !slab.freeSlots )
+   {
+      _partialSlabs.pop_back();
+   }
+
+   mem.memory = slab.memory.memory;
+   mem.offset = slab.memory.offset + slot * _slotSize;
+   mem.data = slab.memory.data ? static_cast<uint8_t*>( slab.memory.data ) + slot * _slotSize
+                               : nullptr;
+   mem.handle = slabIdx * SLOTS_PER_SLAB + slot;
+   mem.pool = slab.memory.pool;
+   return true;
+}
+
+void VSlabAllocator::free( const VMemAlloc& mem )
+{
+   const uint32_t slabIdx = mem.handle / SLOTS_PER_SLAB;
+   const uint64_t slotBit = 1ull << ( mem.handle % SLOTS_PER_SLAB );
+   assert( slabIdx < _slabs.size() );
+
+   Slab& slab = _slabs[ slabIdx ];
+   // Already freed slot
+   assert( !( slab.freeSlots & slotBit ) );
+
+   // The slab was full, it can be used again.
+   if ( !slab.freeSlots )
+   {
+      _partialSlabs.push_back( slabIdx );
+   }
+   slab.freeSlots |= slotBit;
+}
+
+void VSlabAllocator::addSlab( const VMemAlloc& memory, uint64_t frame )
+{
+   assert( ( memory.offset & ( _slotSize - 1 ) ) == 0 );
+   if ( _releasedSlabs.empty() )
+   {
+      _partialSlabs.push_back( static_cast<uint32_t>( _slabs.size() ) );
+      _slabs.push_back( Slab{memory, ~0ull, frame} );
+   }
+   else
+   {
+      _partialSlabs.push_back( _releasedSlabs.back() );
+      _slabs[ _releasedSlabs.back() ] = Slab{memory, ~0ull, frame};
+      _releasedSlabs.pop_back();
+   }
+}
+
+void VSlabAllocator::releaseEmptySlabs( uint64_t frame,
+                                        uint64_t idleFrames,
+                                        std::vector<VMemAlloc>& released )
+{
+   for ( uint32_t i = 0; i < _slabs.size(); ++i )
+   {
+      Slab& slab = _slabs[ i ];
+      if ( slab.memory.handle == MemoryPool::INVALID_HANDLE )
+      {
+         continue;
+      }
+
+      if ( slab.freeSlots != ~0ull )
+      {
+         slab.lastUsedFrame = frame;
+      }
+      else if ( frame - slab.lastUsedFrame >= idleFrames )
+      {
+         released.push_back( slab.memory );
+         slab.memory.handle = MemoryPool::INVALID_HANDLE;
+         _partialSlabs.erase( std::find( _partialSlabs.begin(), _partialSlabs.end(), i ) );
+         _releasedSlabs.push_back( i );
+      }
+   }
+}
+
+std::string VSlabAllocator::_debugPrint() const
+{
+   uint64_t usedSlots = 0;
+   for ( const auto& slab : _slabs )
+   {
+      for ( uint64_t used = ~slab.freeSlots; used; used &= used - 1 )
+         ++usedSlots;
+   }
+
+   const size_t slabCount = _slabs.size() - _releasedSlabs.size();
+   return "Slab of " + std::to_string( _slotSize ) + " bytes slots : " +
+          std::to_string( usedSlots ) + " / " + std::to_string( slabCount * SLOTS_PER_SLAB ) +
+          " slots used";
+}
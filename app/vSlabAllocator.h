@@ -0,0 +1,54 @@
+#ifndef VK_SLAB_ALLOCATOR_H_
+#define VK_SLAB_ALLOCATOR_H_
+
+#include "vMemoryPool.h"
+#include <vulkan/vulkan.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+// Hands out fixed size slots for one size class. Each slab is a single
+// allocation from a VMemoryPool holding SLOTS_PER_SLAB slots, with its free
+// slots tracked in a 64 bits mask. No padding or chunk splitting is ever done.
+class VSlabAllocator
+{
+  public:
+   static constexpr uint32_t SLOTS_PER_SLAB = 64;
+   static constexpr uint64_t MIN_SLOT_SIZE = 64;
+
+   // slotSize must be a power of two, every slot is aligned on it.
+   explicit VSlabAllocator( uint64_t slotSize );
+
+   // Takes a free slot. Returns false if every slab is full, a slab must then be added.
+   bool alloc( VMemAlloc& mem );
+   void free( const VMemAlloc& mem );
+   // Adds a slab backed by 'memory', which must be slabSize() bytes aligned on slotSize().
+   void addSlab( const VMemAlloc& memory, uint64_t frame );
+   // Removes the slabs without any used slot for at least 'idleFrames' frames and appends
+   // their memory to 'released', for the caller to give back to the pools.
+   void releaseEmptySlabs( uint64_t frame, uint64_t idleFrames, std::vector<VMemAlloc>& released );
+
+   uint64_t slotSize() const { return _slotSize; }
+   uint64_t slabSize() const { return _slotSize * SLOTS_PER_SLAB; }
+
+   std::string _debugPrint() const;
+
+  private:
+   struct Slab
+   {
+      VMemAlloc memory;
+      // Bit N set if slot N is free
+      uint64_t freeSlots;
+      // Last frame the slab was seen with a used slot
+      uint64_t lastUsedFrame;
+   };
+
+   // The slot handles hold the slab index, so the released slabs leave a hole to reuse.
+   std::vector<Slab> _slabs;
+   // Slabs with at least one free slot
+   std::vector<uint32_t> _partialSlabs;
+   std::vector<uint32_t> _releasedSlabs;
+   const uint64_t _slotSize;
+};
+
+#endif  // VK_SLAB_ALLOCATOR_H_
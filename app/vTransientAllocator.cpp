@@ -0,0 +1,150 @@
+#include "vTransientAllocator.h"
+#include <algorithm>
+#include <assert.h>
+
+VTransientAllocator::VTransientAllocator( const VDeleter<VkDevice>& device,
+                                          VMemoryManager& memoryManager )
+    : _device( device ), _memoryManager( memoryManager )
+{
+}
+
+VTransientAllocator::~VTransientAllocator()
+{
+   reset();
+}
+
+uint32_t VTransientAllocator::addTarget( const VkImageCreateInfo& createInfo,
+                                         uint32_t firstPass,
+                                         uint32_t lastPass )
+{
+   assert( firstPass <= lastPass && !_memory.memory && "Reset before adding targets" );
+
+   Target target = {};
+   target.createInfo = createInfo;
+   const VkImageUsageFlags attachmentUsage =
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+   if ( !( createInfo.usage & ~attachmentUsage ) )
+   {
+      target.createInfo.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+   }
+   target.firstPass = firstPass;
+   target.lastPass = lastPass;
+   target.image = VK_NULL_HANDLE;
+   _targets.push_back( target );
+   return static_cast<uint32_t>( _targets.size() - 1 );
+}
+
+uint64_t VTransientAllocator::findOffset( const Target& target,
+                                          const std::vector<const Target*>& placed ) const
+{
+   // The placed targets are sorted by offset, so the first gap big enough is found in order.
+   const uint64_t alignMask = target.requirements.alignment - 1;
+   uint64_t offset = 0;
+   for ( const Target* other : placed )
+   {
+      if ( other->lastPass < target.firstPass || other->firstPass > target.lastPass )
+      {
+         continue;
+      }
+      if ( offset + target.requirements.size <= other->offset )
+      {
+         break;
+      }
+      offset = std::max( offset,
+                         ( other->offset + other->requirements.size + alignMask ) & ~alignMask );
+   }
+   return offset;
+}
+
+void VTransientAllocator::build()
+{
+   assert( !_memory.memory && "Already built" );
+   if ( _targets.empty() )
+   {
+      return;
+   }
+
+   VkMemoryRequirements requirements = {};
+   requirements.alignment = 1;
+   requirements.memoryTypeBits = ~0u;
+   for ( Target& target : _targets )
+   {
+      VK_CALL( vkCreateImage( _device, &target.createInfo, nullptr, &target.image ) );
+      vkGetImageMemoryRequirements( _device, target.image, &target.requirements );
+      requirements.alignment = std::max( requirements.alignment, target.requirements.alignment );
+      requirements.memoryTypeBits &= target.requirements.memoryTypeBits;
+   }
+   assert( requirements.memoryTypeBits && "Transient targets without a memory type in common" );
+
+   // Biggest first, the smaller ones then fill the holes left between them.
+   std::vector<Target*> order( _targets.size() );
+   for ( size_t i = 0; i < _targets.size(); ++i )
+   {
+      order[ i ] = &_targets[ i ];
+   }
+   std::sort( order.begin(), order.end(), []( const Target* a, const Target* b ) {
+      return a->requirements.size > b->requirements.size;
+   } );
+
+   std::vector<const Target*> placed;
+   placed.reserve( _targets.size() );
+   for ( Target* target : order )
+   {
+      target->offset = findOffset( *target, placed );
+      requirements.size = std::max( requirements.size, target->offset + target->requirements.size );
+      placed.insert( std::upper_bound( placed.begin(), placed.end(), target,
+                                       []( const Target* a, const Target* b ) {
+                                          return a->offset < b->offset;
+                                       } ),
+                     target );
+   }
+
+   // Device local memory that is lazily allocated is only ever used by transient attachments
+   VMemoryManager::TypeHints hints = {};
+   hints.preferred = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+   _memory = _memoryManager.allocForOptimalImages( requirements,
+                                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, hints );
+   _memorySize = requirements.size;
+
+   for ( const Target& target : _targets )
+   {
+      VK_CALL( vkBindImageMemory( _device, target.image, _memory.memory,
+                                  _memory.offset + target.offset ) );
+   }
+}
+
+void VTransientAllocator::reset()
+{
+   for ( Target& target : _targets )
+   {
+      if ( target.image != VK_NULL_HANDLE )
+      {
+         vkDestroyImage( _device, target.image, nullptr );
+      }
+   }
+   _targets.clear();
+
+   if ( _memory.memory )
+   {
+      _memoryManager.free( _memory );
+      _memory = {};
+   }
+   _memorySize = 0;
+}
+
+VkImage VTransientAllocator::image( uint32_t target ) const
+{
+   assert( target < _targets.size() );
+   return _targets[ target ].image;
+}
+
+uint64_t VTransientAllocator::unaliasedSize() const
+{
+   uint64_t size = 0;
+   for ( const Target& target : _targets )
+   {
+      size += target.requirements.size;
+   }
+   return size;
+}
@@ -0,0 +1,61 @@
+#ifndef VK_TRANSIENT_ALLOCATOR_H_
+#define VK_TRANSIENT_ALLOCATOR_H_
+
+#include "vkUtils.h"
+#include "vMemoryPool.h"
+#include <vulkan/vulkan.h>
+#include <inttypes.h>
+#include <vector>
+
+// Render targets only living within a frame, such as depth buffers. Each target is used
+// from one pass of the frame to another, and the targets whose pass ranges do not overlap
+// share the same memory. All of them are bound in a single allocation from the memory
+// manager, in LAZILY_ALLOCATED memory when the device has some, so tiled GPUs can keep
+// them in tile memory and never back them.
+//
+// The content of a target is undefined at its first pass, since another target may have
+// used its memory before. The render passes must not load it.
+class VTransientAllocator
+{
+  public:
+   VTransientAllocator( const VDeleter<VkDevice>& device, VMemoryManager& memoryManager );
+   ~VTransientAllocator();
+
+   // Declares a target used from pass 'firstPass' to 'lastPass', included. Targets only
+   // used as attachments get VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT. Returns the index of
+   // the target.
+   uint32_t addTarget( const VkImageCreateInfo& createInfo, uint32_t firstPass, uint32_t lastPass );
+   // Creates the images of the targets added since the last reset, and binds them.
+   void build();
+   // Destroys the images and frees their memory, to add the targets again, for instance
+   // when the swap chain size changes. The device must be done with them.
+   void reset();
+
+   VkImage image( uint32_t target ) const;
+
+   // Device memory taken by the targets, and what they would take without aliasing.
+   uint64_t memorySize() const { return _memory.memory ? _memorySize : 0; }
+   uint64_t unaliasedSize() const;
+
+  private:
+   struct Target
+   {
+      VkImageCreateInfo createInfo;
+      uint32_t firstPass;
+      uint32_t lastPass;
+      VkImage image;
+      VkMemoryRequirements requirements;
+      uint64_t offset;
+   };
+
+   // Lowest offset where 'target' does not overlap the placed targets alive at the same time
+   uint64_t findOffset( const Target& target, const std::vector<const Target*>& placed ) const;
+
+   const VDeleter<VkDevice>& _device;
+   VMemoryManager& _memoryManager;
+   std::vector<Target> _targets;
+   VMemAlloc _memory = {};
+   uint64_t _memorySize = 0;
+};
+
+#endif  // VK_TRANSIENT_ALLOCATOR_H_
@@ -55,6 +55,15 @@ class VDeleter
    }
 
    operator T() const { return object; }
+
+   // Gives up the ownership of the object without destroying it.
+   T release()
+   {
+      T obj = object;
+      object = VK_NULL_HANDLE;
+      return obj;
+   }
+
   private:
    T object{VK_NULL_HANDLE};
    std::function<void( T )> deleter;
@@ -22,10 +22,34 @@ const std::vector<const char*> VALIDATION_LAYERS = {"VK_LAYER_LUNARG_standard_va
 
 const std::vector<const char*> DEVICE_EXTENSIONS = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 
+// Enabled when the device supports all of them
+const std::vector<const char*> DEDICATED_ALLOCATION_EXTENSIONS = {
+   VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME, VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME};
+const std::vector<const char*> MEMORY_BUDGET_EXTENSIONS = {VK_EXT_MEMORY_BUDGET_EXTENSION_NAME};
+
 const char* PIPELINE_CACHE_FILE_NAME = "PipelineCache.vk";
 
 const bool enableValidationLayers = true;
 
+// Per frame transient memory
+const VkDeviceSize FRAME_GPU_SEGMENT_SIZE = 64 * 1024;
+const VkDeviceSize FRAME_CPU_SEGMENT_SIZE = 64 * 1024;
+
+// Staging buffers shared by the uploads
+const VkDeviceSize STAGING_BLOCK_SIZE = 16 * 1024 * 1024;
+
+// Vertices and indices of the meshes, in shared device local buffers. The blocks start small
+// and grow with the meshes.
+const VkDeviceSize MESH_BLOCK_SIZE = 4 * 1024 * 1024;
+const VkDeviceSize MESH_MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+// Also transfer sources so the defragmentation can move the blocks
+const VkBufferUsageFlags MESH_USAGE =
+   VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+
+// Bytes the defragmentation can copy each frame
+const VkDeviceSize DEFRAG_BYTES_PER_FRAME = 4 * 1024 * 1024;
+
 VkResult CreateDebugReportCallbackEXT( VkInstance instance,
                                        const VkDebugReportCallbackCreateInfoEXT* pCreateInfo,
                                        const VkAllocationCallbacks* pAllocator,
@@ -123,10 +147,21 @@ bool isExtensionAvailable( const char* ext, const std::vector<VkExtensionPropert
 {
    return std::find_if( extList.begin(), extList.end(),
                         [&ext]( const VkExtensionProperties& extension ) {
-                           return strcmp( ext, extension.extensionName );
+                           return strcmp( ext, extension.extensionName ) == 0;
                         } ) != extList.end();
 }
 
+bool isInstanceExtensionSupported( const char* extension )
+{
+   uint32_t extensionCount;
+   vkEnumerateInstanceExtensionProperties( nullptr, &extensionCount, nullptr );
+   std::vector<VkExtensionProperties> extensionPropertiesAvailable( extensionCount );
+   vkEnumerateInstanceExtensionProperties( nullptr, &extensionCount,
+                                           extensionPropertiesAvailable.data() );
+
+   return isExtensionAvailable( extension, extensionPropertiesAvailable );
+}
+
 bool areDeviceExtensionsSupported( const VkPhysicalDevice& device,
                                    const std::vector<const char*> extensions )
 {
@@ -175,6 +210,8 @@ void endSingleTimeCommands( VkCommandBuffer commandBuffer,
 VkCommandBuffer copyBuffer( VkBuffer source,
                             VkBuffer dest,
                             VkDeviceSize size,
+                            VkDeviceSize srcOffset,
+                            VkDeviceSize dstOffset,
                             VDeleter<VkDevice>& device,
                             VCommandPool& commandPool,
                             VkQueue& queue,
@@ -187,6 +224,8 @@ VkCommandBuffer copyBuffer( VkBuffer source,
    VkCommandBuffer commandBuffer = commandPool.alloc( VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT );
 
    VkBufferCopy copyRegion = {};
+   copyRegion.srcOffset = srcOffset;
+   copyRegion.dstOffset = dstOffset;
    copyRegion.size = size;
    vkCmdCopyBuffer( commandBuffer, source, dest, 1, &copyRegion );
 
@@ -368,6 +407,13 @@ VulkanGraphic::VulkanGraphic( std::vector<const char*> instanceExtensions )
       instanceExtensions.push_back( VK_EXT_DEBUG_REPORT_EXTENSION_NAME );
    }
 
+   _hasPhysDeviceProperties2 =
+      isInstanceExtensionSupported( VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME );
+   if ( _hasPhysDeviceProperties2 )
+   {
+      instanceExtensions.push_back( VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME );
+   }
+
    createInfo.enabledExtensionCount = static_cast<uint32_t>( instanceExtensions.size() );
    createInfo.ppEnabledExtensionNames = instanceExtensions.data();
 
@@ -499,8 +545,25 @@ bool VulkanGraphic::createLogicalDevice()
    VERIFY( areDeviceExtensionsSupported( _physDevice, DEVICE_EXTENSIONS ),
            "Not all extensions are supported." );
 
-   createInfo.enabledExtensionCount = static_cast<uint32_t>( DEVICE_EXTENSIONS.size() );
-   createInfo.ppEnabledExtensionNames = DEVICE_EXTENSIONS.data();
+   std::vector<const char*> extensions = DEVICE_EXTENSIONS;
+   const bool hasDedicatedAllocation =
+      areDeviceExtensionsSupported( _physDevice, DEDICATED_ALLOCATION_EXTENSIONS );
+   if ( hasDedicatedAllocation )
+   {
+      extensions.insert( extensions.end(), DEDICATED_ALLOCATION_EXTENSIONS.begin(),
+                         DEDICATED_ALLOCATION_EXTENSIONS.end() );
+   }
+   const bool hasMemoryBudget =
+      _hasPhysDeviceProperties2 &&
+      areDeviceExtensionsSupported( _physDevice, MEMORY_BUDGET_EXTENSIONS );
+   if ( hasMemoryBudget )
+   {
+      extensions.insert( extensions.end(), MEMORY_BUDGET_EXTENSIONS.begin(),
+                         MEMORY_BUDGET_EXTENSIONS.end() );
+   }
+
+   createInfo.enabledExtensionCount = static_cast<uint32_t>( extensions.size() );
+   createInfo.ppEnabledExtensionNames = extensions.data();
 
    if ( enableValidationLayers )
    {
@@ -514,6 +577,21 @@ bool VulkanGraphic::createLogicalDevice()
 
    VK_CALL( vkCreateDevice( _physDevice, &createInfo, nullptr, &_device ) );
 
+   if ( hasDedicatedAllocation )
+   {
+      _memoryManager.enableDedicatedAllocation();
+   }
+   if ( hasMemoryBudget )
+   {
+      _memoryManager.enableMemoryBudget(
+         reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(
+            vkGetInstanceProcAddr( _instance, "vkGetPhysicalDeviceMemoryProperties2KHR" ) ) );
+   }
+   _stagingArena.init( VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                       STAGING_BLOCK_SIZE );
+   _meshArena.init( MESH_USAGE, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MESH_BLOCK_SIZE );
+
    // Get the handle of the queue.
    vkGetDeviceQueue( _device, _graphicQueue.familyIndex, 0, &_graphicQueue.handle );
    vkGetDeviceQueue( _device, _presentationQueue.familyIndex, 0, &_presentationQueue.handle );
@@ -560,7 +638,8 @@ bool VulkanGraphic::createRenderPass()
    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
    depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-   depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+   // Cleared every frame and its memory can be aliased, so its previous content is dropped
+   depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
    VkAttachmentReference depthAttachmentRef = {};
@@ -906,6 +985,7 @@ bool VulkanGraphic::createCommandPool()
 
    _loadCommandPool.init( *_device.get(), 10, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
                           _transferQueue.familyIndex );
+   _meshArena.enableGrowth( MESH_MAX_BLOCK_SIZE, _loadCommandPool, _transferQueue.handle );
 
    return true;
 }
@@ -978,10 +1058,9 @@ bool VulkanGraphic::createDescriptorSet()
    return true;
 }
 
-inline VMemAlloc VulkanGraphic::createBuffer( VkMemoryPropertyFlags memProperty,
-                                              VkDeviceSize size,
-                                              VkBufferUsageFlags usage,
-                                              VDeleter<VkBuffer>& buffer )
+VkMemoryRequirements VulkanGraphic::createUnboundBuffer( VkDeviceSize size,
+                                                        VkBufferUsageFlags usage,
+                                                        VDeleter<VkBuffer>& buffer )
 {
    VkBufferCreateInfo bufferInfo = {};
    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -993,7 +1072,15 @@ inline VMemAlloc VulkanGraphic::createBuffer( VkMemoryPropertyFlags memProperty,
 
    VkMemoryRequirements memRequirements;
    vkGetBufferMemoryRequirements( _device, buffer, &memRequirements );
+   return memRequirements;
+}
 
+inline VMemAlloc VulkanGraphic::createBuffer( VkMemoryPropertyFlags memProperty,
+                                              VkDeviceSize size,
+                                              VkBufferUsageFlags usage,
+                                              VDeleter<VkBuffer>& buffer )
+{
+   const VkMemoryRequirements memRequirements = createUnboundBuffer( size, usage, buffer );
    const VMemAlloc alloc = _memoryManager.alloc( memRequirements, memProperty );
 
    vkBindBufferMemory( _device, buffer, alloc.memory, alloc.offset );
@@ -1032,16 +1119,13 @@ void VulkanGraphic::createImage( uint32_t width,
 
    VK_CALL( vkCreateImage( _device, &imageInfo, nullptr, &image ) );
 
-   VkMemoryRequirements memRequirements;
-   vkGetImageMemoryRequirements( _device, image, &memRequirements );
-
    // Free the image memory if it was already allocated
    if ( image.isAllocated() )
    {
       _memoryManager.free( image.getMemory() );
    }
 
-   image.setMemory( _memoryManager.alloc( memRequirements, memProperty ) );
+   image.setMemory( _memoryManager.allocForImage( image, tiling, memProperty ) );
 
    VK_CALL(
       vkBindImageMemory( _device, image, image.getMemory().memory, image.getMemory().offset ) );
@@ -1085,12 +1169,18 @@ VkCommandBuffer VulkanGraphic::createCommandBuffers( unsigned frameIdx )
    vkCmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout, 0, 1,
                             &_descriptorSet, 0, nullptr );
 
+   // The indices follow the vertices in the range of the mesh. The block holding it is
+   // looked up every frame, as the defragmentation may have moved it.
+   const VkBuffer meshBuffer =
+      _verticesCount > 0 ? _meshArena.buffer( _meshGeometry ) : VK_NULL_HANDLE;
+   const VkDeviceSize indexOffset = _meshGeometry.offset + sizeof( Vertex ) * _verticesCount;
+
    if ( _verticesCount > 0 )
    {
-      VkBuffer vertexBuffers[] = {_vertexBuffer};
-      VkDeviceSize offsets[] = {0};
+      VkBuffer vertexBuffers[] = {meshBuffer};
+      VkDeviceSize offsets[] = {_meshGeometry.offset};
       vkCmdBindVertexBuffers( commandBuffer, 0, 1, vertexBuffers, offsets );
-      vkCmdBindIndexBuffer( commandBuffer, _indexBuffer, 0, VK_INDEX_TYPE_UINT32 );
+      vkCmdBindIndexBuffer( commandBuffer, meshBuffer, indexOffset, VK_INDEX_TYPE_UINT32 );
       vkCmdDrawIndexed( commandBuffer, _indexCount, 1, 0, 0, 0 );
    }
 
@@ -1098,10 +1188,10 @@ VkCommandBuffer VulkanGraphic::createCommandBuffers( unsigned frameIdx )
 
    if ( _verticesCount > 0 )
    {
-      VkBuffer vertexBuffers[] = {_vertexBuffer};
-      VkDeviceSize offsets[] = {0};
+      VkBuffer vertexBuffers[] = {meshBuffer};
+      VkDeviceSize offsets[] = {_meshGeometry.offset};
       vkCmdBindVertexBuffers( commandBuffer, 0, 1, vertexBuffers, offsets );
-      vkCmdBindIndexBuffer( commandBuffer, _indexBuffer, 0, VK_INDEX_TYPE_UINT32 );
+      vkCmdBindIndexBuffer( commandBuffer, meshBuffer, indexOffset, VK_INDEX_TYPE_UINT32 );
       vkCmdDrawIndexed( commandBuffer, _indexCount, 1, 0, 0, 0 );
    }
 
@@ -1132,62 +1222,69 @@ bool VulkanGraphic::createSemaphores()
       vkCreateFence( _device, &createInfo, nullptr, &_frameRenderedFence[ i ] );
    }
 
+   createInfo.flags = 0;
+   VK_CALL( vkCreateFence( _device, &createInfo, nullptr, &_defragFence ) );
+   _defragmenter =
+      std::make_unique<VDefragmenter>( _device, _memoryManager, _swapChain->_imageCount );
+   _meshArena.enableDefragmentation( *_defragmenter );
+
    return true;
 }
 
-bool VulkanGraphic::createVertexBuffer( const std::vector<Vertex>& vertices )
+bool VulkanGraphic::stageMesh( const std::pmr::vector<Vertex>& vertices,
+                               const std::pmr::vector<uint32_t>& indices,
+                               VStagedMesh& mesh )
 {
-   const size_t bufferSize = sizeof( ( vertices[ 0 ] ) ) * vertices.size();
-
-   VDeleter<VkBuffer> stagingBuffer{_device, vkDestroyBuffer};
-   VDeleter<VkDeviceMemory> stagingBufferMemory{_device, vkFreeMemory};
-   VMemAlloc hostBuffer =
-      createBuffer( VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                    bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer );
-   void* data;
-   VK_CALL( vkMapMemory( _device, hostBuffer.memory, hostBuffer.offset, bufferSize, 0, &data ) );
-   memcpy( data, vertices.data(), bufferSize );
-   vkUnmapMemory( _device, hostBuffer.memory );
+   const VkDeviceSize verticesSize = sizeof( Vertex ) * vertices.size();
+   const VkDeviceSize indicesSize = sizeof( uint32_t ) * indices.size();
 
-   createBuffer( VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                 _vertexBuffer );
-
-   VkCommandBuffer cmd = copyBuffer( stagingBuffer, _vertexBuffer, bufferSize, _device,
-                                     _transferCommandPools[ _curFrameIdx ], _transferQueue.handle );
+   // Both are uploaded through the same staging range
+   mesh.staging = _stagingArena.alloc( verticesSize + indicesSize, sizeof( Vertex ) );
+   memcpy( mesh.staging.data, vertices.data(), verticesSize );
+   memcpy( static_cast<char*>( mesh.staging.data ) + verticesSize, indices.data(), indicesSize );
 
-   _verticesCount = static_cast<uint32_t>( vertices.size() );
-
-   vkDeviceWaitIdle( _device );
-   freeBuffer( hostBuffer );
+   mesh.verticesCount = static_cast<uint32_t>( vertices.size() );
+   mesh.indexCount = static_cast<uint32_t>( indices.size() );
 
    return true;
 }
 
-bool VulkanGraphic::createIndexBuffer( const std::vector<uint32_t>& indices )
+void VulkanGraphic::releaseMeshBuffers()
+{
+   if ( _meshGeometry.block )
+   {
+      _meshArena.free( _meshGeometry );
+   }
+   _verticesCount = 0;
+   _indexCount = 0;
+}
+
+bool VulkanGraphic::createMeshBuffers( VStagedMesh& mesh )
 {
-   const size_t bufferSize = indices.size() * sizeof( uint32_t );
-   VDeleter<VkBuffer> stagingBuffer{_device, vkDestroyBuffer};
-   VDeleter<VkDeviceMemory> stagingBufferMemory{_device, vkFreeMemory};
-   VMemAlloc hostBuffer =
-      createBuffer( VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                    bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer );
-   void* data;
-   VK_CALL( vkMapMemory( _device, hostBuffer.memory, hostBuffer.offset, bufferSize, 0, &data ) );
-   memcpy( data, indices.data(), bufferSize );
-   vkUnmapMemory( _device, hostBuffer.memory );
+   const VkDeviceSize meshSize =
+      sizeof( Vertex ) * mesh.verticesCount + sizeof( uint32_t ) * mesh.indexCount;
 
-   createBuffer( VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                 _indexBuffer );
+   // The previous mesh may still be used by the frames in flight
+   vkDeviceWaitIdle( _device );
+   // The arena blocks being moved get their new buffer now, so the copy is not lost with
+   // the old one. The alloc may also grow a block, which needs the device to be idle.
+   completeDefragMoves();
+   releaseMeshBuffers();
 
-   VkCommandBuffer cmd = copyBuffer( stagingBuffer, _indexBuffer, bufferSize, _device,
-                                     _transferCommandPools[ _curFrameIdx ], _transferQueue.handle );
+   // The vertices are a whole number of Vertex, so the indices after them stay aligned.
+   _meshGeometry = _meshArena.alloc( meshSize, sizeof( Vertex ) );
+   copyBuffer( mesh.staging.buffer, _meshArena.buffer( _meshGeometry ), meshSize,
+               mesh.staging.offset, _meshGeometry.offset, _device,
+               _transferCommandPools[ _curFrameIdx ], _transferQueue.handle );
 
-   _indexCount = static_cast<uint32_t>( indices.size() );
+   _verticesCount = mesh.verticesCount;
+   _indexCount = mesh.indexCount;
 
    vkDeviceWaitIdle( _device );
-   freeBuffer( hostBuffer );
+   _stagingArena.free( mesh.staging );
+   _stagingArena.releaseEmptyBlocks();
+   _meshArena.releaseEmptyBlocks();
+   mesh = VStagedMesh{};
 
    return true;
 }
@@ -1196,9 +1293,9 @@ bool VulkanGraphic::createUniformBuffer()
 {
    VkDeviceSize bufferSize = sizeof( UniformBufferObject );
 
-   _uniformStagingBufferMemory =
-      createBuffer( VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                    bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, _uniformStagingBuffer );
+   // One segment for each swap chain image, as each of them has its own frame fence.
+   _frameAllocator.init( _physDevice, _swapChain->_imageCount, FRAME_GPU_SEGMENT_SIZE,
+                         FRAME_CPU_SEGMENT_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT );
    createBuffer( VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferSize,
                  VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                  _uniformBuffer );
@@ -1220,10 +1317,8 @@ bool VulkanGraphic::createTextureImage()
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                 _stagingImage );
 
-   void* data;
-   vkMapMemory( _device, _stagingImage.getMemory().memory, 0, size, 0, &data );
-   memcpy( data, pixels, (size_t)size );
-   vkUnmapMemory( _device, _stagingImage.getMemory().memory );
+   // Host visible memory stays mapped
+   memcpy( _stagingImage.getMemory().data, pixels, (size_t)size );
 
    stbi_image_free( pixels );
 
@@ -1282,31 +1377,46 @@ bool VulkanGraphic::createTextureSampler()
 
 bool VulkanGraphic::createDepthImage()
 {
-   createImage( _swapChain->_curExtent.width, _swapChain->_curExtent.height, VK_FORMAT_D32_SFLOAT,
-                VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, _depthImage );
-   createImageView( _depthImage, VK_FORMAT_D32_SFLOAT, VK_IMAGE_ASPECT_DEPTH_BIT, _depthImageView,
-                    _device );
+   // The targets have the size of the swap chain, so all of them are declared again. The
+   // view goes first, it still points to the previous image.
+   vkDestroyImageView( _device, _depthImageView.release(), nullptr );
+   _transientTargets.reset();
+
+   VkImageCreateInfo imageInfo = {};
+   imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+   imageInfo.imageType = VK_IMAGE_TYPE_2D;
+   imageInfo.extent.width = _swapChain->_curExtent.width;
+   imageInfo.extent.height = _swapChain->_curExtent.height;
+   imageInfo.extent.depth = 1;
+   imageInfo.mipLevels = 1;
+   imageInfo.arrayLayers = 1;
+   imageInfo.format = VK_FORMAT_D32_SFLOAT;
+   imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+   imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+   imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 
-   transitionImageLayout( _depthImage, VK_FORMAT_D32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, _device,
-                          _loadCommandPool, _transferQueue.handle );
+   // Only used by the main render pass
+   const uint32_t depthTarget = _transientTargets.addTarget( imageInfo, 0, 0 );
+   _transientTargets.build();
 
-   vkDeviceWaitIdle( _device );
+   createImageView( _transientTargets.image( depthTarget ), VK_FORMAT_D32_SFLOAT,
+                    VK_IMAGE_ASPECT_DEPTH_BIT, _depthImageView, _device );
    return true;
 }
 
 void VulkanGraphic::updateUBO( const UniformBufferObject& ubo )
 {
-   void* data;
-   vkMapMemory( _device, _uniformStagingBufferMemory.memory, _uniformStagingBufferMemory.offset,
-                sizeof( ubo ), 0, &data );
-   memcpy( data, &ubo, sizeof( ubo ) );
-   vkUnmapMemory( _device, _uniformStagingBufferMemory.memory );
-
-   _uboUpdateCmdBuf = copyBuffer( _uniformStagingBuffer, _uniformBuffer, sizeof( ubo ), _device,
-                                  _transferCommandPools[ _curFrameIdx ], _transferQueue.handle, 0,
-                                  nullptr, 1, _uboUpdatedSemaphore.get() );
+   const VFrameAlloc staging =
+      _frameAllocator.alloc( sizeof( ubo ), alignof( UniformBufferObject ) );
+   assert( staging.data && "Frame allocator segment is full" );
+   memcpy( staging.data, &ubo, sizeof( ubo ) );
+
+   _uboUpdateCmdBuf = copyBuffer( staging.buffer, _uniformBuffer, sizeof( ubo ), staging.offset,
+                                  0, _device, _transferCommandPools[ _curFrameIdx ],
+                                  _transferQueue.handle, 0, nullptr, 1,
+                                  _uboUpdatedSemaphore.get() );
 }
 
 void VulkanGraphic::onNewFrame()
@@ -1320,10 +1430,57 @@ void VulkanGraphic::onNewFrame()
    VK_CALL( vkWaitForFences( _device, 1, &_frameRenderedFence[ _curFrameIdx ], VK_FALSE, 1000 ) );
    vkResetFences( _device, 1, &_frameRenderedFence[ _curFrameIdx ] );
 
+   // The frame is done with its transient data
+   _frameAllocator.reset( _curFrameIdx );
+   _memoryManager.onNewFrame();
+
+   defragmentMemory();
+
    _transferCommandPools[ _curFrameIdx ].freeAll( VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT );
    _graphicCommandPools[ _curFrameIdx ].freeAll( VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT );
 }
 
+void VulkanGraphic::defragmentMemory()
+{
+   _defragmenter->onNewFrame();
+
+   // Wait for the previous moves to be done before planning new ones
+   if ( !completeDefragMoves() )
+   {
+      return;
+   }
+
+   VkCommandBuffer cmd = _loadCommandPool.alloc( VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT );
+   if ( _defragmenter->recordMoves( cmd, DEFRAG_BYTES_PER_FRAME ) == 0 )
+   {
+      vkEndCommandBuffer( cmd );
+      _loadCommandPool.free( cmd );
+      return;
+   }
+
+   endSingleTimeCommands( cmd, _device, _transferQueue.handle, _loadCommandPool, 0, nullptr, 0,
+                          nullptr, _defragFence );
+   _defragCmdBuf = cmd;
+}
+
+bool VulkanGraphic::completeDefragMoves()
+{
+   if ( _defragCmdBuf == VK_NULL_HANDLE )
+   {
+      return true;
+   }
+   if ( vkGetFenceStatus( _device, _defragFence ) != VK_SUCCESS )
+   {
+      return false;
+   }
+
+   _defragmenter->completeMoves();
+   _loadCommandPool.free( _defragCmdBuf );
+   _defragCmdBuf = VK_NULL_HANDLE;
+   vkResetFences( _device, 1, &_defragFence );
+   return true;
+}
+
 void VulkanGraphic::render()
 {
    const uint32_t frameIdx = _curFrameIdx;
@@ -1369,6 +1526,11 @@ const SwapChain* VulkanGraphic::getSwapChain() const
    return _swapChain.get();
 }
 
+bool VulkanGraphic::startMemoryTrace( const std::string& path )
+{
+   return _memoryManager.startTrace( path );
+}
+
 void VulkanGraphic::_debugPrintMemoryMgrInfo() const
 {
    _memoryManager._debugPrint();
@@ -1377,6 +1539,7 @@ void VulkanGraphic::_debugPrintMemoryMgrInfo() const
 VulkanGraphic::~VulkanGraphic()
 {
    vkDeviceWaitIdle( _device );
+   releaseMeshBuffers();
 
    // Free the frame fences
    for ( auto& f : _frameRenderedFence )
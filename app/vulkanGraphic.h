@@ -6,10 +6,15 @@
 #include "utils.h"
 #include "vkUtils.h"
 #include "vMemoryPool.h"
+#include "vFrameAllocator.h"
+#include "vBufferArena.h"
+#include "vDefragmenter.h"
+#include "vTransientAllocator.h"
 #include "vImage.h"
 #include "vCommandPool.h"
 #include <fstream>
 #include <memory>
+#include <memory_resource>
 #include <vector>
 #include <vulkan/vulkan.h>
 
@@ -26,6 +31,15 @@ struct UniformBufferObject
    glm::mat4 proj;
 };
 
+// Mesh waiting in a staging range, the vertices followed by the indices. Only the copy to
+// the mesh arena is left, see VulkanGraphic::stageMesh.
+struct VStagedMesh
+{
+   VBufferRange staging = {};
+   uint32_t verticesCount = 0;
+   uint32_t indexCount = 0;
+};
+
 class VulkanGraphic
 {
   public:
@@ -44,8 +58,14 @@ class VulkanGraphic
    bool createDescriptorPool();
    VkCommandBuffer createCommandBuffers( unsigned frameIdx );
    bool createSemaphores();
-   bool createVertexBuffer( const std::vector<Vertex>& vertices );
-   bool createIndexBuffer( const std::vector<uint32_t>& indices );
+   // Can be called from a loader job, while the render thread keeps going. Copies the
+   // vertices and indices of the mesh to staging memory.
+   bool stageMesh( const std::pmr::vector<Vertex>& vertices,
+                   const std::pmr::vector<uint32_t>& indices,
+                   VStagedMesh& mesh );
+   // From the render thread. Uploads the staged mesh to the mesh arena and makes it the
+   // rendered one.
+   bool createMeshBuffers( VStagedMesh& mesh );
    bool createDescriptorSetLayout();
    bool createDescriptorSet();
    bool createUniformBuffer();
@@ -63,6 +83,9 @@ class VulkanGraphic
 
    const SwapChain* getSwapChain() const;
 
+   // Records the device memory allocations, see VMemoryManager::startTrace.
+   bool startMemoryTrace( const std::string& path );
+
    void _debugPrintMemoryMgrInfo() const;
 
   private:
@@ -72,11 +95,17 @@ class VulkanGraphic
       VkQueue handle;
    };
 
+   // Creates the buffer without binding any memory to it.
+   VkMemoryRequirements createUnboundBuffer( VkDeviceSize size,
+                                             VkBufferUsageFlags usage,
+                                             VDeleter<VkBuffer>& buffer );
    VMemAlloc createBuffer( VkMemoryPropertyFlags memProperty,
                            VkDeviceSize size,
                            VkBufferUsageFlags usage,
                            VDeleter<VkBuffer>& buffer );
    void freeBuffer( VMemAlloc& alloc );
+   // Gives the range of the mesh back to the mesh arena. The device must be done with it.
+   void releaseMeshBuffers();
 
    void createImage( uint32_t width,
                      uint32_t height,
@@ -88,8 +117,14 @@ class VulkanGraphic
 
    bool createShaderModule( const std::string& shaderPath, VDeleter<VkShaderModule>& shaderModule );
    void recreateSwapChainIfNotValid( VkResult res );
+   void defragmentMemory();
+   // Hands the moved resources to their owners once the GPU is done with the copies of the
+   // last defragmentation step. Returns false if the copies are still running.
+   bool completeDefragMoves();
 
    VDeleter<VkInstance> _instance{vkDestroyInstance};
+   // VK_KHR_get_physical_device_properties2 is enabled, needed by VK_EXT_memory_budget
+   bool _hasPhysDeviceProperties2 = false;
    VDeleter<VkDevice> _device{vkDestroyDevice};
    VkPhysicalDevice _physDevice;
    Queue _graphicQueue;
@@ -119,15 +154,22 @@ class VulkanGraphic
    VDeleter<VkFence> _uboUpdatedFence{_device, vkDestroyFence};
    VkCommandBuffer _uboUpdateCmdBuf;
 
-   VDeleter<VkBuffer> _vertexBuffer{_device, vkDestroyBuffer};
-   VDeleter<VkBuffer> _indexBuffer{_device, vkDestroyBuffer};
-
    VMemoryManager _memoryManager{_physDevice, _device};
+   // Moves the blocks of the mesh arena a bit every frame to defragment the memory
+   std::unique_ptr<VDefragmenter> _defragmenter;
+   VDeleter<VkFence> _defragFence{_device, vkDestroyFence};
+   VkCommandBuffer _defragCmdBuf = VK_NULL_HANDLE;
    uint32_t _verticesCount = 0;
    uint32_t _indexCount = 0;
 
-   VDeleter<VkBuffer> _uniformStagingBuffer{_device, vkDestroyBuffer};
-   VMemAlloc _uniformStagingBufferMemory;
+   // Transient per frame data, such as the uniform buffer uploads
+   VFrameAllocator _frameAllocator{_device};
+   // Staging ranges of the uploads, in persistently mapped buffers
+   VBufferArena _stagingArena{_device, _memoryManager};
+   // Device local vertex and index data of the meshes, bound once per draw with offsets
+   VBufferArena _meshArena{_device, _memoryManager};
+   // Vertices of the rendered mesh, followed by its indices
+   VBufferRange _meshGeometry = {};
    VDeleter<VkBuffer> _uniformBuffer{_device, vkDestroyBuffer};
 
    VImage _stagingImage{_device};
@@ -137,8 +179,8 @@ class VulkanGraphic
    VDeleter<VkImageView> _textureImageView{_device, vkDestroyImageView};
    VDeleter<VkSampler> _textureSampler{_device, vkDestroySampler};
 
-   VImage _depthImage{_device};
-   VDeleter<VkDeviceMemory> _depthImageMemory{_device, vkFreeMemory};
+   // Render targets living within a frame, the depth image for now
+   VTransientAllocator _transientTargets{_device, _memoryManager};
    VDeleter<VkImageView> _depthImageView{_device, vkDestroyImageView};
 
    VDeleter<VkDebugReportCallbackEXT> _validationCallback{_instance, DestroyDebugReportCallbackEXT};
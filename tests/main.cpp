@@ -1,10 +1,19 @@
 #include <app/MemoryPool.h>
+#include <app/ConcurrentMemoryPool.h>
+#include <app/MemoryTrace.h>
+#include <app/MemoryResource.h>
 #include <app/ThreadPool.h>
+#include <app/ParallelAlgorithms.h>
 #include <memory>
 #include <inttypes.h>
 #include <assert.h>
 #include <random>
+#include <algorithm>
+#include <numeric>
+#include <thread>
 #include <iostream>
+#include <cstdio>
+#include <cstring>
 
 std::mt19937 rng;
 static auto randNum(int from, int to)
@@ -16,12 +25,43 @@ static auto randNum(int from, int to)
 static constexpr int POSSIBLE_ALIGNMENT[] = { 2, 4, 8, 16, 32, 64, 128, 512, 1024, 2048, 4096 };
 static constexpr int ALIGNMENT_COUNT = sizeof(POSSIBLE_ALIGNMENT) / sizeof(POSSIBLE_ALIGNMENT[0]);
 
+static constexpr MemoryPool::Backend BACKENDS[] = { MemoryPool::Backend::FIRST_FIT, MemoryPool::Backend::TLSF, MemoryPool::Backend::BUDDY };
+
+// Runs 'test' with every pool backend, until one of them fails
+template< typename F >
+static bool forEachBackend(const F& test)
+{
+	for (auto backend : BACKENDS)
+	{
+		if (!test(backend))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Live allocation of the random tests, with what it should still hold
+struct PoolAlloc
+{
+	MemoryPool::Handle handle;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct ResourceAlloc
+{
+	uint8_t* ptr;
+	size_t size;
+	size_t align;
+};
+
 bool memoryPoolAllocateAll()
 {
 	constexpr uint64_t size = 1024;
 	MemoryPool pool(size, 1024);
 
-	uint64_t allocs[size];
+	MemoryPool::Handle allocs[size];
 	for (int i = 0; i < size/2; ++i)
 	{
 		allocs[i] = pool.alloc(1, 2);
@@ -35,7 +75,7 @@ bool memoryPoolAllocateAllAndDeallocateAll()
 	constexpr uint64_t size = 1024;
 	MemoryPool pool(size, 1024);
 
-	uint64_t allocs[size];
+	MemoryPool::Handle allocs[size];
 	for (int i = 0; i < size / 2; ++i)
 	{
 		allocs[i] = pool.alloc(1, 2);
@@ -61,7 +101,7 @@ bool memoryAllocateDeallocateHalfTheTime()
 	constexpr uint64_t size = 1024;
 	MemoryPool pool(size, 1024);
 
-	uint64_t allocs[size];
+	MemoryPool::Handle allocs[size];
 	for (int i = 0; i < size; ++i)
 	{
 		allocs[i] = pool.alloc(1, 1);
@@ -80,7 +120,7 @@ bool memoryRandomAllocsRandomAlign()
 	constexpr uint64_t size = 1024 * 1024 * 1024;
 	MemoryPool pool(size, 1000);
 
-	uint64_t allocs[1000];
+	MemoryPool::Handle allocs[1000];
 	for (int i = 0; i < 1000; ++i)
 	{
 		uint64_t size = randNum(1, 515);
@@ -98,7 +138,7 @@ bool memoryRandomAllocsRandomAlignRandomFree()
 	constexpr uint64_t size = 1024 * 1024 * 1024;
 	MemoryPool pool(size, allocationCount);
 
-	std::vector< uint64_t > allocs;
+	std::vector< MemoryPool::Handle > allocs;
 	allocs.reserve(allocationCount);
 	for (int i = 0; i < allocationCount; ++i)
 	{
@@ -123,8 +163,8 @@ bool memoryExactFit()
 	constexpr uint64_t size = 1024;
 	MemoryPool pool(size, 1024);
 
-	size_t offset = pool.alloc(1024, 64);
-	pool.free(offset);
+	MemoryPool::Handle handle = pool.alloc(1024, 64);
+	pool.free(handle);
 
 	for (size_t i = 0; i < 1000; ++i)
 	{
@@ -132,8 +172,8 @@ bool memoryExactFit()
 		size_t bigAllocAllignId = randNum(0, ALIGNMENT_COUNT - 4);
 		size_t bigAllocAlign = POSSIBLE_ALIGNMENT[bigAllocAllignId];
 		size_t alignLeft = (bigAllocAlign - (smallAlloc & (bigAllocAlign - 1))) & (bigAllocAlign-1);
-		size_t alloc1 = pool.alloc(smallAlloc, 32);
-		size_t alloc2 = pool.alloc(size - smallAlloc - alignLeft, bigAllocAlign);
+		MemoryPool::Handle alloc1 = pool.alloc(smallAlloc, 32);
+		MemoryPool::Handle alloc2 = pool.alloc(size - smallAlloc - alignLeft, bigAllocAlign);
 
 		assert(pool.spaceLeft() == 0);
 		pool.free(alloc2);
@@ -143,6 +183,573 @@ bool memoryExactFit()
 	return pool._debugIsConform();
 }
 
+bool memoryFirstFitRandomAllocsRandomFree()
+{
+	constexpr size_t allocationCount = 2000;
+	constexpr uint64_t size = 1024 * 1024 * 1024;
+	MemoryPool pool(size, allocationCount, MemoryPool::Backend::FIRST_FIT);
+
+	std::vector< MemoryPool::Handle > allocs;
+	allocs.reserve(allocationCount);
+	for (int i = 0; i < allocationCount; ++i)
+	{
+		uint64_t size = randNum(1, 1024);
+		uint64_t align = randNum(0, ALIGNMENT_COUNT-1);
+		allocs.push_back( pool.alloc(size, POSSIBLE_ALIGNMENT[align]) );
+
+		if (randNum(0, 2) == 0)
+		{
+			auto allocToRemove = randNum(0, (int)allocs.size() - 1);
+			pool.free(allocs[allocToRemove]);
+			allocs.erase(allocs.begin() + allocToRemove);
+		}
+	}
+
+	return pool._debugIsConform();
+}
+
+bool memoryTlsfAlignedAllocInHole()
+{
+	constexpr uint64_t size = 4096;
+	MemoryPool pool(size, 64, MemoryPool::Backend::TLSF);
+
+	// Leave a single 1024 bytes hole at offset 1024
+	MemoryPool::Handle allocs[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		allocs[i] = pool.alloc(1024, 1024);
+	}
+	pool.free(allocs[1]);
+
+	// The hole is too small for the worst case padding of a 1024 aligned
+	// request, but it is aligned and must still be found.
+	const MemoryPool::Handle handle = pool.alloc(1024, 1024);
+	if (handle == MemoryPool::INVALID_HANDLE || pool.offset(handle) != 1024 || pool.spaceLeft() != 0)
+		return false;
+
+	// Free everything, we should be back to a single free block.
+	pool.free(handle);
+	pool.free(allocs[0]);
+	pool.free(allocs[3]);
+	pool.free(allocs[2]);
+	return pool.spaceLeft() == size && pool.offset(pool.alloc(size, 4096)) == 0 && pool._debugIsConform();
+}
+
+bool memoryHandlesOutliveChunkReserve()
+{
+	// Far more allocations than the reserved chunk metadata
+	constexpr uint64_t allocCount = 5000;
+	MemoryPool pool(allocCount * 16, 16);
+
+	std::vector< MemoryPool::Handle > allocs;
+	for (uint64_t i = 0; i < allocCount; ++i)
+	{
+		allocs.push_back(pool.alloc(16, 16));
+		if (allocs.back() == MemoryPool::INVALID_HANDLE || pool.offset(allocs.back()) != i * 16)
+			return false;
+	}
+
+	// Handles must still point to the same chunks
+	for (uint64_t i = 0; i < allocCount; i += 2)
+	{
+		pool.free(allocs[i]);
+	}
+	for (uint64_t i = 1; i < allocCount; i += 2)
+	{
+		if (pool.offset(allocs[i]) != i * 16)
+			return false;
+		pool.free(allocs[i]);
+	}
+
+	return pool.spaceLeft() == allocCount * 16 && pool._debugIsConform();
+}
+
+bool memoryBuddyRandomAllocsRandomFree()
+{
+	constexpr size_t allocationCount = 2000;
+	// Not a power of two, the end of the pool must never be handed out.
+	constexpr uint64_t size = 1000 * 1000 * 1000;
+	MemoryPool pool(size, allocationCount, MemoryPool::Backend::BUDDY);
+
+	std::vector< MemoryPool::Handle > allocs;
+	allocs.reserve(allocationCount);
+	for (int i = 0; i < allocationCount; ++i)
+	{
+		uint64_t size = randNum(1, 64 * 1024);
+		uint64_t align = POSSIBLE_ALIGNMENT[randNum(0, ALIGNMENT_COUNT-1)];
+		MemoryPool::Handle handle = pool.alloc(size, align);
+		if (handle == MemoryPool::INVALID_HANDLE || pool.offset(handle) % align != 0 || pool.offset(handle) + size > pool.totalPoolSize())
+			return false;
+		allocs.push_back(handle);
+
+		if (randNum(0, 2) == 0)
+		{
+			auto allocToRemove = randNum(0, (int)allocs.size() - 1);
+			pool.free(allocs[allocToRemove]);
+			allocs.erase(allocs.begin() + allocToRemove);
+		}
+	}
+
+	const uint64_t initialFreeSpace = MemoryPool(size, 0, MemoryPool::Backend::BUDDY).spaceLeft();
+	for (auto handle : allocs)
+	{
+		pool.free(handle);
+	}
+
+	return pool.spaceLeft() == initialFreeSpace && pool._debugIsConform();
+}
+
+bool memoryBuddyMergesBack()
+{
+	constexpr uint64_t size = 64 * 1024;
+	MemoryPool pool(size, 0, MemoryPool::Backend::BUDDY);
+
+	// Fill the pool with the smallest blocks, then free them all.
+	std::vector< MemoryPool::Handle > allocs;
+	for (MemoryPool::Handle h = pool.alloc(1, 1); h != MemoryPool::INVALID_HANDLE; h = pool.alloc(1, 1))
+	{
+		allocs.push_back(h);
+	}
+	if (pool.spaceLeft() != 0 || allocs.size() != size / 256)
+		return false;
+
+	for (size_t i = 0; i < allocs.size(); i += 2)
+	{
+		pool.free(allocs[i]);
+	}
+	// Every other block is free, nothing bigger than a single block can fit.
+	if (pool.alloc(512, 1) != MemoryPool::INVALID_HANDLE)
+		return false;
+
+	for (size_t i = 1; i < allocs.size(); i += 2)
+	{
+		pool.free(allocs[i]);
+	}
+
+	// Everything merged back in a single block
+	MemoryPool::Handle whole = pool.alloc(size, size);
+	return whole != MemoryPool::INVALID_HANDLE && pool.offset(whole) == 0 && pool._debugIsConform();
+}
+
+bool memoryPoolGrowShrinkInPlace()
+{
+	constexpr uint64_t size = 64 * 1024;
+	return forEachBackend([&](MemoryPool::Backend backend)
+	{
+		MemoryPool pool(size, 16, backend);
+		MemoryPool::Handle a = pool.alloc(4096, 256);
+		MemoryPool::Handle b = pool.alloc(4096, 256);
+		const uint64_t offsetA = pool.offset(a);
+
+		// The allocation right after prevents it
+		if (pool.offset(b) != offsetA + 4096 || pool.tryGrow(a, 8192) || pool.size(a) != 4096)
+		{
+			return false;
+		}
+
+		pool.free(b);
+		if (!pool.tryGrow(a, 8192) || pool.offset(a) != offsetA || pool.size(a) < 8192)
+		{
+			return false;
+		}
+
+		pool.shrink(a, 1024);
+		if (pool.offset(a) != offsetA || pool.size(a) < 1024 || pool.size(a) >= 8192 ||
+			pool.spaceLeft() != size - pool.size(a))
+		{
+			return false;
+		}
+
+		pool.free(a);
+		if (pool.spaceLeft() != size)
+		{
+			return false;
+		}
+
+		// Random resizes, no allocation should ever overlap another
+		std::vector< PoolAlloc > allocs;
+		for (int i = 0; i < 2000; ++i)
+		{
+			const int op = randNum(0, 3);
+			if (op == 0 || allocs.empty())
+			{
+				const uint64_t allocSize = randNum(1, 2048);
+				const MemoryPool::Handle handle = pool.alloc(allocSize, POSSIBLE_ALIGNMENT[randNum(0, ALIGNMENT_COUNT - 1)]);
+				if (handle != MemoryPool::INVALID_HANDLE)
+				{
+					allocs.push_back(PoolAlloc{ handle, pool.offset(handle), allocSize });
+				}
+				continue;
+			}
+
+			const size_t idx = randNum(0, (int)allocs.size() - 1);
+			PoolAlloc& alloc = allocs[idx];
+			if (op == 1)
+			{
+				pool.free(alloc.handle);
+				allocs[idx] = allocs.back();
+				allocs.pop_back();
+				continue;
+			}
+
+			const uint64_t newSize = op == 2 ? alloc.size * randNum(1, 4) : randNum(1, (int)alloc.size);
+			if (op == 3)
+			{
+				pool.shrink(alloc.handle, newSize);
+				alloc.size = newSize;
+			}
+			else if (pool.tryGrow(alloc.handle, newSize))
+			{
+				alloc.size = newSize;
+			}
+			if (pool.offset(alloc.handle) != alloc.offset || pool.size(alloc.handle) < alloc.size)
+			{
+				return false;
+			}
+
+			std::vector< PoolAlloc > sorted = allocs;
+			std::sort(sorted.begin(), sorted.end(), [](const PoolAlloc& l, const PoolAlloc& r) { return l.offset < r.offset; });
+			for (size_t j = 1; j < sorted.size(); ++j)
+			{
+				if (sorted[j - 1].offset + sorted[j - 1].size > sorted[j].offset)
+				{
+					return false;
+				}
+			}
+		}
+
+		for (const PoolAlloc& alloc : allocs)
+		{
+			pool.free(alloc.handle);
+		}
+		if (pool.spaceLeft() != size)
+		{
+			return false;
+		}
+
+		return true;
+	});
+}
+
+bool memoryPoolStats()
+{
+	constexpr uint64_t size = 64 * 1024;
+	return forEachBackend([&](MemoryPool::Backend backend)
+	{
+		MemoryPool pool(size, 16, backend);
+		pool.setLatencyTracking(true);
+
+		// Every other block freed, the free space is scattered.
+		std::vector< MemoryPool::Handle > allocs;
+		for (int i = 0; i < 16; ++i)
+		{
+			allocs.push_back(pool.alloc(4096, 256));
+		}
+		for (int i = 0; i < 16; i += 2)
+		{
+			pool.free(allocs[i]);
+		}
+		pool.alloc(2 * size, 1);
+
+		MemoryPool::Stats stats;
+		pool.getStats(stats);
+		uint64_t timedAllocs = 0;
+		for (auto count : stats.allocLatencyNs)
+		{
+			timedAllocs += count;
+		}
+
+		if (stats.totalBytes != size || stats.usedBytes != size / 2 || stats.freeBytes != size / 2 ||
+			stats.largestFreeBlock != 4096 || stats.fragmentation < 0.8f ||
+			stats.chunkCount != 16 || stats.freeChunkCount != 8 ||
+			stats.allocCount != 17 || stats.failedAllocCount != 1 || stats.freeCount != 8 || timedAllocs != 17)
+		{
+			return false;
+		}
+
+		// Everything merged back in a single free chunk
+		for (int i = 1; i < 16; i += 2)
+		{
+			pool.free(allocs[i]);
+		}
+		pool.getStats(stats);
+		if (stats.largestFreeBlock != size || stats.fragmentation != 0.0f || stats.freeChunkCount != 1)
+		{
+			return false;
+		}
+
+		return true;
+	});
+}
+
+bool memoryTraceRoundTrip()
+{
+	const std::string path = "memoryTraceTest.bin";
+	std::vector< MemoryTrace::Event > expected;
+	{
+		MemoryTrace::Writer writer(path);
+		if (!writer.isOpen())
+		{
+			return false;
+		}
+
+		std::vector< uint32_t > live;
+		for (int i = 0; i < 1000; ++i)
+		{
+			if (!live.empty() && randNum(0, 5) == 0)
+			{
+				const size_t idx = randNum(0, (int)live.size() - 1);
+				const uint64_t newSize = randNum(1, 1 << 20);
+				writer.recordResize(live[idx], newSize);
+				expected.push_back(MemoryTrace::Event{ MemoryTrace::EventType::RESIZE, live[idx], 0, newSize, 1, 0, 0 });
+			}
+			else if (!live.empty() && randNum(0, 2) == 0)
+			{
+				const size_t idx = randNum(0, (int)live.size() - 1);
+				writer.recordFree(live[idx]);
+				expected.push_back(MemoryTrace::Event{ MemoryTrace::EventType::FREE, live[idx], 0, 0, 1, 0, 0 });
+				live.erase(live.begin() + idx);
+			}
+			else
+			{
+				const uint64_t size = (uint64_t)randNum(1, 1 << 20) << randNum(0, 12);
+				const uint64_t align = POSSIBLE_ALIGNMENT[randNum(0, ALIGNMENT_COUNT - 1)];
+				const uint32_t properties = randNum(0, 15);
+				const uint32_t memTypeBits = randNum(1, 0xffff);
+				live.push_back(writer.recordAlloc(size, align, properties, memTypeBits));
+				expected.push_back(MemoryTrace::Event{ MemoryTrace::EventType::ALLOC, live.back(), 0, size, align, properties, memTypeBits });
+			}
+		}
+	}
+
+	std::vector< MemoryTrace::Event > events;
+	const bool isRead = MemoryTrace::read(path, events);
+	std::remove(path.c_str());
+	if (!isRead || events.size() != expected.size())
+	{
+		return false;
+	}
+
+	uint64_t lastTime = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const auto& e = events[i];
+		const auto& exp = expected[i];
+		if (e.type != exp.type || e.id != exp.id || e.timeNs < lastTime ||
+			e.size != exp.size || e.alignment != exp.alignment ||
+			e.properties != exp.properties || e.memTypeBits != exp.memTypeBits)
+		{
+			return false;
+		}
+		lastTime = e.timeNs;
+	}
+
+	return true;
+}
+
+bool memoryResourceArenaAndPool()
+{
+	// Arena : containers grow through several blocks, then everything is freed at once
+	ArenaMemoryResource arena(4096);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		std::pmr::vector< uint32_t > ints(&arena);
+		std::pmr::vector< std::pmr::vector< char > > strings(&arena);
+		for (uint32_t i = 0; i < 5000; ++i)
+		{
+			ints.push_back(i);
+			strings.emplace_back(randNum(1, 100), 'a');
+		}
+		for (uint32_t i = 0; i < 5000; ++i)
+		{
+			if (ints[i] != i || strings[i].get_allocator().resource() != &arena)
+			{
+				return false;
+			}
+		}
+		void* aligned = arena.allocate(64, 256);
+		if (reinterpret_cast<uintptr_t>(aligned) % 256 != 0 || arena.usedBytes() > arena.reservedBytes())
+		{
+			return false;
+		}
+
+		ints = {};
+		strings = {};
+		arena.reset();
+		if (arena.usedBytes() != 0)
+		{
+			return false;
+		}
+	}
+
+	// Pool : random allocations and frees, including some bigger than a block
+	return forEachBackend([&](MemoryPool::Backend backend)
+	{
+		PoolMemoryResource pool(64 * 1024, backend);
+		std::vector< ResourceAlloc > allocs;
+		for (int i = 0; i < 2000; ++i)
+		{
+			if (!allocs.empty() && randNum(0, 2) == 0)
+			{
+				const size_t idx = randNum(0, (int)allocs.size() - 1);
+				const ResourceAlloc a = allocs[idx];
+				for (size_t j = 0; j < a.size; ++j)
+				{
+					// Overwritten by another allocation
+					if (a.ptr[j] != (uint8_t)(uintptr_t)a.ptr)
+					{
+						return false;
+					}
+				}
+				pool.deallocate(a.ptr, a.size, a.align);
+				allocs[idx] = allocs.back();
+				allocs.pop_back();
+			}
+			else
+			{
+				const size_t size = randNum(0, 20) == 0 ? randNum(64 * 1024, 256 * 1024) : randNum(1, 2048);
+				const size_t align = POSSIBLE_ALIGNMENT[randNum(0, ALIGNMENT_COUNT - 1)];
+				uint8_t* ptr = static_cast< uint8_t* >(pool.allocate(size, align));
+				if (reinterpret_cast<uintptr_t>(ptr) % align != 0)
+				{
+					return false;
+				}
+				memset(ptr, (uint8_t)(uintptr_t)ptr, size);
+				allocs.push_back(ResourceAlloc{ ptr, size, align });
+			}
+		}
+
+		for (const ResourceAlloc& a : allocs)
+		{
+			pool.deallocate(a.ptr, a.size, a.align);
+		}
+		if (pool.usedBytes() != 0)
+		{
+			return false;
+		}
+
+		return true;
+	});
+}
+
+bool memoryResourceHugePages()
+{
+	constexpr size_t hugePageSize = HugePageMemoryResource::HUGE_PAGE_SIZE;
+	for (bool prefault : { false, true })
+	{
+		HugePageMemoryResource hugePages(prefault);
+		char* block = static_cast< char* >(hugePages.allocate(hugePageSize + 1, 64));
+		if (reinterpret_cast<uintptr_t>(block) % hugePageSize != 0 || hugePages.mappedBytes() != 2 * hugePageSize)
+		{
+			return false;
+		}
+		memset(block, 0xab, hugePageSize + 1);
+		hugePages.deallocate(block, hugePageSize + 1, 64);
+
+		// Arena and pool blocks sitting on it
+		{
+			ArenaMemoryResource arena(4 * hugePageSize, &hugePages);
+			PoolMemoryResource pool(hugePageSize, MemoryPool::Backend::TLSF, &hugePages);
+			std::pmr::vector< uint64_t > arenaValues(&arena);
+			std::pmr::vector< uint64_t > poolValues(&pool);
+			for (uint64_t i = 0; i < 100000; ++i)
+			{
+				arenaValues.push_back(i);
+				poolValues.push_back(i);
+			}
+			if (arenaValues.back() != 99999 || poolValues.back() != 99999 || hugePages.mappedBytes() == 0)
+			{
+				return false;
+			}
+		}
+
+		if (hugePages.mappedBytes() != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool memoryConcurrentAllocsFromThreads()
+{
+	constexpr uint64_t size = 16 * 1024 * 1024;
+	constexpr int threadCount = 4;
+	ConcurrentMemoryPool pool(size);
+
+	// Each thread keeps some allocations alive, the others are freed right away.
+	// Some of them are too big to be cached and go to the shared pool.
+	std::vector< std::vector< ConcurrentMemoryPool::Allocation > > liveAllocs(threadCount);
+	std::vector< std::vector< uint64_t > > liveSizes(threadCount);
+	std::vector< std::thread > threads;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		const auto seed = randNum(0, 1 << 30);
+		threads.emplace_back([&pool, &liveAllocs, &liveSizes, t, seed]() {
+			std::mt19937 threadRng(seed);
+			std::uniform_int_distribution<uint64_t> sizeDist(1, 64 * 1024);
+			for (int i = 0; i < 500; ++i)
+			{
+				const uint64_t allocSize = sizeDist(threadRng);
+				const auto alloc = pool.alloc(allocSize, POSSIBLE_ALIGNMENT[threadRng() % ALIGNMENT_COUNT]);
+				if (alloc.handle == ConcurrentMemoryPool::INVALID_HANDLE)
+					continue;
+				if (threadRng() % 2)
+				{
+					pool.free(alloc);
+				}
+				else
+				{
+					liveAllocs[t].push_back(alloc);
+					liveSizes[t].push_back(allocSize);
+				}
+			}
+			pool.flushThreadCache();
+		});
+	}
+	for (auto& th : threads)
+	{
+		th.join();
+	}
+
+	// No two live allocations can overlap.
+	std::vector< std::pair< uint64_t, uint64_t > > ranges;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		for (size_t i = 0; i < liveAllocs[t].size(); ++i)
+		{
+			ranges.emplace_back(liveAllocs[t][i].offset, liveAllocs[t][i].offset + liveSizes[t][i]);
+		}
+	}
+	std::sort(ranges.begin(), ranges.end());
+	for (size_t i = 1; i < ranges.size(); ++i)
+	{
+		if (ranges[i].first < ranges[i - 1].second)
+			return false;
+	}
+
+	// Free everything from other threads, then give the cached blocks back.
+	threads.clear();
+	for (int t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([&pool, &liveAllocs, t]() {
+			for (const auto& alloc : liveAllocs[(t + 1) % threadCount])
+			{
+				pool.free(alloc);
+			}
+			pool.flushThreadCache();
+		});
+	}
+	for (auto& th : threads)
+	{
+		th.join();
+	}
+	pool.flushThreadCache();
+
+	return pool.spaceLeft() == size && pool._debugIsConform();
+}
+
 bool threadPoolTest()
 {
 	ThreadPool pool(std::thread::hardware_concurrency());
@@ -159,6 +766,106 @@ bool threadPoolTest()
 	return true;
 }
 
+bool threadPoolNestedJobs()
+{
+	// Jobs added from a worker go to its own deque and are stolen by the others
+	constexpr int outerCount = 64;
+	constexpr int innerCount = 100;
+	std::atomic<int> count(0);
+	{
+		ThreadPool pool(std::thread::hardware_concurrency());
+		std::vector< std::future<void> > res(outerCount);
+		for (int i = 0; i < outerCount; ++i)
+		{
+			res[i] = pool.addJob([&pool, &count]() {
+				for (int j = 0; j < innerCount; ++j)
+				{
+					pool.addJob([&count]() { ++count; });
+				}
+			});
+		}
+		for (auto& r : res)
+		{
+			r.get();
+		}
+		while (count < outerCount * innerCount)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	return count == outerCount * innerCount;
+}
+
+bool threadPoolSubmitWithCounter()
+{
+	// Fire and forget jobs, waited with a counter from inside a job and from outside
+	constexpr int outerCount = 32;
+	constexpr int innerCount = 64;
+	std::atomic<int> sum(0);
+	ThreadPool pool(std::thread::hardware_concurrency());
+	ThreadPool::JobCounter counter;
+	for (int i = 0; i < outerCount; ++i)
+	{
+		pool.submit(counter, [&pool, &sum](int value) {
+			ThreadPool::JobCounter inner;
+			for (int j = 0; j < innerCount; ++j)
+			{
+				pool.submit(inner, [&sum, value]() { sum += value; });
+			}
+			pool.wait(inner);
+		}, i);
+	}
+	pool.wait(counter);
+
+	return counter.done() && sum == innerCount * (outerCount * (outerCount - 1) / 2);
+}
+
+bool threadPoolParallelAlgorithms()
+{
+	ThreadPool pool(std::thread::hardware_concurrency());
+	const size_t count = randNum(0, 100000);
+	std::vector<int64_t> values(count);
+	for (auto& v : values)
+	{
+		v = randNum(0, 1000);
+	}
+
+	std::vector<int64_t> doubled(count);
+	parallelFor(pool, 0, count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			doubled[i] = values[i] * 2;
+		}
+	}, randNum(0, 64));
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (doubled[i] != values[i] * 2)
+			return false;
+	}
+
+	const int64_t sum = parallelReduce(pool, 0, count, int64_t(0),
+		[&](size_t begin, size_t end) {
+			return std::accumulate(values.begin() + begin, values.begin() + end, int64_t(0));
+		},
+		[](int64_t a, int64_t b) { return a + b; });
+	if (sum != std::accumulate(values.begin(), values.end(), int64_t(0)))
+		return false;
+
+	std::vector<int64_t> scanned(count);
+	std::vector<int64_t> expectedScan(count);
+	std::partial_sum(values.begin(), values.end(), expectedScan.begin());
+	parallelInclusiveScan(pool, values.begin(), values.end(), scanned.begin(), std::plus<int64_t>());
+	if (scanned != expectedScan)
+		return false;
+
+	std::vector<int64_t> expectedSort = values;
+	std::sort(expectedSort.begin(), expectedSort.end());
+	parallelSort(pool, values.begin(), values.end());
+
+	return values == expectedSort;
+}
+
 template<typename FUNC>
 bool Test(FUNC f, const char* fctName)
 {
@@ -190,7 +897,21 @@ int main()
 		success &= TEST(memoryRandomAllocsRandomAlign);
 		success &= TEST(memoryRandomAllocsRandomAlignRandomFree);
 		success &= TEST(memoryExactFit);
+		success &= TEST(memoryFirstFitRandomAllocsRandomFree);
+		success &= TEST(memoryTlsfAlignedAllocInHole);
+		success &= TEST(memoryHandlesOutliveChunkReserve);
+		success &= TEST(memoryBuddyRandomAllocsRandomFree);
+		success &= TEST(memoryBuddyMergesBack);
+		success &= TEST(memoryPoolGrowShrinkInPlace);
+		success &= TEST(memoryPoolStats);
+		success &= TEST(memoryTraceRoundTrip);
+		success &= TEST(memoryResourceArenaAndPool);
+		success &= TEST(memoryResourceHugePages);
+		success &= TEST(memoryConcurrentAllocsFromThreads);
 		success &= TEST(threadPoolTest);
+		success &= TEST(threadPoolNestedJobs);
+		success &= TEST(threadPoolSubmitWithCounter);
+		success &= TEST(threadPoolParallelAlgorithms);
 	}
 
 	if (success)
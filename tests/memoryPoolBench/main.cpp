@@ -0,0 +1,85 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../../app/MemoryPool.h"
+
+// Compares the MemoryPool backends on a streaming-like workload of medium and
+// large resources: allocations are kept alive for a while and freed in random order.
+struct BenchResult
+{
+	int elapsedMs;
+	size_t failedAllocs;
+	uint64_t spaceLeft;
+};
+
+static BenchResult runBench(MemoryPool::Backend backend, size_t allocCount, size_t liveCount)
+{
+	constexpr uint64_t poolSize = 2ull * 1024 * 1024 * 1024;
+	static constexpr uint64_t ALIGNMENTS[] = { 256, 1024, 4096, 65536 };
+
+	std::mt19937 rng;
+	rng.seed(123456);
+	// Mostly medium sized buffers, with a few big render targets
+	std::uniform_int_distribution<uint64_t> mediumSize(4 * 1024, 1024 * 1024);
+	std::uniform_int_distribution<uint64_t> largeSize(4 * 1024 * 1024, 32 * 1024 * 1024);
+	std::uniform_int_distribution<int> percent(0, 99);
+	std::uniform_int_distribution<int> alignIdx(0, 3);
+
+	MemoryPool pool(poolSize, liveCount, backend);
+	std::vector<MemoryPool::Handle> live;
+	live.reserve(liveCount);
+
+	BenchResult res = {};
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < allocCount; ++i)
+	{
+		if (live.size() >= liveCount)
+		{
+			std::uniform_int_distribution<size_t> toFree(0, live.size() - 1);
+			const size_t idx = toFree(rng);
+			pool.free(live[idx]);
+			live[idx] = live.back();
+			live.pop_back();
+		}
+
+		const uint64_t size = percent(rng) < 5 ? largeSize(rng) : mediumSize(rng);
+		const MemoryPool::Handle handle = pool.alloc(size, ALIGNMENTS[alignIdx(rng)]);
+		if (handle == MemoryPool::INVALID_HANDLE)
+			++res.failedAllocs;
+		else
+			live.push_back(handle);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	res.elapsedMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	res.spaceLeft = pool.spaceLeft();
+	return res;
+}
+
+int main()
+{
+	constexpr size_t allocCount = 200000;
+	constexpr size_t liveCount = 1000;
+
+	const struct
+	{
+		MemoryPool::Backend backend;
+		const char* name;
+	} backends[] = {
+		{ MemoryPool::Backend::FIRST_FIT, "first fit" },
+		{ MemoryPool::Backend::TLSF, "tlsf" },
+		{ MemoryPool::Backend::BUDDY, "buddy" },
+	};
+
+	for (const auto& b : backends)
+	{
+		const BenchResult res = runBench(b.backend, allocCount, liveCount);
+		std::cout << b.name << " : " << res.elapsedMs << "ms, " << res.failedAllocs
+			<< " failed allocations, " << res.spaceLeft / (1024 * 1024) << "MB left\n";
+	}
+
+	char a;
+	std::cin >> a;
+}
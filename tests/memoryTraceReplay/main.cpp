@@ -0,0 +1,274 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "../../app/MemoryPool.h"
+#include "../../app/MemoryTrace.h"
+
+// Replays an allocation trace recorded by VMemoryManager (MVP_MEMORY_TRACE) against
+// each MemoryPool backend. Pools are created like VMemoryManager does with its default
+// policy: one list of fixed size pools per memory type, and a device memory of their own
+// for the big requests.
+//
+// Usage : memoryTraceReplay [trace file]. Without a file, a synthetic trace is recorded first.
+static constexpr int FRAGMENTATION_SAMPLES = 10;
+static constexpr uint64_t POOL_SIZE = 256 * 1024 * 1024;
+static constexpr uint64_t DEDICATED_THRESHOLD = 32 * 1024 * 1024;
+static constexpr uint32_t DEDICATED = ~0u;
+
+struct ReplayResult
+{
+	int elapsedUs;
+	size_t failedAllocs;
+	size_t failedGrows;
+	uint64_t peakDeviceBytes;
+	uint64_t peakUsedBytes;
+	float fragmentation[FRAGMENTATION_SAMPLES];
+};
+
+class PoolSet
+{
+public:
+	explicit PoolSet(MemoryPool::Backend backend) : _backend(backend) {}
+
+	bool alloc(const MemoryTrace::Event& event, uint32_t& poolIdx, MemoryPool::Handle& handle)
+	{
+		if (event.size >= DEDICATED_THRESHOLD)
+		{
+			poolIdx = DEDICATED;
+			_deviceBytes += event.size;
+			_usedBytes += event.size;
+			return true;
+		}
+
+		auto& pools = _pools[std::make_pair(event.properties, event.memTypeBits)];
+		for (poolIdx = 0; poolIdx < pools.size(); ++poolIdx)
+		{
+			handle = pools[poolIdx]->alloc(event.size, event.alignment);
+			if (handle != MemoryPool::INVALID_HANDLE)
+			{
+				_usedBytes += event.size;
+				return true;
+			}
+		}
+
+		pools.push_back(std::make_unique<MemoryPool>(POOL_SIZE, 256, _backend));
+		_deviceBytes += POOL_SIZE;
+
+		handle = pools.back()->alloc(event.size, event.alignment);
+		if (handle == MemoryPool::INVALID_HANDLE)
+			return false;
+		_usedBytes += event.size;
+		return true;
+	}
+
+	void free(const MemoryTrace::Event& allocEvent, uint32_t poolIdx, MemoryPool::Handle handle, uint64_t size)
+	{
+		if (poolIdx == DEDICATED)
+		{
+			_deviceBytes -= size;
+			_usedBytes -= size;
+			return;
+		}
+
+		_pools[std::make_pair(allocEvent.properties, allocEvent.memTypeBits)][poolIdx]->free(handle);
+		_usedBytes -= size;
+	}
+
+	// In place, like VMemoryManager. Returns false if the allocation cannot grow here.
+	bool resize(const MemoryTrace::Event& allocEvent, uint32_t poolIdx, MemoryPool::Handle& handle, uint64_t size, uint64_t newSize)
+	{
+		if (poolIdx == DEDICATED)
+		{
+			if (newSize > size)
+				return false;
+			_usedBytes -= size - newSize;
+			return true;
+		}
+
+		MemoryPool& pool = *_pools[std::make_pair(allocEvent.properties, allocEvent.memTypeBits)][poolIdx];
+		if (newSize > size)
+		{
+			if (!pool.tryGrow(handle, newSize))
+				return false;
+		}
+		else
+		{
+			pool.shrink(handle, newSize);
+		}
+		_usedBytes = _usedBytes - size + newSize;
+		return true;
+	}
+
+	// 1 - largest free blocks / free bytes, over every pool
+	float fragmentation() const
+	{
+		uint64_t freeBytes = 0, largestFree = 0;
+		MemoryPool::Stats stats;
+		for (const auto& pools : _pools)
+		{
+			for (const auto& pool : pools.second)
+			{
+				pool->getStats(stats);
+				freeBytes += stats.freeBytes;
+				largestFree += stats.largestFreeBlock;
+			}
+		}
+		return freeBytes ? 1.0f - largestFree / float(freeBytes) : 0.0f;
+	}
+
+	uint64_t deviceBytes() const { return _deviceBytes; }
+	uint64_t usedBytes() const { return _usedBytes; }
+
+private:
+	const MemoryPool::Backend _backend;
+	std::map< std::pair<uint32_t, uint32_t>, std::vector< std::unique_ptr<MemoryPool> > > _pools;
+	uint64_t _deviceBytes = 0;
+	uint64_t _usedBytes = 0;
+};
+
+static ReplayResult replay(const std::vector<MemoryTrace::Event>& events, MemoryPool::Backend backend, bool sample)
+{
+	struct Live
+	{
+		size_t eventIdx;
+		uint32_t poolIdx;
+		MemoryPool::Handle handle;
+		uint64_t size;
+	};
+	std::unordered_map<uint32_t, Live> live;
+	live.reserve(events.size());
+
+	PoolSet pools(backend);
+	ReplayResult res = {};
+	const size_t sampleEvery = std::max<size_t>(events.size() / FRAGMENTATION_SAMPLES, 1);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const MemoryTrace::Event& event = events[i];
+		if (event.type == MemoryTrace::EventType::ALLOC)
+		{
+			Live l = { i, 0, MemoryPool::INVALID_HANDLE, event.size };
+			if (pools.alloc(event, l.poolIdx, l.handle))
+				live[event.id] = l;
+			else
+				++res.failedAllocs;
+		}
+		else if (event.type == MemoryTrace::EventType::RESIZE)
+		{
+			auto it = live.find(event.id);
+			if (it != live.end())
+			{
+				Live& l = it->second;
+				if (pools.resize(events[l.eventIdx], l.poolIdx, l.handle, l.size, event.size))
+					l.size = event.size;
+				else
+					++res.failedGrows;
+			}
+		}
+		else
+		{
+			auto it = live.find(event.id);
+			if (it != live.end())
+			{
+				pools.free(events[it->second.eventIdx], it->second.poolIdx, it->second.handle, it->second.size);
+				live.erase(it);
+			}
+		}
+
+		if (sample)
+		{
+			res.peakDeviceBytes = std::max(res.peakDeviceBytes, pools.deviceBytes());
+			res.peakUsedBytes = std::max(res.peakUsedBytes, pools.usedBytes());
+			if (i % sampleEvery == 0 && i / sampleEvery < FRAGMENTATION_SAMPLES)
+				res.fragmentation[i / sampleEvery] = pools.fragmentation();
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	res.elapsedUs = (int)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	return res;
+}
+
+// Streaming-like pattern : buffers and textures loaded and unloaded in random order.
+static void recordSyntheticTrace(const std::string& path)
+{
+	constexpr size_t allocCount = 100000;
+	constexpr size_t liveCount = 2000;
+	constexpr uint32_t DEVICE_LOCAL = 1;
+	constexpr uint32_t HOST_VISIBLE = 2 | 4;
+
+	std::mt19937 rng;
+	rng.seed(123456);
+	std::uniform_int_distribution<uint64_t> smallSize(256, 64 * 1024);
+	std::uniform_int_distribution<uint64_t> mediumSize(64 * 1024, 4 * 1024 * 1024);
+	std::uniform_int_distribution<int> percent(0, 99);
+
+	MemoryTrace::Writer writer(path);
+	std::vector<uint32_t> live;
+	for (size_t i = 0; i < allocCount; ++i)
+	{
+		if (live.size() >= liveCount)
+		{
+			std::uniform_int_distribution<size_t> toFree(0, live.size() - 1);
+			const size_t idx = toFree(rng);
+			writer.recordFree(live[idx]);
+			live[idx] = live.back();
+			live.pop_back();
+		}
+
+		const bool isStaging = percent(rng) < 20;
+		const uint64_t size = percent(rng) < 70 ? smallSize(rng) : mediumSize(rng);
+		live.push_back(writer.recordAlloc(size, isStaging ? 4 : 256, isStaging ? HOST_VISIBLE : DEVICE_LOCAL, 0xff));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string path = argc > 1 ? argv[1] : "memoryTrace.bin";
+	if (argc <= 1)
+	{
+		std::cout << "No trace given, recording a synthetic one in " << path << "\n";
+		recordSyntheticTrace(path);
+	}
+
+	std::vector<MemoryTrace::Event> events;
+	if (!MemoryTrace::read(path, events))
+	{
+		std::cout << "Cannot read trace " << path << "\n";
+		return 1;
+	}
+	std::cout << events.size() << " events\n";
+
+	const struct
+	{
+		MemoryPool::Backend backend;
+		const char* name;
+	} backends[] = {
+		{ MemoryPool::Backend::FIRST_FIT, "first fit" },
+		{ MemoryPool::Backend::TLSF, "tlsf" },
+		{ MemoryPool::Backend::BUDDY, "buddy" },
+	};
+
+	for (const auto& b : backends)
+	{
+		// Time a first run, then replay again to gather the memory usage.
+		const ReplayResult timed = replay(events, b.backend, false);
+		const ReplayResult res = replay(events, b.backend, true);
+
+		std::cout << b.name << " : " << timed.elapsedUs / 1000 << "ms, "
+			<< (uint64_t)(events.size() / (std::max(timed.elapsedUs, 1) / 1e6)) << " ops/s, "
+			<< res.failedAllocs << " failed allocations, " << res.failedGrows << " failed grows, peak "
+			<< res.peakDeviceBytes / (1024 * 1024) << "MB device memory for "
+			<< res.peakUsedBytes / (1024 * 1024) << "MB used\n";
+		std::cout << "   fragmentation over time :";
+		for (float f : res.fragmentation)
+			std::cout << " " << f;
+		std::cout << "\n";
+	}
+}
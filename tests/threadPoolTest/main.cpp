@@ -40,6 +40,24 @@ int main()
 
 	std::cout << "Time elapsed = " << elapsed_seconds << "ms\n";
 
+	// Jobs doing almost nothing, to measure the cost of the pool itself
+	constexpr size_t tinyJobCount = 2000000;
+	std::atomic<size_t> tinySum(0);
+	start = std::chrono::system_clock::now();
+	{
+		ThreadPool pool(std::thread::hardware_concurrency());
+		ThreadPool::JobCounter counter;
+		for (size_t i = 0; i < tinyJobCount; ++i)
+		{
+			pool.submit(counter, [&tinySum]() { tinySum.fetch_add(1, std::memory_order_relaxed); });
+		}
+		pool.wait(counter);
+	}
+	end = std::chrono::system_clock::now();
+	elapsed_seconds = std::chrono::duration_cast<std::chrono::milliseconds>
+		(end - start).count();
+	std::cout << tinySum << " tiny jobs in " << elapsed_seconds << "ms\n";
+
 	size_t finalRes = res[0].get();
 	for (size_t i = 1; i < res.size(); ++i)
 	{
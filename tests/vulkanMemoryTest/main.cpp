@@ -0,0 +1,386 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../../app/vkUtils.h"
+#include "../../app/vMemoryPool.h"
+#include "../../app/vBufferArena.h"
+#include "../../app/vResizableBuffer.h"
+#include "../../app/vDefragmenter.h"
+#include "../../app/vCommandPool.h"
+
+// Tests of the device memory classes needing a Vulkan device. They run on the first
+// device found, without any window. Nothing is run if there is no device.
+static VDeleter<VkInstance> instance{ vkDestroyInstance };
+static VDeleter<VkDevice> device{ vkDestroyDevice };
+static VkPhysicalDevice physDevice = VK_NULL_HANDLE;
+static uint32_t queueFamily = 0;
+static VkQueue queue = VK_NULL_HANDLE;
+
+static bool createDevice()
+{
+	VkApplicationInfo appInfo = {};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = "vulkanMemoryTest";
+	appInfo.apiVersion = VK_API_VERSION_1_0;
+
+	VkInstanceCreateInfo instanceInfo = {};
+	instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instanceInfo.pApplicationInfo = &appInfo;
+	if (vkCreateInstance(&instanceInfo, nullptr, &instance) != VK_SUCCESS)
+	{
+		return false;
+	}
+
+	uint32_t deviceCount = 1;
+	if (vkEnumeratePhysicalDevices(instance, &deviceCount, &physDevice) < 0 || deviceCount == 0)
+	{
+		return false;
+	}
+
+	// The copies go through a graphic queue, which can always do transfers
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physDevice, &familyCount, nullptr);
+	std::vector< VkQueueFamilyProperties > families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physDevice, &familyCount, families.data());
+	while (queueFamily < familyCount && !(families[queueFamily].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+	{
+		++queueFamily;
+	}
+	if (queueFamily == familyCount)
+	{
+		return false;
+	}
+
+	const float priority = 1.0f;
+	VkDeviceQueueCreateInfo queueInfo = {};
+	queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queueInfo.queueFamilyIndex = queueFamily;
+	queueInfo.queueCount = 1;
+	queueInfo.pQueuePriorities = &priority;
+
+	VkDeviceCreateInfo deviceInfo = {};
+	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	deviceInfo.queueCreateInfoCount = 1;
+	deviceInfo.pQueueCreateInfos = &queueInfo;
+	if (vkCreateDevice(physDevice, &deviceInfo, nullptr, &device) != VK_SUCCESS)
+	{
+		return false;
+	}
+	vkGetDeviceQueue(device, queueFamily, 0, &queue);
+	return true;
+}
+
+static VkMemoryRequirements createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer)
+{
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	VK_CALL(vkCreateBuffer(device, &bufferInfo, nullptr, &buffer));
+
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(device, buffer, &requirements);
+	return requirements;
+}
+
+static void copyRange(VkCommandBuffer cmdBuffer, VkBuffer src, VkDeviceSize srcOffset, VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size)
+{
+	VkBufferCopy region = {};
+	region.srcOffset = srcOffset;
+	region.dstOffset = dstOffset;
+	region.size = size;
+	vkCmdCopyBuffer(cmdBuffer, src, dst, 1, &region);
+}
+
+static void submitAndWait(VkCommandBuffer cmdBuffer)
+{
+	VK_CALL(vkEndCommandBuffer(cmdBuffer));
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cmdBuffer;
+	VK_CALL(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+	VK_CALL(vkQueueWaitIdle(queue));
+}
+
+bool defragmenterSkipsBatches()
+{
+	constexpr VkDeviceSize size = 64 * 1024;
+	constexpr VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	VMemoryManager memoryManager(physDevice, device);
+	VCommandPool commandPool;
+	commandPool.init(device, 1, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily);
+
+	// The batch is placed after a buffer which is then freed, so it could go lower in its pool
+	VkBuffer filler;
+	VMemAlloc fillerAlloc = memoryManager.alloc(createBuffer(4 * size, usage, filler), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	VkBuffer buffers[2];
+	const std::vector< VkMemoryRequirements > requirements = { createBuffer(size, usage, buffers[0]), createBuffer(size, usage, buffers[1]) };
+	std::vector< VMemAlloc > batch = memoryManager.allocBatch(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	for (int i = 0; i < 2; ++i)
+	{
+		VK_CALL(vkBindBufferMemory(device, buffers[i], batch[i].memory, batch[i].offset));
+	}
+	vkDestroyBuffer(device, filler, nullptr);
+	memoryManager.free(fillerAlloc);
+
+	bool moved = false;
+	VDefragmenter defragmenter(device, memoryManager, 1);
+	const uint32_t id = defragmenter.registerBuffer(buffers[0], size, usage, batch[0], [&moved](VkBuffer, const VMemAlloc&) { moved = true; });
+	VkCommandBuffer cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	const uint64_t movedBytes = defragmenter.recordMoves(cmdBuffer, ~0ull);
+	vkEndCommandBuffer(cmdBuffer);
+	defragmenter.completeMoves();
+	defragmenter.unregister(id);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		vkDestroyBuffer(device, buffers[i], nullptr);
+		memoryManager.free(batch[i]);
+	}
+	return movedBytes == 0 && !moved && !defragmenter.hasPendingMoves();
+}
+
+bool optimalImagesHaveTheirOwnPools()
+{
+	VMemoryManager memoryManager(physDevice, device);
+
+	// From the slabs and from the pools
+	bool success = true;
+	for (VkDeviceSize size : { VkDeviceSize(1024), VkDeviceSize(64 * 1024) })
+	{
+		VkMemoryRequirements requirements = {};
+		requirements.size = size;
+		requirements.alignment = 256;
+		requirements.memoryTypeBits = ~0u;
+		VMemAlloc buffer = memoryManager.alloc(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		VMemAlloc image = memoryManager.allocForOptimalImages(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		success &= buffer.memory != image.memory;
+		memoryManager.free(buffer);
+		memoryManager.free(image);
+	}
+	return success;
+}
+
+bool arenaBlocksMoveWhole()
+{
+	constexpr VkDeviceSize blockSize = 64 * 1024;
+	constexpr VkDeviceSize size = 1024;
+	constexpr VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	VMemoryManager memoryManager(physDevice, device);
+	VDefragmenter defragmenter(device, memoryManager, 1);
+	VCommandPool commandPool;
+	commandPool.init(device, 1, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily);
+	VBufferArena staging(device, memoryManager);
+	staging.init(usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, blockSize);
+	VBufferArena arena(device, memoryManager);
+	arena.init(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, blockSize);
+	arena.enableDefragmentation(defragmenter);
+
+	// The block is placed after a buffer which is then freed, so it can go lower in its pool
+	VkBuffer filler;
+	VMemAlloc fillerAlloc = memoryManager.alloc(createBuffer(4 * blockSize, usage, filler), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	VBufferRange range = arena.alloc(size, 16);
+
+	// The blocks are allocations of the manager
+	VMemoryManager::Stats stats;
+	memoryManager.getStats(stats);
+	bool success = stats.usedBytes >= 5 * blockSize;
+
+	VBufferRange upload = staging.alloc(size, 16);
+	for (VkDeviceSize i = 0; i < size; ++i)
+	{
+		static_cast<uint8_t*>(upload.data)[i] = static_cast<uint8_t>(i * 7);
+	}
+	VkCommandBuffer cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, upload.buffer, upload.offset, arena.buffer(range), range.offset, size);
+	submitAndWait(cmdBuffer);
+
+	vkDestroyBuffer(device, filler, nullptr);
+	memoryManager.free(fillerAlloc);
+
+	const VkBuffer oldBuffer = arena.buffer(range);
+	cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	const uint64_t movedBytes = defragmenter.recordMoves(cmdBuffer, ~0ull);
+	submitAndWait(cmdBuffer);
+	defragmenter.completeMoves();
+	success &= movedBytes >= blockSize && arena.buffer(range) != oldBuffer;
+
+	// The range is read back through the new buffer of the block
+	VBufferRange readback = staging.alloc(size, 16);
+	cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, arena.buffer(range), range.offset, readback.buffer, readback.offset, size);
+	submitAndWait(cmdBuffer);
+	success &= memcmp(upload.data, readback.data, size) == 0;
+
+	staging.free(upload);
+	staging.free(readback);
+	arena.free(range);
+	return success;
+}
+
+// Fills the buffer through 'upload', resizes it to 'newSize' and reads its content back
+// through 'readback'. Returns whether it was resized in place, and sets 'preserved'.
+static bool resizeAndCheck(VMemoryManager& memoryManager, VCommandPool& commandPool, VResizableBuffer& buffer, VkDeviceSize newSize, const VBufferRange& upload, const VBufferRange& readback, bool& preserved)
+{
+	for (VkDeviceSize i = 0; i < upload.size; ++i)
+	{
+		static_cast<uint8_t*>(upload.data)[i] = static_cast<uint8_t>(i * 7);
+	}
+	VkCommandBuffer cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, upload.buffer, upload.offset, buffer.buffer, 0, upload.size);
+	submitAndWait(cmdBuffer);
+	commandPool.free(cmdBuffer);
+
+	const bool inPlace = resizeBuffer(device, memoryManager, commandPool, queue, buffer, newSize);
+
+	cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, buffer.buffer, 0, readback.buffer, readback.offset, readback.size);
+	submitAndWait(cmdBuffer);
+	commandPool.free(cmdBuffer);
+	preserved = buffer.size == newSize && memcmp(upload.data, readback.data, readback.size) == 0;
+	return inPlace;
+}
+
+bool resizableBufferGrowsInPlace()
+{
+	constexpr VkDeviceSize size = 64 * 1024;
+	VMemoryManager memoryManager(physDevice, device);
+	VCommandPool commandPool;
+	commandPool.init(device, 1, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily);
+	VBufferArena staging(device, memoryManager);
+	staging.init(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 4 * size);
+	VBufferRange upload = staging.alloc(size, 16);
+	VBufferRange readback = staging.alloc(size, 16);
+
+	// Nothing is allocated after the buffer, so it can grow in place
+	VResizableBuffer buffer(device);
+	createResizableBuffer(device, memoryManager, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, buffer);
+	const VMemAlloc oldMemory = buffer.memory;
+
+	bool preserved = false;
+	const bool inPlace = resizeAndCheck(memoryManager, commandPool, buffer, 4 * size, upload, readback, preserved);
+	bool success = inPlace && preserved && buffer.memory.memory == oldMemory.memory && buffer.memory.offset == oldMemory.offset;
+
+	// Shrinking stays in place too
+	success &= resizeAndCheck(memoryManager, commandPool, buffer, size, upload, readback, preserved) && preserved;
+
+	freeResizableBuffer(memoryManager, buffer);
+	staging.free(upload);
+	staging.free(readback);
+	return success;
+}
+
+bool resizableBufferCopiesWhenBlocked()
+{
+	constexpr VkDeviceSize size = 64 * 1024;
+	VMemoryManager memoryManager(physDevice, device);
+	VCommandPool commandPool;
+	commandPool.init(device, 1, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily);
+	VBufferArena staging(device, memoryManager);
+	staging.init(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 4 * size);
+	VBufferRange upload = staging.alloc(size, 16);
+	VBufferRange readback = staging.alloc(size, 16);
+
+	// The memory right after the buffer is used, so growing it needs a copy
+	VResizableBuffer buffer(device);
+	createResizableBuffer(device, memoryManager, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, buffer);
+	VkBuffer blocker;
+	VMemAlloc blockerAlloc = memoryManager.alloc(createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, blocker), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	const VMemAlloc oldMemory = buffer.memory;
+
+	bool preserved = false;
+	const bool inPlace = resizeAndCheck(memoryManager, commandPool, buffer, 4 * size, upload, readback, preserved);
+	const bool success = !inPlace && preserved && (buffer.memory.memory != oldMemory.memory || buffer.memory.offset != oldMemory.offset);
+
+	vkDestroyBuffer(device, blocker, nullptr);
+	memoryManager.free(blockerAlloc);
+	freeResizableBuffer(memoryManager, buffer);
+	staging.free(upload);
+	staging.free(readback);
+	return success;
+}
+
+bool arenaBlocksGrow()
+{
+	constexpr VkDeviceSize blockSize = 64 * 1024;
+	constexpr VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	VMemoryManager memoryManager(physDevice, device);
+	VCommandPool commandPool;
+	commandPool.init(device, 1, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily);
+	VBufferArena staging(device, memoryManager);
+	staging.init(usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 2 * blockSize);
+	VBufferRange upload = staging.alloc(blockSize, 16);
+	VBufferRange readback = staging.alloc(blockSize, 16);
+	for (VkDeviceSize i = 0; i < blockSize; ++i)
+	{
+		static_cast<uint8_t*>(upload.data)[i] = static_cast<uint8_t>(i * 7);
+	}
+
+	VBufferArena arena(device, memoryManager);
+	arena.init(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, blockSize);
+	arena.enableGrowth(4 * blockSize, commandPool, queue);
+	VBufferRange first = arena.alloc(blockSize, 16);
+	VkCommandBuffer cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, upload.buffer, upload.offset, arena.buffer(first), first.offset, blockSize);
+	submitAndWait(cmdBuffer);
+	commandPool.free(cmdBuffer);
+
+	// The second range does not fit in the block, which grows instead of adding a new one
+	VBufferRange second = arena.alloc(blockSize, 16);
+	bool success = second.block == first.block && arena.totalBytes() == 2 * blockSize;
+
+	cmdBuffer = commandPool.alloc(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	copyRange(cmdBuffer, arena.buffer(first), first.offset, readback.buffer, readback.offset, blockSize);
+	submitAndWait(cmdBuffer);
+	commandPool.free(cmdBuffer);
+	success &= memcmp(upload.data, readback.data, blockSize) == 0;
+
+	// Once empty, the block goes back to its initial size
+	arena.free(first);
+	arena.free(second);
+	arena.releaseEmptyBlocks();
+	success &= arena.totalBytes() == blockSize;
+
+	staging.free(upload);
+	staging.free(readback);
+	return success;
+}
+
+template<typename FUNC>
+bool Test(FUNC f, const char* fctName)
+{
+	if (f())
+	{
+		printf("Test function %s passed.\n", fctName);
+		return true;
+	}
+	else
+	{
+		printf("%s FAILED.\n", fctName);
+		return false;
+	}
+}
+
+#define TEST(x) Test( (x), #x );
+
+int main()
+{
+	if (!createDevice())
+	{
+		std::cout << "No Vulkan device, skipping the tests" << std::endl;
+		return 0;
+	}
+
+	bool success = true;
+	success &= TEST(defragmenterSkipsBatches);
+	success &= TEST(optimalImagesHaveTheirOwnPools);
+	success &= TEST(arenaBlocksMoveWhole);
+	success &= TEST(resizableBufferGrowsInPlace);
+	success &= TEST(resizableBufferCopiesWhenBlocked);
+	success &= TEST(arenaBlocksGrow);
+	return success ? 0 : 1;
+}